@@ -0,0 +1,238 @@
+// Copyright 2019 NSONE, Inc
+
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+
+#include "capacity.h"
+
+constexpr double CapacitySearch::PRECISION;
+constexpr double CapacitySearch::CLIENT_BOUND;
+
+// report columns, in CSV order
+static const std::vector<std::string> COLUMNS{"qps", "achieved_qps", "received_qps", "loss_pct", "timeouts",
+    "mean_ms", "p50_ms", "p90_ms", "p99_ms", "p99.9_ms", "p99.99_ms", "max_ms"};
+
+void StepStats::add(const PeriodStats &stats)
+{
+    _s_count += stats.s_count;
+    _r_count += stats.r_count - stats.bad_count;
+    _timeouts += stats.timeouts;
+    _latency.merge(stats.latency);
+}
+
+void StepStats::reset()
+{
+    _s_count = _r_count = _timeouts = 0;
+    _latency.reset();
+}
+
+nlohmann::json StepStats::report(uint64_t qps, long seconds) const
+{
+    nlohmann::json j;
+    j["qps"] = qps;
+    j["achieved_qps"] = sent_qps(seconds);
+    j["received_qps"] = static_cast<double>(_r_count) / seconds;
+    j["loss_pct"] = loss_pct();
+    // timeouts only show r_timeout after the send, so these may belong to an earlier step
+    j["timeouts"] = _timeouts;
+    j["mean_ms"] = _latency.mean() * Metrics::HR_TO_MSEC_MULT;
+    j["p50_ms"] = _latency.percentile(50.0) * Metrics::HR_TO_MSEC_MULT;
+    j["p90_ms"] = _latency.percentile(90.0) * Metrics::HR_TO_MSEC_MULT;
+    j["p99_ms"] = _latency.percentile(99.0) * Metrics::HR_TO_MSEC_MULT;
+    j["p99.9_ms"] = _latency.percentile(99.9) * Metrics::HR_TO_MSEC_MULT;
+    j["p99.99_ms"] = _latency.percentile(99.99) * Metrics::HR_TO_MSEC_MULT;
+    j["max_ms"] = _latency.max() * Metrics::HR_TO_MSEC_MULT;
+    return j;
+}
+
+CapacitySearch::CapacitySearch(uint64_t start_qps, long step_periods, double max_p99_ms, double max_loss_pct,
+    rate_cb set_rate, std::function<void()> done, int verbosity)
+    : _step_periods(std::max(step_periods, 1L))
+    , _max_p99_ms(max_p99_ms)
+    , _max_loss_pct(max_loss_pct)
+    , _set_rate(std::move(set_rate))
+    , _done(std::move(done))
+    , _verbosity(verbosity)
+    , _qps(std::max<uint64_t>(start_qps, 1))
+    , _steps(nlohmann::json::array())
+{
+}
+
+void CapacitySearch::start()
+{
+    step(_qps);
+}
+
+void CapacitySearch::step(uint64_t qps)
+{
+    _qps = qps;
+    _periods = 0;
+    _stats.reset();
+    if (_verbosity) {
+        std::cout << "capacity search: trying " << _qps << " QPS" << std::endl;
+    }
+    _set_rate(_qps);
+}
+
+void CapacitySearch::period(const PeriodStats &stats)
+{
+    if (_finished) {
+        return;
+    }
+    // the first period mixes in the previous rate
+    if (_periods++ == 0) {
+        return;
+    }
+    _stats.add(stats);
+    if (_periods > _step_periods) {
+        evaluate();
+    }
+}
+
+void CapacitySearch::evaluate()
+{
+    double achieved_qps = _stats.sent_qps(_step_periods);
+    double loss_pct = _stats.loss_pct();
+    double p99_ms = _stats.latency().percentile(99.0) * Metrics::HR_TO_MSEC_MULT;
+
+    // timeouts are reported but not judged, see StepStats
+    std::string failed;
+    if (achieved_qps < _qps * CLIENT_BOUND) {
+        failed = "client could not send at this rate";
+    } else if (!_stats.answered() || p99_ms > _max_p99_ms) {
+        failed = "p99 latency";
+    } else if (loss_pct > _max_loss_pct) {
+        failed = "loss";
+    }
+    bool pass = failed.empty();
+
+    auto j = _stats.report(_qps, _step_periods);
+    j["pass"] = pass;
+    if (!pass) {
+        j["failed"] = failed;
+    }
+    _steps.push_back(j);
+    if (_verbosity) {
+        std::cout << "capacity search: " << _qps << " QPS " << (pass ? "passed" : "failed") << ", sent "
+                  << achieved_qps << " QPS, p99 " << p99_ms << " ms, loss " << loss_pct << "%";
+        if (!pass) {
+            std::cout << " (" << failed << ")";
+        }
+        std::cout << std::endl;
+    }
+
+    if (pass) {
+        _pass_qps = _qps;
+    } else {
+        _fail_qps = _qps;
+        _bisecting = true;
+    }
+    if (!_bisecting) {
+        step(_qps * 2);
+        return;
+    }
+    uint64_t gap = std::max<uint64_t>(static_cast<uint64_t>(_pass_qps * PRECISION), 1);
+    if (_fail_qps - _pass_qps <= gap) {
+        _finished = true;
+        if (_verbosity) {
+            std::cout << "capacity search: " << _pass_qps << " QPS is the highest passing rate" << std::endl;
+        }
+        _done();
+        return;
+    }
+    step(_pass_qps + (_fail_qps - _pass_qps) / 2);
+}
+
+nlohmann::json CapacitySearch::summary() const
+{
+    nlohmann::json j;
+    j["slo"] = {{"p99_ms", _max_p99_ms}, {"loss_pct", _max_loss_pct}};
+    j["step_secs"] = _step_periods;
+    j["steps"] = _steps;
+    j["finished"] = _finished;
+    j["capacity_qps"] = _pass_qps;
+    return j;
+}
+
+LoadSweep::LoadSweep(uint64_t from, uint64_t to, uint64_t step, long warmup_periods, long measure_periods, int verbosity)
+    : _warmup_periods(std::max(warmup_periods, 0L))
+    , _measure_periods(std::max(measure_periods, 1L))
+    , _verbosity(verbosity)
+    , _table(nlohmann::json::array())
+{
+    step = std::max<uint64_t>(step, 1);
+    if (from <= to) {
+        for (uint64_t qps = from; qps <= to; qps += step) {
+            _rates.push_back(qps);
+        }
+    } else {
+        for (uint64_t qps = from; qps >= to && qps > 0; qps = (qps > step) ? qps - step : 0) {
+            _rates.push_back(qps);
+        }
+    }
+}
+
+void LoadSweep::start(CapacitySearch::rate_cb set_rate, std::function<void()> done)
+{
+    _set_rate = std::move(set_rate);
+    _done = std::move(done);
+    if (_verbosity) {
+        std::cout << "sweep: " << _rates.front() << " QPS" << std::endl;
+    }
+    _set_rate(_rates.front());
+}
+
+void LoadSweep::period(const PeriodStats &stats)
+{
+    if (finished()) {
+        return;
+    }
+    if (_periods++ < _warmup_periods) {
+        return;
+    }
+    _stats.add(stats);
+    if (_periods < _warmup_periods + _measure_periods) {
+        return;
+    }
+
+    auto j = _stats.report(_rates[_row], _measure_periods);
+    _table.push_back(j);
+    if (_verbosity) {
+        std::cout << "sweep: " << _rates[_row] << " QPS measured, sent " << j["achieved_qps"].get<double>() << " QPS, loss "
+                  << j["loss_pct"].get<double>() << "%, p50/p99/p99.9 " << j["p50_ms"].get<double>() << "/"
+                  << j["p99_ms"].get<double>() << "/" << j["p99.9_ms"].get<double>() << " ms" << std::endl;
+    }
+    _row++;
+    _periods = 0;
+    _stats.reset();
+    if (finished()) {
+        _done();
+        return;
+    }
+    if (_verbosity) {
+        std::cout << "sweep: " << _rates[_row] << " QPS" << std::endl;
+    }
+    _set_rate(_rates[_row]);
+}
+
+nlohmann::json LoadSweep::table() const
+{
+    return _table;
+}
+
+std::string LoadSweep::csv() const
+{
+    std::ostringstream out;
+    for (size_t i = 0; i < COLUMNS.size(); i++) {
+        out << (i ? "," : "") << COLUMNS[i];
+    }
+    out << "\n";
+    for (const auto &row : _table) {
+        for (size_t i = 0; i < COLUMNS.size(); i++) {
+            out << (i ? "," : "") << row[COLUMNS[i]];
+        }
+        out << "\n";
+    }
+    return out.str();
+}
@@ -0,0 +1,166 @@
+// Copyright 2019 NSONE, Inc
+
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "json.hpp"
+#include "metrics.h"
+
+/**
+ * Totals of the metrics periods making up one step of a capacity search or load sweep.
+ */
+class StepStats
+{
+public:
+    void add(const PeriodStats &stats);
+
+    void reset();
+
+    // offered rate and results over the given seconds: achieved and answered QPS, loss, timeouts
+    // and latency percentiles
+    nlohmann::json report(uint64_t qps, long seconds) const;
+
+    double sent_qps(long seconds) const
+    {
+        return static_cast<double>(_s_count) / seconds;
+    }
+
+    // share of queries sent during the step that went unanswered. queries still in flight at the
+    // end are made up by those answered from before it; answers that come too late are bad
+    // receives, which don't count as answered.
+    double loss_pct() const
+    {
+        return (_s_count && _r_count < _s_count) ? (100.0 * (_s_count - _r_count) / _s_count) : 0.0;
+    }
+
+    u_long answered() const
+    {
+        return _r_count;
+    }
+
+    const LatencyHistogram &latency() const
+    {
+        return _latency;
+    }
+
+private:
+    u_long _s_count{0};
+    // good responses
+    u_long _r_count{0};
+    u_long _timeouts{0};
+    LatencyHistogram _latency;
+};
+
+/**
+ * Searches for the highest rate the target sustains within a latency and loss SLO. Each step
+ * holds one rate for a number of metrics periods (seconds) and checks p99 latency and loss over
+ * them, the first period of each step being left out while the previous rate drains. The rate
+ * doubles until a step fails, then the range between the last passing and first failing rate is
+ * halved until it is within PRECISION of the passing rate.
+ *
+ * A step also fails if the client sends less than CLIENT_BOUND of the rate asked for, as the
+ * server was then never offered it.
+ */
+class CapacitySearch
+{
+public:
+    using rate_cb = std::function<void(uint64_t qps)>;
+
+    // stop once the highest passing rate is known to within this fraction
+    static constexpr double PRECISION = 0.02;
+    static constexpr double CLIENT_BOUND = 0.95;
+
+    /**
+     * @param step_periods periods each rate is measured over, after one to settle
+     * @param set_rate change the offered rate
+     * @param done called once the search has converged
+     */
+    CapacitySearch(uint64_t start_qps, long step_periods, double max_p99_ms, double max_loss_pct,
+        rate_cb set_rate, std::function<void()> done, int verbosity);
+
+    void start();
+
+    // account one metrics period, moving on to the next step when this one is complete
+    void period(const PeriodStats &stats);
+
+    bool finished() const
+    {
+        return _finished;
+    }
+
+    // SLO, every step and the result
+    nlohmann::json summary() const;
+
+private:
+    long _step_periods;
+    double _max_p99_ms;
+    double _max_loss_pct;
+    rate_cb _set_rate;
+    std::function<void()> _done;
+    int _verbosity;
+
+    bool _bisecting{false};
+    bool _finished{false};
+    uint64_t _qps;
+    // highest passing and lowest failing rates so far, 0 if none yet
+    uint64_t _pass_qps{0};
+    uint64_t _fail_qps{0};
+
+    // the current step
+    long _periods{0};
+    StepStats _stats;
+
+    nlohmann::json _steps;
+
+    void step(uint64_t qps);
+    void evaluate();
+};
+
+/**
+ * Steps the offered rate through a range for a load/latency curve, like a QPS flow of warmup plus
+ * measurement seconds per rate. The rate changes on metrics period boundaries, so that each
+ * step's measurement periods see only its own rate, and are totalled into one row of the report.
+ */
+class LoadSweep
+{
+public:
+    /**
+     * @param to last rate, included; below from to sweep downwards
+     */
+    LoadSweep(uint64_t from, uint64_t to, uint64_t step, long warmup_periods, long measure_periods, int verbosity);
+
+    /**
+     * Start at the first rate.
+     *
+     * @param done called after the last step has been measured
+     */
+    void start(CapacitySearch::rate_cb set_rate, std::function<void()> done);
+
+    void period(const PeriodStats &stats);
+
+    bool finished() const
+    {
+        return _row == _rates.size();
+    }
+
+    // one row per rate, as a JSON array or CSV with a header line
+    nlohmann::json table() const;
+    std::string csv() const;
+
+private:
+    std::vector<uint64_t> _rates;
+    long _warmup_periods;
+    long _measure_periods;
+    int _verbosity;
+    CapacitySearch::rate_cb _set_rate;
+    std::function<void()> _done;
+
+    // periods seen in the current step, and the step's row
+    long _periods{0};
+    size_t _row{0};
+    StepStats _stats;
+    nlohmann::json _table;
+};
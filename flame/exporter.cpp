@@ -0,0 +1,140 @@
+// Copyright 2019 NSONE, Inc
+
+#include <cstring>
+#include <stdexcept>
+
+#include "exporter.h"
+
+MetricsExporter::MetricsExporter(std::shared_ptr<uvw::Loop> loop, const std::string &address)
+{
+    std::string ip{"0.0.0.0"};
+    std::string port{address};
+    auto colon = address.rfind(':');
+    if (colon != std::string::npos) {
+        ip = address.substr(0, colon);
+        port = address.substr(colon + 1);
+        if (ip.size() > 1 && ip.front() == '[' && ip.back() == ']') {
+            ip = ip.substr(1, ip.size() - 2);
+        }
+    }
+    sockaddr_storage addr{};
+    int p{0};
+    try {
+        p = std::stoi(port);
+    } catch (const std::exception &) {
+        p = -1;
+    }
+    if (p < 0 || p > 65535
+        || (uv_ip4_addr(ip.c_str(), p, reinterpret_cast<sockaddr_in *>(&addr)) != 0
+            && uv_ip6_addr(ip.c_str(), p, reinterpret_cast<sockaddr_in6 *>(&addr)) != 0)) {
+        throw std::runtime_error("bad metrics listen address: " + address);
+    }
+
+    _server = loop->resource<uvw::TcpHandle>();
+    std::string error;
+    // bind and listen report failure through an error event
+    _server->once<uvw::ErrorEvent>([&error](const uvw::ErrorEvent &e, uvw::TcpHandle &) {
+        error = e.what();
+    });
+    _server->bind(reinterpret_cast<const sockaddr &>(addr));
+    if (error.empty()) {
+        _server->listen();
+    }
+    if (!error.empty()) {
+        _server->close();
+        throw std::runtime_error("unable to listen for metrics on " + address + ": " + error);
+    }
+    _server->clear<uvw::ErrorEvent>();
+    // a failed accept only loses that scrape
+    _server->on<uvw::ErrorEvent>([](const uvw::ErrorEvent &, uvw::TcpHandle &) {});
+    _server->on<uvw::ListenEvent>([this](const uvw::ListenEvent &, uvw::TcpHandle &server) {
+        accept(server);
+    });
+}
+
+void MetricsExporter::stop()
+{
+    if (_server) {
+        _server->close();
+        _server.reset();
+    }
+    while (!_clients.empty()) {
+        drop(*_clients.begin()->first);
+    }
+}
+
+void MetricsExporter::accept(uvw::TcpHandle &server)
+{
+    auto client = server.loop().resource<uvw::TcpHandle>();
+    auto request = std::make_shared<std::string>();
+    client->on<uvw::DataEvent>([this, request](const uvw::DataEvent &e, uvw::TcpHandle &c) {
+        request->append(e.data.get(), e.length);
+        if (request->find("\r\n\r\n") != std::string::npos) {
+            c.stop();
+            respond(c, *request);
+        } else if (request->size() > MAX_REQUEST) {
+            drop(c);
+        }
+    });
+    client->on<uvw::WriteEvent>([this](const uvw::WriteEvent &, uvw::TcpHandle &c) { drop(c); });
+    client->on<uvw::EndEvent>([this](const uvw::EndEvent &, uvw::TcpHandle &c) { drop(c); });
+    client->on<uvw::ErrorEvent>([this](const uvw::ErrorEvent &, uvw::TcpHandle &c) { drop(c); });
+    server.accept(*client);
+
+    // a scraper that connects and stalls would otherwise keep the loop running
+    auto timer = server.loop().resource<uvw::TimerHandle>();
+    auto c = client.get();
+    timer->on<uvw::TimerEvent>([this, c](const uvw::TimerEvent &, uvw::TimerHandle &) { drop(*c); });
+    timer->start(std::chrono::duration_cast<uvw::TimerHandle::Time>(CLIENT_TIMEOUT), uvw::TimerHandle::Time{0});
+    _clients.emplace(c, std::make_pair(client, timer));
+    client->read();
+}
+
+void MetricsExporter::drop(uvw::TcpHandle &client)
+{
+    auto i = _clients.find(&client);
+    if (i == _clients.end()) {
+        return;
+    }
+    auto handles = std::move(i->second);
+    _clients.erase(i);
+    handles.second->close();
+    handles.first->close();
+}
+
+void MetricsExporter::respond(uvw::TcpHandle &client, const std::string &request)
+{
+    // request line: METHOD PATH VERSION
+    auto end = request.find("\r\n");
+    auto line = request.substr(0, end);
+    auto sp1 = line.find(' ');
+    auto sp2 = line.find(' ', sp1 + 1);
+    std::string method = line.substr(0, sp1);
+    std::string path = (sp1 == std::string::npos) ? "" : line.substr(sp1 + 1, sp2 - sp1 - 1);
+    // the query string, e.g. Prometheus' ?name[]=, doesn't select anything here
+    path = path.substr(0, path.find('?'));
+
+    std::string status{"200 OK"};
+    std::string type{CONTENT_TYPE};
+    std::string body;
+    if (method != "GET" && method != "HEAD") {
+        status = "405 Method Not Allowed";
+        type = "text/plain";
+        body = "only GET is supported\n";
+    } else if (path != "/metrics") {
+        status = "404 Not Found";
+        type = "text/plain";
+        body = "metrics are at /metrics\n";
+    } else {
+        body = _page;
+    }
+
+    std::string response = "HTTP/1.1 " + status + "\r\nContent-Type: " + type + "\r\nContent-Length: "
+        + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n";
+    if (method != "HEAD") {
+        response += body;
+    }
+    auto data = std::make_unique<char[]>(response.size());
+    std::memcpy(data.get(), response.data(), response.size());
+    client.write(std::move(data), response.size());
+}
@@ -0,0 +1,55 @@
+// Copyright 2019 NSONE, Inc
+
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include <uvw.hpp>
+
+/**
+ * Serves the latest metrics on GET /metrics over HTTP, in OpenMetrics text format, for Prometheus
+ * to scrape during a run. The page is rendered by MetricsMgr once per metrics period and handed
+ * over with update(), so a scrape only copies a finished string to the socket and never touches
+ * the counters the generators are updating.
+ *
+ * Each connection gets one response and is then closed, as is one that hasn't been answered
+ * within CLIENT_TIMEOUT.
+ */
+class MetricsExporter
+{
+public:
+    static constexpr const char *CONTENT_TYPE = "application/openmetrics-text; version=1.0.0; charset=utf-8";
+    // requests are a single GET, anything longer is dropped
+    static const size_t MAX_REQUEST = 8192;
+    // longest a connection may take to send its request and read the response
+    static constexpr std::chrono::seconds CLIENT_TIMEOUT{5};
+
+    /**
+     * @param address [IP:]PORT to listen on, all IPv4 addresses if no IP is given. IPv6 addresses
+     *        go in brackets, e.g. [::1]:9100
+     * @throws std::runtime_error if the address is bad or can't be listened on
+     */
+    MetricsExporter(std::shared_ptr<uvw::Loop> loop, const std::string &address);
+
+    void update(std::string page)
+    {
+        _page = std::move(page);
+    }
+
+    // stop listening and close open connections, so the loop can finish
+    void stop();
+
+private:
+    std::shared_ptr<uvw::TcpHandle> _server;
+    std::string _page;
+    // open connections, with the timer that closes them
+    std::unordered_map<uvw::TcpHandle *, std::pair<std::shared_ptr<uvw::TcpHandle>, std::shared_ptr<uvw::TimerHandle>>> _clients;
+
+    void accept(uvw::TcpHandle &server);
+    // close a connection and its timer, if still open
+    void drop(uvw::TcpHandle &client);
+    void respond(uvw::TcpHandle &client, const std::string &request);
+};
@@ -0,0 +1,81 @@
+// Copyright 2019 NSONE, Inc
+
+#include <algorithm>
+
+#include "histogram.h"
+
+LatencyHistogram::LatencyHistogram()
+    : _counts(index(MAX_VALUE) + 1)
+{
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other)
+{
+    if (!other._count) {
+        return;
+    }
+    for (size_t i = 0; i < _counts.size(); i++) {
+        _counts[i] += other._counts[i];
+    }
+    if (!_count || other._min < _min) {
+        _min = other._min;
+    }
+    _max = std::max(_max, other._max);
+    _count += other._count;
+    _sum += other._sum;
+}
+
+void LatencyHistogram::reset()
+{
+    if (!_count) {
+        return;
+    }
+    std::fill(_counts.begin(), _counts.end(), 0);
+    _count = _sum = _min = _max = 0;
+}
+
+uint64_t LatencyHistogram::value_at(int i)
+{
+    if (i < static_cast<int>(SUB_BUCKETS)) {
+        return i;
+    }
+    int shift = i / (SUB_BUCKETS / 2) - 1;
+    uint64_t low = static_cast<uint64_t>(i - shift * (SUB_BUCKETS / 2)) << shift;
+    return low + ((uint64_t(1) << shift) >> 1);
+}
+
+uint64_t LatencyHistogram::percentile(double percent) const
+{
+    if (!_count) {
+        return 0;
+    }
+    uint64_t rank = static_cast<uint64_t>(percent / 100.0 * _count + 0.5);
+    rank = std::max<uint64_t>(rank, 1);
+    uint64_t seen{0};
+    for (size_t i = 0; i < _counts.size(); i++) {
+        seen += _counts[i];
+        if (seen >= rank) {
+            // a bucket's midpoint may lie outside what was actually recorded
+            return std::min(std::max(value_at(i), _min), _max);
+        }
+    }
+    return _max;
+}
+
+std::vector<uint64_t> LatencyHistogram::cumulative(const std::vector<uint64_t> &bounds) const
+{
+    std::vector<uint64_t> counts(bounds.size());
+    uint64_t seen{0};
+    size_t b{0};
+    for (size_t i = 0; i < _counts.size() && b < bounds.size(); i++) {
+        // a bucket counts below a bound if its midpoint does
+        while (b < bounds.size() && value_at(i) > bounds[b]) {
+            counts[b++] = seen;
+        }
+        seen += _counts[i];
+    }
+    for (; b < bounds.size(); b++) {
+        counts[b] = seen;
+    }
+    return counts;
+}
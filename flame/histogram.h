@@ -0,0 +1,100 @@
+// Copyright 2019 NSONE, Inc
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+/**
+ * Latency histogram with log bucketing in the style of HdrHistogram: each power of two range of
+ * values is split into SUB_BUCKETS / 2 linear buckets, so a bucket is at most 1/64 (about 1.6%) of
+ * its values wide, and a value read back as its bucket's midpoint is within 0.8%, with a fixed
+ * number of buckets. Recording is a couple of shifts and an increment, and merging two histograms
+ * adds their buckets.
+ *
+ * Values are nanoseconds; anything above MAX_VALUE (about 68 s) is counted as MAX_VALUE.
+ */
+class LatencyHistogram
+{
+public:
+    static const int SUB_BUCKET_BITS = 7;
+    static const uint64_t SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const int MAX_VALUE_BITS = 36;
+    static const uint64_t MAX_VALUE = (uint64_t(1) << MAX_VALUE_BITS) - 1;
+
+    LatencyHistogram();
+
+    void record(uint64_t value)
+    {
+        if (value > MAX_VALUE) {
+            value = MAX_VALUE;
+        }
+        _counts[index(value)]++;
+        // 0 is a value like any other, the first one recorded is the min so far
+        if (!_count || value < _min) {
+            _min = value;
+        }
+        if (value > _max) {
+            _max = value;
+        }
+        _count++;
+        _sum += value;
+    }
+
+    void merge(const LatencyHistogram &other);
+
+    void reset();
+
+    uint64_t count() const
+    {
+        return _count;
+    }
+
+    uint64_t min() const
+    {
+        return _min;
+    }
+
+    uint64_t max() const
+    {
+        return _max;
+    }
+
+    uint64_t sum() const
+    {
+        return _sum;
+    }
+
+    // exact, from the sum of all values
+    double mean() const
+    {
+        return _count ? static_cast<double>(_sum) / _count : 0.0;
+    }
+
+    // value at or below which percent (0 to 100) of the values fall, to within the bucket precision
+    uint64_t percentile(double percent) const;
+
+    // number of values at or below each of the ascending bounds, to within the bucket precision
+    std::vector<uint64_t> cumulative(const std::vector<uint64_t> &bounds) const;
+
+private:
+    std::vector<uint64_t> _counts;
+    uint64_t _count{0};
+    uint64_t _sum{0};
+    uint64_t _min{0};
+    uint64_t _max{0};
+
+    static int index(uint64_t value)
+    {
+        if (value < SUB_BUCKETS) {
+            return static_cast<int>(value);
+        }
+        // keep the top SUB_BUCKET_BITS bits of the value: the shift picks the power of two range,
+        // the remaining bits (top bit always set) the linear bucket within it
+        int shift = 63 - __builtin_clzll(value) - (SUB_BUCKET_BITS - 1);
+        return static_cast<int>((shift * (SUB_BUCKETS / 2)) + (value >> shift));
+    }
+
+    // midpoint of the values in bucket i
+    static uint64_t value_at(int i);
+};
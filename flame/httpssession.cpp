@@ -0,0 +1,216 @@
+// Copyright 2019 NSONE, Inc
+
+#include <algorithm>
+#include <cstring>
+
+#include <arpa/inet.h>
+
+#include "httpssession.h"
+
+// largest DNS message we accept in a response body
+static const size_t MAX_DNS_RESPONSE_SIZE = 65535;
+
+static nghttp2_nv make_nv(const std::string &name, const std::string &value)
+{
+    return {(uint8_t *)name.data(), (uint8_t *)value.data(), name.size(), value.size(), NGHTTP2_NV_FLAG_NONE};
+}
+
+HTTPSSession::HTTPSSession(SSL_CTX *ctx, const std::string &sni, SSL_SESSION *resume,
+    const std::string &authority, const std::string &path, Method method, size_t max_streams)
+    : TCPTLSSession(ctx, sni, resume)
+    , _authority(authority)
+    , _path(path)
+    , _method(method)
+    , _max_streams(max_streams)
+{
+    nghttp2_session_callbacks *callbacks;
+    nghttp2_session_callbacks_new(&callbacks);
+    nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, on_frame_recv);
+    nghttp2_session_callbacks_set_on_header_callback(callbacks, on_header);
+    nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks, on_data_chunk);
+    nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, on_stream_close);
+    nghttp2_session_client_new(&_h2, callbacks, this);
+    nghttp2_session_callbacks_del(callbacks);
+}
+
+HTTPSSession::~HTTPSSession()
+{
+    nghttp2_session_del(_h2);
+}
+
+void HTTPSSession::handshake_complete()
+{
+    const unsigned char *alpn{nullptr};
+    unsigned int alpn_len{0};
+    SSL_get0_alpn_selected(_ssl, &alpn, &alpn_len);
+    if (alpn_len != 2 || memcmp(alpn, "h2", 2) != 0) {
+        // server doesn't speak HTTP/2
+        _error();
+        return;
+    }
+
+    nghttp2_settings_entry settings[] = {
+        {NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, static_cast<uint32_t>(_max_streams)},
+        {NGHTTP2_SETTINGS_ENABLE_PUSH, 0},
+    };
+    nghttp2_submit_settings(_h2, NGHTTP2_FLAG_NONE, settings, sizeof(settings) / sizeof(settings[0]));
+    send();
+
+    TCPTLSSession::handshake_complete();
+}
+
+size_t HTTPSSession::available_streams()
+{
+    if (!_remote_settings) {
+        // streams over the server's limit would be refused
+        return 0;
+    }
+    size_t limit = std::min<size_t>(_max_streams,
+        nghttp2_session_get_remote_settings(_h2, NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS));
+    return (_streams.size() < limit) ? limit - _streams.size() : 0;
+}
+
+bool HTTPSSession::submit(uint16_t id, const uint8_t *wire, size_t len, const std::string &dns_param)
+{
+    static const std::string method_get{"GET"}, method_post{"POST"}, scheme{"https"}, mime{"application/dns-message"};
+
+    std::string path;
+    std::string content_length;
+    std::vector<nghttp2_nv> hdrs;
+    if (_method == Method::GET) {
+        path = _path + "?dns=" + dns_param;
+        hdrs = {make_nv(":method", method_get), make_nv(":scheme", scheme), make_nv(":authority", _authority),
+            make_nv(":path", path), make_nv("accept", mime)};
+    } else {
+        content_length = std::to_string(len);
+        hdrs = {make_nv(":method", method_post), make_nv(":scheme", scheme), make_nv(":authority", _authority),
+            make_nv(":path", _path), make_nv("accept", mime), make_nv("content-type", mime),
+            make_nv("content-length", content_length)};
+    }
+
+    Stream stream{id, wire, len, 0, 0, {}};
+    int32_t stream_id;
+    if (_method == Method::GET) {
+        stream_id = nghttp2_submit_request(_h2, nullptr, hdrs.data(), hdrs.size(), nullptr, nullptr);
+    } else {
+        nghttp2_data_provider provider;
+        provider.source.ptr = nullptr;
+        provider.read_callback = read_body;
+        stream_id = nghttp2_submit_request(_h2, nullptr, hdrs.data(), hdrs.size(), &provider, nullptr);
+    }
+    if (stream_id < 0) {
+        return false;
+    }
+    _streams.emplace(stream_id, std::move(stream));
+    return true;
+}
+
+void HTTPSSession::send()
+{
+    // coalesce all pending frames into one TLS write
+    std::string out;
+    const uint8_t *data;
+    ssize_t len;
+    while ((len = nghttp2_session_mem_send(_h2, &data)) > 0) {
+        out.append(reinterpret_cast<const char *>(data), len);
+    }
+    if (len < 0) {
+        _error();
+        return;
+    }
+    if (out.size()) {
+        write(out.data(), out.size());
+    }
+}
+
+void HTTPSSession::received_plaintext(const char data[], size_t len)
+{
+    if (nghttp2_session_mem_recv(_h2, reinterpret_cast<const uint8_t *>(data), len) < 0) {
+        _error();
+        return;
+    }
+    // acknowledge settings, window updates, etc.
+    send();
+}
+
+ssize_t HTTPSSession::read_body(nghttp2_session *session, int32_t stream_id, uint8_t *buf, size_t length,
+    uint32_t *data_flags, nghttp2_data_source *source, void *user_data)
+{
+    auto self = static_cast<HTTPSSession *>(user_data);
+    auto s = self->_streams.find(stream_id);
+    if (s == self->_streams.end()) {
+        return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+    }
+    auto &stream = s->second;
+    size_t n = std::min(length, stream.body_len - stream.body_offset);
+    memcpy(buf, stream.body + stream.body_offset, n);
+    stream.body_offset += n;
+    if (stream.body_offset == stream.body_len) {
+        *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+    }
+    return n;
+}
+
+int HTTPSSession::on_frame_recv(nghttp2_session *session, const nghttp2_frame *frame, void *user_data)
+{
+    auto self = static_cast<HTTPSSession *>(user_data);
+    if (frame->hd.type == NGHTTP2_SETTINGS && !(frame->hd.flags & NGHTTP2_FLAG_ACK) && !self->_remote_settings) {
+        self->_remote_settings = true;
+        self->_ready();
+    }
+    return 0;
+}
+
+int HTTPSSession::on_header(nghttp2_session *session, const nghttp2_frame *frame, const uint8_t *name, size_t namelen,
+    const uint8_t *value, size_t valuelen, uint8_t flags, void *user_data)
+{
+    auto self = static_cast<HTTPSSession *>(user_data);
+    if (frame->hd.type != NGHTTP2_HEADERS || namelen != 7 || memcmp(name, ":status", 7) != 0) {
+        return 0;
+    }
+    auto s = self->_streams.find(frame->hd.stream_id);
+    if (s != self->_streams.end()) {
+        s->second.status = std::atoi(std::string(reinterpret_cast<const char *>(value), valuelen).c_str());
+    }
+    return 0;
+}
+
+int HTTPSSession::on_data_chunk(nghttp2_session *session, uint8_t flags, int32_t stream_id, const uint8_t *data,
+    size_t len, void *user_data)
+{
+    auto self = static_cast<HTTPSSession *>(user_data);
+    auto s = self->_streams.find(stream_id);
+    if (s == self->_streams.end()) {
+        return 0;
+    }
+    if (s->second.response.size() + len > MAX_DNS_RESPONSE_SIZE) {
+        return nghttp2_submit_rst_stream(session, NGHTTP2_FLAG_NONE, stream_id, NGHTTP2_CANCEL);
+    }
+    s->second.response.append(reinterpret_cast<const char *>(data), len);
+    return 0;
+}
+
+int HTTPSSession::on_stream_close(nghttp2_session *session, int32_t stream_id, uint32_t error_code, void *user_data)
+{
+    auto self = static_cast<HTTPSSession *>(user_data);
+    auto s = self->_streams.find(stream_id);
+    if (s == self->_streams.end()) {
+        return 0;
+    }
+    Stream stream = std::move(s->second);
+    self->_streams.erase(s);
+
+    // need at least a DNS header to write our id into
+    if (error_code != NGHTTP2_NO_ERROR || stream.status != 200 || stream.response.size() < 12) {
+        self->_bad_response(stream.id);
+        return 0;
+    }
+
+    auto size = stream.response.size();
+    auto data = std::make_unique<char[]>(size);
+    memcpy(data.get(), stream.response.data(), size);
+    uint16_t id = htons(stream.id);
+    memcpy(data.get(), &id, sizeof(id));
+    self->_query(std::move(data), size);
+    return 0;
+}
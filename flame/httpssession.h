@@ -0,0 +1,106 @@
+// Copyright 2019 NSONE, Inc
+
+#pragma once
+
+#include <string>
+#include <unordered_map>
+
+#include <nghttp2/nghttp2.h>
+
+#include "tcptlssession.h"
+
+/**
+ * DNS over HTTPS (RFC 8484) client session on HTTP/2. Each query is its own stream, many
+ * streams are multiplexed on the TLS connection. Queries are sent with DNS ID 0 as the RFC
+ * recommends; the ID they are tracked under is written into the response before it is
+ * handed to the query callback.
+ */
+class HTTPSSession : public TCPTLSSession
+{
+public:
+    enum class Method {
+        GET,
+        POST,
+    };
+
+    using bad_response_cb = std::function<void(uint16_t id)>;
+    using ready_cb = std::function<void()>;
+
+    /**
+     * @param authority value of the :authority pseudo header
+     * @param path request path, e.g. /dns-query
+     * @param max_streams our limit on concurrent streams, the server's SETTINGS may lower it
+     */
+    HTTPSSession(SSL_CTX *ctx, const std::string &sni, SSL_SESSION *resume,
+        const std::string &authority, const std::string &path, Method method, size_t max_streams);
+    ~HTTPSSession();
+
+    // number of queries that may be submitted before hitting the concurrency limit.
+    // zero until the server's SETTINGS have arrived, see on_ready()
+    size_t available_streams();
+
+    // streams currently open
+    size_t open_streams() const
+    {
+        return _streams.size();
+    }
+
+    /**
+     * Submit a query, queued until send() is called. Returns false if the connection can
+     * no longer open streams (GOAWAY received or stream ids exhausted).
+     *
+     * @param id id to track the query under
+     * @param wire query in wire format, must stay valid until the stream closes (POST)
+     * @param dns_param base64url encoded query (GET)
+     */
+    bool submit(uint16_t id, const uint8_t *wire, size_t len, const std::string &dns_param);
+
+    // write all queued frames to the connection
+    void send();
+
+    // a stream ended with a non 200 status, was reset or returned no DNS message
+    void on_bad_response(bad_response_cb handler)
+    {
+        _bad_response = std::move(handler);
+    }
+
+    // the server's SETTINGS arrived, streams may be submitted
+    void on_ready(ready_cb handler)
+    {
+        _ready = std::move(handler);
+    }
+
+protected:
+    void received_plaintext(const char data[], size_t len) override;
+    void handshake_complete() override;
+
+private:
+    struct Stream {
+        uint16_t id;
+        const uint8_t *body;
+        size_t body_len;
+        size_t body_offset;
+        int status;
+        std::string response;
+    };
+
+    nghttp2_session *_h2{nullptr};
+    std::string _authority;
+    std::string _path;
+    Method _method;
+    size_t _max_streams;
+    bool _remote_settings{false};
+
+    std::unordered_map<int32_t, Stream> _streams;
+    bad_response_cb _bad_response;
+    ready_cb _ready;
+
+    static ssize_t read_body(nghttp2_session *session, int32_t stream_id, uint8_t *buf, size_t length,
+        uint32_t *data_flags, nghttp2_data_source *source, void *user_data);
+    static int on_frame_recv(nghttp2_session *session, const nghttp2_frame *frame, void *user_data);
+    static int on_header(nghttp2_session *session, const nghttp2_frame *frame, const uint8_t *name, size_t namelen,
+        const uint8_t *value, size_t valuelen, uint8_t flags, void *user_data);
+    static int on_data_chunk(nghttp2_session *session, uint8_t flags, int32_t stream_id, const uint8_t *data,
+        size_t len, void *user_data);
+    static int on_stream_close(nghttp2_session *session, int32_t stream_id, uint32_t error_code, void *user_data);
+};
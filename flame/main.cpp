@@ -1,31 +1,57 @@
 // Copyright 2019 NSONE, Inc
 
+#include <cstring>
+#include <fstream>
 #include <iostream>
 #include <iterator>
 #include <map>
-#include <queue>
 #include <sstream>
 #include <string>
 #include <vector>
 
+#include <sys/resource.h>
+
+#include "capacity.h"
 #include "config.h"
 #include "docopt.h"
+#include "exporter.h"
 #include "metrics.h"
+#include "pacer.h"
+#include "perfcounters.h"
+#include "qpsflow.h"
 #include "query.h"
+#include "socketpool.h"
+#include "trace.h"
 #include "trafgen.h"
 #include "utils.h"
+#ifdef HAVE_IO_URING
+#include "uring.h"
+#endif
+#ifdef HAVE_PACKET_RING
+#include "packetsender.h"
+#endif
 
 #include <uvw.hpp>
 
 #include "version.h"
 
+// most sockets --source opens by default, one per address
+static const uint64_t MAX_SOURCE_SOCKETS = 65536;
+
 static const char USAGE[] =
     R"(Flamethrower.
     Usage:
       flame [-q QCOUNT] [-c TCOUNT] [-p PORT] [-d DELAY_MS] [-r RECORD] [-T QTYPE] [-o FILE]
             [-l LIMIT_SECS] [-t TIMEOUT] [-F FAMILY] [-f FILE] [-n LOOP] [-P PROTOCOL]
             [-Q QPS] [-g GENERATOR] [-v VERBOSITY] [-R] [--class CLASS] [--qps-flow SPEC]
-            [--dnssec]
+            [--dnssec] [--tls-no-resume] [--session-queries NUM] [--doh-method METHOD]
+            [--doh-path PATH] [--max-streams NUM] [--gso] [--io-engine ENGINE] [--sqpoll]
+            [--raw-iface IFACE] [--raw-dst-mac MAC] [--sockets NUM] [--connect]
+            [--timestamps] [--source ADDRS] [--per-socket] [--pace] [--arrival PROCESS]
+            [--outstanding NUM] [--find-capacity] [--slo-p99 MS] [--slo-loss PCT]
+            [--step-secs SECS] [--sweep RANGE] [--warmup-secs SECS] [--sweep-out FILE]
+            [--prometheus ADDR] [--trace FILE] [--trace-every N] [--loop-metrics]
+            [--perf-counters]
             TARGET [GENOPTS]...
       flame (-h | --help)
       flame --version
@@ -41,18 +67,74 @@ static const char USAGE[] =
       -t TIMEOUT_SECS  Query timeout in seconds [default: 3]
       -n LOOP          Loop LOOP times through record list, 0 is unlimited [default: 0]
       -Q QPS           Rate limit to a maximum of QPS, 0 is no limit [default: 0]
-      --qps-flow SPEC  Change rate limit over time, format: QPS,MS;QPS,MS;...
+      --qps-flow SPEC  Change rate limit over time, format: QPS,MS;QPS,MS;... Groups may also be
+                       ramp:FROM:TO,MS or sine:MEAN:AMPLITUDE:PERIOD_MS,MS or file:CSV (a QPS series,
+                       one line per second), and the last may be loop to repeat
+      --pace           UDP: send at the -Q or --qps-flow rate with each query at its own exact time,
+                       from a high resolution timer, instead of bursts of -q queries every -d ms
+      --arrival PROCESS  Paced send times: constant, poisson or burst:N (N queries at once). Other than
+                       constant implies --pace. Latency is measured from intended send times [default: constant]
+      --outstanding NUM  UDP: keep NUM queries in flight over all generators, each answer or timeout
+                       sending the next (closed loop), instead of -q queries every -d ms [default: 0]
+      --find-capacity  Search for the highest rate within the SLO, starting from -Q (or 1000), and
+                       print a JSON summary of every step when done
+      --slo-p99 MS     Capacity search: highest passing p99 latency [default: 10]
+      --slo-loss PCT   Capacity search: highest passing share of unanswered queries [default: 1]
+      --step-secs SECS  Capacity search and sweep: seconds each rate is measured [default: 5]
+      --sweep RANGE    Step the rate through FROM:TO:STEP QPS, reporting achieved QPS, loss and latency
+                       percentiles of each step as a table
+      --warmup-secs SECS  Sweep: seconds at each rate before measuring [default: 2]
+      --sweep-out FILE  Sweep: write the table to FILE, as CSV if it ends in .csv, otherwise JSON.
+                       Printed as JSON when not given
       -r RECORD        The base record to use as the DNS query for generators [default: test.com]
       -T QTYPE         The query type to use for generators [default: A]
       -f FILE          Read records from FILE, one per row, QNAME TYPE
       -p PORT          Which port to flame [default: 53]
       -F FAMILY        Internet family (inet/inet6) [default: inet]
-      -P PROTOCOL      Protocol to use (udp/tcp) [default: udp]
+      -P PROTOCOL      Protocol to use (udp/tcp/dot/doh) [default: udp]
       -g GENERATOR     Generate queries with the given generator [default: static]
-      -o FILE          Metrics output file, JSON format.
+      -o FILE          Metrics output file, newline delimited JSON. CBOR if FILE ends in .cbor, and zstd
+                       compressed if it (then) ends in .zst, e.g. metrics.cbor.zst
+      --prometheus ADDR  Serve run totals for Prometheus on http://ADDR/metrics, ADDR being [IP:]PORT
+      --trace FILE     Log send and receive times, id, query index, rcode, size and source port of every
+                       Nth answered or timed out query to FILE, in binary (see README)
+      --trace-every N  Trace one in every N queries [default: 100]
+      --loop-metrics   Measure flame's event loop (busy and CPU share, time per phase, send timer
+                       lateness) and flag periods where flame itself is the bottleneck. Costs a
+                       couple of clock reads per send batch and response.
+      --perf-counters  Count cycles, instructions, cache and branch misses of the event loop thread,
+                       reported per query for sending, query generation, receiving and timeouts.
+                       Linux only, needs hardware counters (perf_event_open). Slows sending down.
+                       Implies --loop-metrics.
       -v VERBOSITY     How verbose output should be, 0 is silent [default: 1]
       -R               Randomize the query list before sending [default: false]
       --dnssec         Set DO flag in EDNS.
+      --gso            UDP: send each batch of same sized queries with one segmentation offload
+                       (UDP_SEGMENT) syscall, and receive with UDP_GRO. Linux only.
+      --io-engine ENGINE  UDP i/o engine (libuv/uring). uring uses io_uring, Linux 6.0+ [default: libuv]
+      --sqpoll         io_uring: submit from a kernel polling thread instead of with syscalls
+      --raw-iface IFACE  UDP: send prebuilt frames on IFACE from a packet socket TX ring, bypassing
+                       the UDP/IP stack. Responses are received as usual. Needs CAP_NET_RAW.
+      --raw-dst-mac MAC  Next hop MAC address for --raw-iface, looked up in the ARP table by default
+      --sockets NUM    UDP: spread queries over NUM sockets (source ports) shared by all generators,
+                       instead of one socket per generator. 0 is one per generator [default: 0]
+      --source ADDRS   UDP: bind the shared sockets to source addresses spread over ADDRS, a comma
+                       separated list of addresses and CIDR prefixes. One socket per address, unless
+                       set with --sockets. Addresses need not be assigned to an interface.
+      --per-socket     List every shared socket (address, port) in the report and metrics output,
+                       instead of only the min/avg/max over sockets
+      --connect        UDP: connect sockets to the target, so sends carry no address and responses
+                       from other sources are dropped by the kernel
+      --timestamps     UDP: time responses from the kernel's send timestamp to its receive timestamp
+                       (SO_TIMESTAMPING, in hardware where the NIC does it), and report the user
+                       space time either side apart. Linux only.
+
+    DNS over TLS/HTTPS Options:
+      --tls-no-resume        Disable TLS session resumption, every connection does a full handshake
+      --session-queries NUM  Reconnect after NUM queries on a connection, 0 keeps connections open [default: 0]
+      --doh-method METHOD    DoH HTTP method (GET/POST) [default: POST]
+      --doh-path PATH        DoH request path [default: /dns-query]
+      --max-streams NUM      Maximum concurrent DoH streams (queries) per connection [default: 100]
 
      Generators:
 
@@ -97,43 +179,14 @@ static const char USAGE[] =
 
 )";
 
-void parse_flowspec(std::string spec, std::queue<std::pair<uint64_t, uint64_t>> &result, int verbosity)
-{
-
-    std::vector<std::string> groups = split(spec, ';');
-    for (int i = 0; i < groups.size(); i++) {
-        std::vector<std::string> nums = split(groups[i], ',');
-        if (verbosity > 1) {
-            std::cout << "adding QPS flow: " << nums[0] << "qps, " << nums[1] << "ms" << std::endl;
-        }
-        result.push(std::make_pair(std::stol(nums[0]), std::stol(nums[1])));
-    }
-}
-
-void flow_change(std::queue<std::pair<uint64_t, uint64_t>> qps_flow,
-    std::shared_ptr<TokenBucket> rl,
-    int verbosity)
+// apply a new rate to whichever of the rate limiter or pacer drives sending
+void set_rate(uint64_t qps, std::shared_ptr<RateLimiter> rl, std::shared_ptr<Pacer> pacer)
 {
-    auto flow = qps_flow.front();
-    qps_flow.pop();
-    if (verbosity) {
-        if (qps_flow.size()) {
-            std::cout << "QPS flow now " << flow.first << " for " << flow.second << "ms, flows left: "
-                      << qps_flow.size() << std::endl;
-        } else {
-            std::cout << "QPS flow now " << flow.first << " until completion" << std::endl;
-        }
+    if (pacer) {
+        pacer->rate(qps);
+    } else {
+        rl->rate(qps);
     }
-    *rl = TokenBucket(flow.first, flow.first);
-    if (qps_flow.size() == 0)
-        return;
-    auto loop = uvw::Loop::getDefault();
-    auto qps_timer = loop->resource<uvw::TimerHandle>();
-    qps_timer->on<uvw::TimerEvent>([qps_flow, rl, verbosity](const auto &event, auto &handle) {
-        handle.stop();
-        flow_change(qps_flow, rl, verbosity);
-    });
-    qps_timer->start(uvw::TimerHandle::Time{flow.second}, uvw::TimerHandle::Time{0});
 }
 
 bool arg_exists(const char *needle, int argc, char *argv[])
@@ -222,10 +275,26 @@ int main(int argc, char *argv[])
             b_count = 100;
         if (!arg_exists("-c", argc, argv))
             c_count = 30;
+    } else if (args["-P"].asString() == "dot") {
+        proto = Protocol::DOT;
+        if (!arg_exists("-d", argc, argv))
+            s_delay = 1000;
+        if (!arg_exists("-q", argc, argv))
+            b_count = 100;
+        if (!arg_exists("-c", argc, argv))
+            c_count = 30;
+    } else if (args["-P"].asString() == "doh") {
+        proto = Protocol::DOH;
+        if (!arg_exists("-d", argc, argv))
+            s_delay = 1000;
+        if (!arg_exists("-q", argc, argv))
+            b_count = 100;
+        if (!arg_exists("-c", argc, argv))
+            c_count = 30;
     } else if (args["-P"].asString() == "udp") {
         proto = Protocol::UDP;
     } else {
-        std::cerr << "protocol must be 'udp' or 'tcp'" << std::endl;
+        std::cerr << "protocol must be 'udp', 'tcp', 'dot' or 'doh'" << std::endl;
         return 1;
     }
     auto config = std::make_shared<Config>(
@@ -254,6 +323,7 @@ int main(int argc, char *argv[])
         qgen->set_dnssec(args["--dnssec"].asBool());
         qgen->set_qname(args["-r"].asString());
         qgen->set_qtype(args["-T"].asString());
+        qgen->set_zero_id(proto == Protocol::DOH);
         qgen->init();
     } catch (const std::exception &e) {
         std::cerr << "generator error: " << e.what() << std::endl;
@@ -272,15 +342,101 @@ int main(int argc, char *argv[])
         }
     }
     auto metrics_mgr = std::make_shared<MetricsMgr>(loop, config, cmdline);
+    std::shared_ptr<MetricsExporter> exporter;
+    if (args["--prometheus"]) {
+        try {
+            exporter = std::make_shared<MetricsExporter>(loop, args["--prometheus"].asString());
+        } catch (const std::runtime_error &e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+        metrics_mgr->export_to(exporter);
+    }
+
+    bool paced = args["--pace"].asBool();
+    auto arrival = Pacer::Arrival::CONSTANT;
+    long burst_size{1};
+    std::string arrival_spec = args["--arrival"].asString();
+    if (arrival_spec == "poisson") {
+        arrival = Pacer::Arrival::POISSON;
+    } else if (arrival_spec.rfind("burst:", 0) == 0) {
+        arrival = Pacer::Arrival::BURST;
+        try {
+            burst_size = std::stol(arrival_spec.substr(6));
+        } catch (const std::exception &) {
+            burst_size = 0;
+        }
+        if (burst_size < 1 || burst_size > Pacer::MAX_BURST) {
+            std::cerr << "burst size must be 1 to " << Pacer::MAX_BURST << std::endl;
+            return 1;
+        }
+    } else if (arrival_spec != "constant") {
+        std::cerr << "arrival process must be constant, poisson or burst:N" << std::endl;
+        return 1;
+    }
+    if (arrival != Pacer::Arrival::CONSTANT) {
+        paced = true;
+    }
+    bool find_capacity = args["--find-capacity"].asBool();
+    if (find_capacity && args["--qps-flow"]) {
+        std::cerr << "--find-capacity sets the rate itself, it can't be combined with --qps-flow" << std::endl;
+        return 1;
+    }
+    std::shared_ptr<LoadSweep> sweep;
+    if (args["--sweep"]) {
+        if (config->rate_limit() || args["--qps-flow"] || find_capacity) {
+            std::cerr << "--sweep sets the rate itself, it can't be combined with -Q, --qps-flow or --find-capacity" << std::endl;
+            return 1;
+        }
+        auto range = split(args["--sweep"].asString(), ':');
+        try {
+            if (range.size() != 3 || std::stol(range[0]) < 1 || std::stol(range[1]) < 1 || std::stol(range[2]) < 1) {
+                throw std::invalid_argument("range");
+            }
+            sweep = std::make_shared<LoadSweep>(std::stol(range[0]), std::stol(range[1]), std::stol(range[2]),
+                args["--warmup-secs"].asLong(), args["--step-secs"].asLong(), config->verbosity());
+        } catch (const std::exception &) {
+            std::cerr << "sweep range must be FROM:TO:STEP, in QPS" << std::endl;
+            return 1;
+        }
+    }
+    if (paced && (proto != Protocol::UDP || !(config->rate_limit() || args["--qps-flow"] || find_capacity || sweep))) {
+        std::cerr << "--pace requires UDP and a rate, -Q or --qps-flow" << std::endl;
+        return 1;
+    }
+
+    long outstanding = args["--outstanding"].asLong();
+    if (outstanding) {
+        if (proto != Protocol::UDP || paced || config->rate_limit() || args["--qps-flow"] || find_capacity || sweep || outstanding < 0) {
+            std::cerr << "--outstanding requires UDP, without a rate or pacing" << std::endl;
+            return 1;
+        }
+        // every generator needs at least one query in flight, and its share of the ids
+        c_count = std::min(c_count, outstanding);
+        if (outstanding > std::numeric_limits<uint16_t>::max() / c_count * c_count) {
+            std::cerr << "--outstanding must be between 1 and " << std::numeric_limits<uint16_t>::max() / c_count * c_count
+                      << " with " << c_count << " generators" << std::endl;
+            return 1;
+        }
+    }
 
-    std::queue<std::pair<uint64_t, uint64_t>> qps_flow;
-    std::shared_ptr<TokenBucket> rl;
-    if (config->rate_limit()) {
-        rl = std::make_shared<TokenBucket>(config->rate_limit(), config->rate_limit());
-    } else if (args["--qps-flow"]) {
-        rl = std::make_shared<TokenBucket>();
-        parse_flowspec(args["--qps-flow"].asString(), qps_flow, config->verbosity());
-        flow_change(qps_flow, rl, config->verbosity());
+    std::shared_ptr<QPSFlow> qps_flow;
+    std::shared_ptr<RateLimiter> rl;
+    if (args["--qps-flow"] && !config->rate_limit()) {
+        try {
+            qps_flow = std::make_shared<QPSFlow>(args["--qps-flow"].asString());
+        } catch (const std::invalid_argument &e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
+    // paced sends keep to the rate themselves, the pacer is set up once the generators exist
+    auto burst = RateLimiter::burst_for(std::chrono::milliseconds(s_delay));
+    if (!paced && config->rate_limit()) {
+        rl = std::make_shared<RateLimiter>(config->rate_limit(), burst);
+    } else if (!paced && (qps_flow || find_capacity || sweep)) {
+        // the flow, search or sweep sets the rate as it goes
+        rl = std::make_shared<RateLimiter>(0, burst);
     }
 
     auto traf_config = std::make_shared<TrafGenConfig>();
@@ -288,9 +444,192 @@ int main(int argc, char *argv[])
     traf_config->family = family;
     traf_config->target_address = addr.ip;
     traf_config->port = static_cast<unsigned int>(args["-p"].asLong());
+    if (proto == Protocol::DOT && !arg_exists("-p", argc, argv))
+        traf_config->port = 853;
+    if (proto == Protocol::DOH && !arg_exists("-p", argc, argv))
+        traf_config->port = 443;
+    memcpy(&traf_config->target_sockaddr, node->ai_addr, node->ai_addrlen);
+    if (family == AF_INET) {
+        reinterpret_cast<sockaddr_in *>(&traf_config->target_sockaddr)->sin_port = htons(traf_config->port);
+    } else {
+        reinterpret_cast<sockaddr_in6 *>(&traf_config->target_sockaddr)->sin6_port = htons(traf_config->port);
+    }
     traf_config->s_delay = s_delay;
+    traf_config->paced = paced;
     traf_config->protocol = proto;
     traf_config->r_timeout = args["-t"].asLong();
+    if (std::chrono::seconds(traf_config->r_timeout) + TrafGen::TIMEOUT_INTERVAL >= QueryClock::MAX_AGE) {
+        // in flight queries are timed on 32 bit stamps, which must not wrap before the timeout check
+        std::cerr << "timeout must be less than " << (QueryClock::MAX_AGE - TrafGen::TIMEOUT_INTERVAL).count()
+                  << " seconds" << std::endl;
+        return 1;
+    }
+    traf_config->udp_gso = args["--gso"].asBool();
+    if (traf_config->udp_gso && proto != Protocol::UDP) {
+        std::cerr << "--gso requires UDP" << std::endl;
+        return 1;
+    }
+    if (args["--io-engine"].asString() == "uring") {
+        if (proto != Protocol::UDP) {
+            std::cerr << "io_uring engine requires UDP" << std::endl;
+            return 1;
+        }
+#ifdef HAVE_IO_URING
+        try {
+            traf_config->io_uring = std::make_shared<IOUring>(loop, IOUring::DEFAULT_ENTRIES, args["--sqpoll"].asBool());
+        } catch (const std::runtime_error &e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+#else
+        std::cerr << "not built with io_uring support" << std::endl;
+        return 1;
+#endif
+    } else if (args["--io-engine"].asString() != "libuv") {
+        std::cerr << "i/o engine must be 'libuv' or 'uring'" << std::endl;
+        return 1;
+    } else if (args["--sqpoll"].asBool()) {
+        std::cerr << "--sqpoll requires the uring i/o engine" << std::endl;
+        return 1;
+    }
+    if (args["--raw-iface"]) {
+        if (proto != Protocol::UDP || traf_config->udp_gso || traf_config->io_uring) {
+            std::cerr << "raw send mode requires UDP, without --gso or the uring i/o engine" << std::endl;
+            return 1;
+        }
+#ifdef HAVE_PACKET_RING
+        try {
+            traf_config->raw_sender = std::make_shared<PacketSender>(args["--raw-iface"].asString(), family,
+                traf_config->target_address, traf_config->port,
+                args["--raw-dst-mac"] ? args["--raw-dst-mac"].asString() : "");
+        } catch (const std::runtime_error &e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+#else
+        std::cerr << "not built with raw send support" << std::endl;
+        return 1;
+#endif
+    }
+    traf_config->timestamps = args["--timestamps"].asBool();
+    if (traf_config->timestamps) {
+        if (proto != Protocol::UDP || traf_config->udp_gso || traf_config->io_uring || traf_config->raw_sender) {
+            std::cerr << "--timestamps requires UDP, without --gso, --raw-iface or the uring i/o engine" << std::endl;
+            return 1;
+        }
+    }
+    traf_config->udp_connect = args["--connect"].asBool();
+    if (traf_config->udp_connect) {
+        if (proto != Protocol::UDP) {
+            std::cerr << "--connect requires UDP" << std::endl;
+            return 1;
+        }
+#ifndef HAVE_UV_UDP_CONNECT
+        if (!traf_config->udp_gso && !traf_config->io_uring && !traf_config->timestamps) {
+            std::cerr << "--connect needs libuv 1.27 or newer, or --gso, --timestamps or the uring i/o engine" << std::endl;
+            return 1;
+        }
+#endif
+    }
+    auto socket_count = args["--sockets"].asLong();
+    if (socket_count < 0) {
+        std::cerr << "socket count must be >= 0" << std::endl;
+        return 1;
+    }
+    std::shared_ptr<SourceAddresses> sources;
+    if (args["--source"]) {
+        if (traf_config->raw_sender) {
+            std::cerr << "--source can not be used with --raw-iface" << std::endl;
+            return 1;
+        }
+        try {
+            sources = std::make_shared<SourceAddresses>(family, args["--source"].asString());
+        } catch (const std::runtime_error &e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+        if (!socket_count) {
+            if (sources->size() > MAX_SOURCE_SOCKETS) {
+                std::cerr << "more than " << MAX_SOURCE_SOCKETS << " source addresses, set the number of sockets with --sockets" << std::endl;
+                return 1;
+            }
+            socket_count = sources->size();
+        }
+    }
+    if (socket_count) {
+        if (proto != Protocol::UDP || traf_config->udp_gso || traf_config->io_uring || traf_config->timestamps) {
+            std::cerr << "--sockets and --source require UDP, without --gso, --timestamps or the uring i/o engine" << std::endl;
+            return 1;
+        }
+        if (c_count < 1 || c_count > std::numeric_limits<uint16_t>::max()) {
+            std::cerr << "--sockets needs between 1 and " << std::numeric_limits<uint16_t>::max() << " generators" << std::endl;
+            return 1;
+        }
+        // every socket is a descriptor: raise the soft limit as far as we may
+        rlimit nofile;
+        if (getrlimit(RLIMIT_NOFILE, &nofile) == 0) {
+            if (nofile.rlim_cur < nofile.rlim_max) {
+                nofile.rlim_cur = nofile.rlim_max;
+                setrlimit(RLIMIT_NOFILE, &nofile);
+            }
+            if (nofile.rlim_cur != RLIM_INFINITY && static_cast<rlim_t>(socket_count) + 64 > nofile.rlim_cur) {
+                std::cerr << socket_count << " sockets exceed the open file limit (" << nofile.rlim_cur << ")" << std::endl;
+                return 1;
+            }
+        }
+        try {
+            traf_config->socket_pool = std::make_shared<UDPSocketPool>(loop,
+                metrics_mgr->create_socket_metrics(socket_count, args["--per-socket"].asBool()),
+                traf_config->target_sockaddr, traf_config->udp_connect, sources, socket_count, c_count);
+        } catch (const std::runtime_error &e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
+    traf_config->tls_sni = args["TARGET"].asString();
+    traf_config->tls_resume = !args["--tls-no-resume"].asBool();
+    traf_config->session_queries = args["--session-queries"].asLong();
+    traf_config->doh_authority = args["TARGET"].asString();
+    if (traf_config->port != 443)
+        traf_config->doh_authority += ":" + std::to_string(traf_config->port);
+    traf_config->doh_path = args["--doh-path"].asString();
+    traf_config->doh_max_streams = args["--max-streams"].asLong();
+    if (args["--doh-method"].asString() == "GET") {
+        traf_config->doh_method = HTTPSSession::Method::GET;
+    } else if (args["--doh-method"].asString() == "POST") {
+        traf_config->doh_method = HTTPSSession::Method::POST;
+    } else {
+        std::cerr << "DoH method must be 'GET' or 'POST'" << std::endl;
+        return 1;
+    }
+    if (traf_config->doh_max_streams < 1) {
+        std::cerr << "max streams must be >= 1" << std::endl;
+        return 1;
+    }
+    if (args["--loop-metrics"].asBool() || args["--perf-counters"].asBool()) {
+        traf_config->loop_metrics = metrics_mgr->create_loop_metrics();
+    }
+    if (args["--perf-counters"].asBool()) {
+        try {
+            traf_config->loop_metrics->perf_counters(std::make_shared<PerfCounters>());
+        } catch (const std::runtime_error &e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
+    if (args["--trace"]) {
+        long every = args["--trace-every"].asLong();
+        if (every < 1) {
+            std::cerr << "trace every must be >= 1" << std::endl;
+            return 1;
+        }
+        try {
+            traf_config->tracer = std::make_shared<Tracer>(args["--trace"].asString(), every);
+        } catch (const std::runtime_error &e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
 
     std::vector<std::shared_ptr<TrafGen>> throwers;
     for (auto i = 0; i < c_count; i++) {
@@ -300,9 +639,48 @@ int main(int argc, char *argv[])
             traf_config,
             qgen,
             rl));
+        if (outstanding) {
+            throwers[i]->closed_loop(outstanding / c_count + (i < outstanding % c_count ? 1 : 0));
+        }
         throwers[i]->start();
     }
 
+    std::shared_ptr<Pacer> pacer;
+    if (paced) {
+        // spread each round of due queries evenly over the generators, the remainder going to
+        // the next ones in turn
+        size_t next{0};
+        try {
+            pacer = std::make_shared<Pacer>(loop, metrics_mgr->create_pacer_metrics(), arrival, burst_size,
+                [&throwers, next](const std::vector<Pacer::time_point> &intended) mutable {
+                    long share = intended.size() / throwers.size();
+                    long extra = intended.size() % throwers.size();
+                    auto t = intended.data();
+                    if (share) {
+                        for (auto &g : throwers) {
+                            g->send(t, share);
+                            t += share;
+                        }
+                    }
+                    for (long i = 0; i < extra; i++) {
+                        throwers[next]->send(t++, 1);
+                        next = (next + 1) % throwers.size();
+                    }
+                });
+        } catch (const std::runtime_error &e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+        if (config->rate_limit()) {
+            pacer->rate(config->rate_limit());
+        }
+    }
+
+    if (qps_flow) {
+        qps_flow->start(loop, metrics_mgr->create_flow_metrics(),
+            [rl, pacer](uint64_t qps) { set_rate(qps, rl, pacer); }, config->verbosity());
+    }
+
     auto have_in_flight = [&throwers]() {
         for (const auto &i : throwers) {
             if (i->in_flight_cnt()) {
@@ -319,10 +697,16 @@ int main(int argc, char *argv[])
             run_timer->stop();
         if (qgen_loop_timer.get())
             qgen_loop_timer->stop();
+        if (pacer)
+            pacer->stop();
+        if (qps_flow)
+            qps_flow->stop();
         for (auto &t : throwers) {
             t->stop();
         }
         metrics_mgr->stop();
+        if (exporter)
+            exporter->stop();
         if (have_in_flight() && config->verbosity()) {
             std::cout << "stopping, waiting up to " << traf_config->r_timeout << "s for in flight to finish..." << std::endl;
         }
@@ -332,6 +716,38 @@ int main(int argc, char *argv[])
         shutdown();
     };
 
+    // shut down on the next loop iteration: for the end of a capacity search or sweep, which is
+    // found from within the metrics period that is being reported
+    auto shutdown_soon = [&loop, &shutdown]() {
+        auto t = loop->resource<uvw::TimerHandle>();
+        t->on<uvw::TimerEvent>([&shutdown](const auto &, auto &handle) {
+            handle.close();
+            shutdown();
+        });
+        t->start(uvw::TimerHandle::Time{0}, uvw::TimerHandle::Time{0});
+    };
+
+    std::shared_ptr<CapacitySearch> capacity;
+    if (find_capacity) {
+        uint64_t start_qps = config->rate_limit() ? config->rate_limit() : 1000;
+        double slo_p99, slo_loss;
+        try {
+            slo_p99 = std::stod(args["--slo-p99"].asString());
+            slo_loss = std::stod(args["--slo-loss"].asString());
+        } catch (const std::exception &) {
+            std::cerr << "SLO thresholds must be numbers" << std::endl;
+            return 1;
+        }
+        capacity = std::make_shared<CapacitySearch>(start_qps, args["--step-secs"].asLong(), slo_p99, slo_loss,
+            [rl, pacer](uint64_t qps) { set_rate(qps, rl, pacer); }, shutdown_soon, config->verbosity());
+        metrics_mgr->on_period([capacity](const PeriodStats &stats) { capacity->period(stats); });
+        capacity->start();
+    }
+    if (sweep) {
+        sweep->start([rl, pacer](uint64_t qps) { set_rate(qps, rl, pacer); }, shutdown_soon);
+        metrics_mgr->on_period([sweep](const PeriodStats &stats) { sweep->period(stats); });
+    }
+
     if (runtime_limit != 0) {
         run_timer = loop->resource<uvw::TimerHandle>();
         run_timer->on<uvw::TimerEvent>([&shutdown](const auto &, auto &) { shutdown(); });
@@ -355,17 +771,35 @@ int main(int argc, char *argv[])
 
     if (config->verbosity()) {
         std::cout << "flaming target " << args["TARGET"] << " (" << traf_config->target_address << ") on port "
-                  << args["-p"].asLong()
+                  << traf_config->port
                   << " with " << c_count << " concurrent generators, each sending " << b_count
                   << " queries every " << s_delay << "ms on protocol " << args["-P"].asString()
                   << std::endl;
+        if (traf_config->socket_pool) {
+            std::cout << "sharing " << traf_config->socket_pool->size() << " UDP sockets";
+            if (sources) {
+                std::cout << " from " << std::min<uint64_t>(sources->size(), traf_config->socket_pool->size()) << " source addresses";
+            }
+            std::cout << ", " << (std::numeric_limits<uint16_t>::max() / c_count) << " query ids per generator" << std::endl;
+        }
+        if (outstanding) {
+            std::cout << "closed loop, keeping " << outstanding << " queries in flight" << std::endl;
+        }
+        if (paced) {
+            std::cout << "pacing " << arrival_spec << " arrivals, latency measured from intended send times" << std::endl;
+        }
         std::cout << "query generator [" << qgen->name() << "] contains " << qgen->size() << " record(s)" << std::endl;
         if (args["-R"].asBool()) {
             std::cout << "query list randomized" << std::endl;
         }
     }
 
-    metrics_mgr->start();
+    try {
+        metrics_mgr->start();
+    } catch (const std::runtime_error &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
     loop->run();
 
     // break from loop with ^C or timer
@@ -374,5 +808,37 @@ int main(int argc, char *argv[])
     // when loop is complete, finalize metrics
     metrics_mgr->finalize();
 
+    if (auto &tracer = traf_config->tracer) {
+        tracer->close();
+        if (config->verbosity()) {
+            std::cout << "trace: " << tracer->written() << " queries written to " << tracer->path();
+            if (tracer->dropped()) {
+                std::cout << ", " << tracer->dropped() << " dropped (writer fell behind)";
+            }
+            std::cout << std::endl;
+        }
+    }
+
+    if (capacity) {
+        std::cout << capacity->summary().dump(4) << std::endl;
+    }
+    if (sweep) {
+        std::string out = args["--sweep-out"] ? args["--sweep-out"].asString() : "";
+        if (out.empty()) {
+            std::cout << sweep->table().dump(4) << std::endl;
+        } else {
+            std::ofstream f(out);
+            if (out.size() > 4 && out.compare(out.size() - 4, 4, ".csv") == 0) {
+                f << sweep->csv();
+            } else {
+                f << sweep->table().dump(4) << std::endl;
+            }
+            if (!f) {
+                std::cerr << "unable to write sweep table to " << out << std::endl;
+                return 1;
+            }
+        }
+    }
+
     return 0;
 }
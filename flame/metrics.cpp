@@ -1,19 +1,125 @@
 // Copyright 2019 NSONE, Inc
 
+#include <algorithm>
+#include <array>
+#include <cmath>
 #include <ctime>
 #include <iostream>
 #include <sstream>
+#include <tuple>
 
-#include "json.hpp"
+#include "exporter.h"
 #include "metrics.h"
+#include "metricswriter.h"
+#include "probes.h"
 #include "version.h"
 
-#include <ldns/util.h>
+#include <sys/resource.h>
 
-using json = nlohmann::json;
+#include <ldns/util.h>
 
 extern ldns_lookup_table ldns_rcodes[];
 
+// latency percentiles reported, with their names in the console and metric output. the metric keys
+// are spelled out in *_RESPONSE_KEYS below.
+static const std::vector<std::pair<double, std::string>> PERCENTILES{
+    {50.0, "p50"}, {90.0, "p90"}, {99.0, "p99"}, {99.9, "p99.9"}, {99.99, "p99.99"}};
+
+static double to_ms(double ns)
+{
+    return ns * Metrics::HR_TO_MSEC_MULT;
+}
+
+static double to_us(double ns)
+{
+    return ns * Metrics::HR_TO_USEC_MULT;
+}
+
+// keys of a latency histogram's mean, min, max and PERCENTILES, in that order. written every period,
+// so they are not built on the fly.
+using LatencyKeys = std::array<const char *, 8>;
+static const LatencyKeys TOTAL_RESPONSE_KEYS{"total_response_avg_ms", "total_response_min_ms",
+    "total_response_max_ms", "total_response_p50_ms", "total_response_p90_ms", "total_response_p99_ms",
+    "total_response_p99.9_ms", "total_response_p99.99_ms"};
+static const LatencyKeys PERIOD_RESPONSE_KEYS{"period_response_avg_ms", "period_response_min_ms",
+    "period_response_max_ms", "period_response_p50_ms", "period_response_p90_ms", "period_response_p99_ms",
+    "period_response_p99.9_ms", "period_response_p99.99_ms"};
+
+// mean, min, max and percentiles of a latency histogram
+static void write_latency(MetricsWriter &w, const LatencyKeys &keys, const LatencyHistogram &h)
+{
+    w.field(keys[0], to_ms(h.mean()));
+    w.field(keys[1], to_ms(h.min()));
+    w.field(keys[2], to_ms(h.max()));
+    for (size_t i = 0; i < PERCENTILES.size(); i++) {
+        w.field(keys[3 + i], to_ms(h.percentile(PERCENTILES[i].first)));
+    }
+}
+
+// "p50/p90/p99/p99.9/p99.99: a/b/c/d/e"
+static std::string percentiles_text(const LatencyHistogram &h)
+{
+    std::ostringstream names, values;
+    for (size_t i = 0; i < PERCENTILES.size(); i++) {
+        names << (i ? "/" : "") << PERCENTILES[i].second;
+        values << (i ? "/" : "") << to_ms(h.percentile(PERCENTILES[i].first));
+    }
+    return names.str() + ": " + values.str();
+}
+
+static const char *rcode_name(size_t rcode)
+{
+    auto r = ldns_lookup_by_id(ldns_rcodes, static_cast<int>(rcode));
+    return r ? r->name : "UNKNOWN";
+}
+
+static double avg_size(u_long bytes, u_long count)
+{
+    return count ? static_cast<double>(bytes) / count : 0.0;
+}
+
+static double pct(u_long part, u_long whole)
+{
+    return whole ? 100.0 * part / whole : 0.0;
+}
+
+// loop time names, by LoopMetrics::Section, and their share of the loop's time as metric keys
+static const char *const LOOP_SECTIONS[] = {"other", "send", "generate", "receive", "timeouts"};
+static const char *const TOTAL_LOOP_KEYS[] = {"total_loop_other_pct", "total_loop_send_pct",
+    "total_loop_generate_pct", "total_loop_receive_pct", "total_loop_timeouts_pct"};
+static const char *const PERIOD_LOOP_KEYS[] = {"period_loop_other_pct", "period_loop_send_pct",
+    "period_loop_generate_pct", "period_loop_receive_pct", "period_loop_timeouts_pct"};
+static_assert(sizeof(TOTAL_LOOP_KEYS) / sizeof(TOTAL_LOOP_KEYS[0]) == LoopMetrics::SECTIONS, "a key per section");
+
+// query generation is only timed apart from sending when counting hardware events
+static bool shown(const LoopMetrics &lm, size_t section)
+{
+    return section != LoopMetrics::GENERATE || lm.counting();
+}
+
+// the queries a section's hardware counts are per: responses for receiving, timeouts for
+// timeouts, otherwise queries sent
+static u_long perf_queries(size_t section, u_long sent, u_long received, u_long timeouts)
+{
+    switch (section) {
+    case LoopMetrics::RECEIVE:
+        return received;
+    case LoopMetrics::TIMEOUTS:
+        return timeouts;
+    default:
+        return sent;
+    }
+}
+
+MetricsMgr::MetricsMgr(std::shared_ptr<uvw::Loop> l, std::shared_ptr<Config> c, const std::string &cmdline)
+    : _loop(l)
+    , _config(c)
+    , _cmdline(cmdline)
+{
+}
+
+MetricsMgr::~MetricsMgr() = default;
+
 std::shared_ptr<Metrics> MetricsMgr::create_trafgen_metrics()
 {
     auto m = std::make_shared<Metrics>(_loop, *this);
@@ -21,6 +127,131 @@ std::shared_ptr<Metrics> MetricsMgr::create_trafgen_metrics()
     return m;
 }
 
+// min, average and max of per socket counts
+static std::tuple<u_long, u_long, u_long> spread(const std::vector<u_long> &v)
+{
+    auto mm = std::minmax_element(v.begin(), v.end());
+    u_long sum{0};
+    for (auto i : v) {
+        sum += i;
+    }
+    return std::make_tuple(*mm.first, sum / v.size(), *mm.second);
+}
+
+std::shared_ptr<SocketMetrics> MetricsMgr::create_socket_metrics(size_t count, bool detail)
+{
+    _socket_metrics = std::make_shared<SocketMetrics>(count, detail);
+    return _socket_metrics;
+}
+
+std::shared_ptr<PacerMetrics> MetricsMgr::create_pacer_metrics()
+{
+    _pacer_metrics = std::make_shared<PacerMetrics>();
+    return _pacer_metrics;
+}
+
+std::shared_ptr<FlowMetrics> MetricsMgr::create_flow_metrics()
+{
+    _flow_metrics = std::make_shared<FlowMetrics>();
+    return _flow_metrics;
+}
+
+std::shared_ptr<LoopMetrics> MetricsMgr::create_loop_metrics()
+{
+    _loop_metrics = std::make_shared<LoopMetrics>(_loop);
+    return _loop_metrics;
+}
+
+constexpr double LoopMetrics::SATURATED_PCT;
+constexpr std::chrono::microseconds LoopMetrics::LATE;
+
+static u_long to_ns(const timeval &tv)
+{
+    return tv.tv_sec * 1000000000UL + tv.tv_usec * 1000UL;
+}
+
+LoopMetrics::LoopMetrics(std::shared_ptr<uvw::Loop> loop)
+    : _loop(loop)
+{
+#ifdef HAVE_UV_METRICS_IDLE_TIME
+    uv_loop_configure(_loop->raw(), UV_METRICS_IDLE_TIME);
+    // each iteration's busy time is the time from the previous prepare, less the time spent polling
+    _prepare = _loop->resource<uvw::PrepareHandle>();
+    _prepare->on<uvw::PrepareEvent>([this](const auto &, auto &) {
+        auto now = clock::now();
+        u_long idle = idle_time();
+        if (_iteration_start != clock::time_point()) {
+            u_long elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(now - _iteration_start).count();
+            u_long busy = elapsed - std::min(elapsed, idle - _iteration_idle_start);
+            _period_iteration_max = std::max(_period_iteration_max, busy);
+        }
+        _iteration_start = now;
+        _iteration_idle_start = idle;
+    });
+    _prepare->start();
+    // doesn't keep the loop running
+    _prepare->unreference();
+#endif
+    _mark = _period_start = clock::now();
+    _period_idle_start = idle_time();
+    _period_cpu_start = cpu_time();
+    _period_loop_cpu_start = loop_cpu_time();
+}
+
+void LoopMetrics::perf_counters(std::shared_ptr<PerfCounters> perf)
+{
+    _perf = std::move(perf);
+    _perf_mark = _perf->read();
+}
+
+void LoopMetrics::count_perf()
+{
+    auto now = _perf->read();
+    auto &section = _perf_section[_section];
+    for (size_t i = 0; i < PerfCounters::COUNTERS; i++) {
+        // scaled counts may step back a little
+        section[i] += (now[i] > _perf_mark[i]) ? now[i] - _perf_mark[i] : 0;
+    }
+    _perf_mark = now;
+}
+
+void LoopMetrics::close()
+{
+    if (_prepare) {
+        _prepare->stop();
+        _prepare->close();
+        _prepare = nullptr;
+    }
+}
+
+u_long LoopMetrics::idle_time() const
+{
+#ifdef HAVE_UV_METRICS_IDLE_TIME
+    return uv_metrics_idle_time(_loop->raw());
+#else
+    return 0;
+#endif
+}
+
+u_long LoopMetrics::cpu_time()
+{
+    rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return to_ns(ru.ru_utime) + to_ns(ru.ru_stime);
+}
+
+u_long LoopMetrics::loop_cpu_time()
+{
+#ifdef RUSAGE_THREAD
+    // metrics are collected on the loop thread
+    rusage ru;
+    getrusage(RUSAGE_THREAD, &ru);
+    return to_ns(ru.ru_utime) + to_ns(ru.ru_stime);
+#else
+    return cpu_time();
+#endif
+}
+
 void MetricsMgr::start()
 {
     time_t now;
@@ -36,12 +267,12 @@ void MetricsMgr::start()
     _run_id = sstr.str();
 
     if (!_config->output_file().empty()) {
-        _metric_file.open(_config->output_file(), std::ofstream::out | std::ofstream::app);
-        if (!_metric_file.is_open()) {
-            throw std::runtime_error("unable to open metric output file");
-        }
+        _writer = std::make_unique<MetricsWriter>(_config->output_file());
         header_to_disk();
     }
+    if (_exporter) {
+        _exporter->update(openmetrics());
+    }
     _metric_period_timer = _loop->resource<uvw::TimerHandle>();
     _metric_period_timer->on<uvw::TimerEvent>([this](const auto &, auto &) {
         this->periodic_stats();
@@ -62,50 +293,249 @@ void MetricsMgr::stop()
     periodic_stats();
     _metric_period_timer->stop();
     _metric_period_timer->close();
+    if (_loop_metrics) {
+        _loop_metrics->close();
+    }
 }
 
 void MetricsMgr::header_to_disk()
 {
-    json j;
-
-    j["version"] = FLAME_VERSION_NUM;
-    j["cmdline"] = _cmdline;
-    j["start_timestamp"] = _start_ts;
-    j["run_id"] = _run_id;
-
-    _metric_file << j << std::endl;
+    auto &w = *_writer;
+    w.begin_object();
+    w.field("version", FLAME_VERSION_NUM);
+    w.field("cmdline", _cmdline);
+    w.field("start_timestamp", _start_ts);
+    w.field("run_id", _run_id);
+    w.end_object();
+    w.commit();
 }
 
 void MetricsMgr::flush_to_disk()
 {
     update_runtime();
-    json j;
-    j["total_s_count"] = _agg_total_s_count;
-    j["total_r_count"] = _agg_total_r_count;
-    j["period_timeouts"] = _agg_period_timeouts;
-    j["total_timeouts"] = _agg_total_timeouts;
-    j["period_in_flight"] = _agg_period_in_flight;
-    j["total_bad_count"] = _agg_total_bad_count;
-    j["period_bad_count"] = _agg_period_bad_count;
-    j["total_response_avg_ms"] = _agg_total_response_avg_ms;
-    j["total_response_min_ms"] = _agg_total_response_min_ms;
-    j["total_response_max_ms"] = _agg_total_response_max_ms;
-    j["period_response_avg_ms"] = _agg_period_response_avg_ms;
-    j["period_response_min_ms"] = _agg_period_response_min_ms;
-    j["period_response_max_ms"] = _agg_period_response_max_ms;
-    j["total_qps_r_avg"] = _agg_total_qps_r_avg;
-    j["total_qps_s_avg"] = _agg_total_qps_s_avg;
-    j["total_net_errors"] = _agg_total_net_errors;
-    j["total_tcp_connections"] = _agg_total_tcp_connections;
-    j["total_pkt_size_avg"] = _agg_total_pkt_size_avg;
-    j["period_net_errors"] = _agg_period_net_errors;
-    j["period_pkt_size_avg"] = _agg_period_pkt_size_avg;
-    j["runtime_s"] = _runtime_s;
-    j["run_id"] = _run_id;
-    for (auto i : _response_codes) {
-        j["total_responses"][ldns_lookup_by_id(ldns_rcodes, i.first)->name] = i.second;
-    }
-    _metric_file << j << std::endl;
+    auto &w = *_writer;
+    w.begin_object();
+    w.field("total_s_count", _agg_total_s_count);
+    w.field("total_r_count", _agg_total_r_count);
+    w.field("period_timeouts", _agg_period_timeouts);
+    w.field("total_timeouts", _agg_total_timeouts);
+    w.field("period_in_flight", _agg_period_in_flight);
+    w.field("total_bad_count", _agg_total_bad_count);
+    w.field("period_bad_count", _agg_period_bad_count);
+    write_latency(w, TOTAL_RESPONSE_KEYS, _agg_total_latency);
+    write_latency(w, PERIOD_RESPONSE_KEYS, _agg_period_latency);
+    w.field("total_qps_r_avg", _agg_total_qps_r_avg);
+    w.field("total_qps_s_avg", _agg_total_qps_s_avg);
+    w.field("total_net_errors", _agg_total_net_errors);
+    w.field("total_tcp_connections", _agg_total_tcp_connections);
+    if (_agg_total_tls_handshakes) {
+        w.field("total_tls_handshakes", _agg_total_tls_handshakes);
+        w.field("total_tls_resumed", _agg_total_tls_resumed);
+        w.field("total_tls_handshake_avg_ms", _agg_total_tls_handshake_ms / _agg_total_tls_handshakes);
+        w.field("total_tls_handshake_cpu_avg_ms", _agg_total_tls_handshake_cpu_ms / _agg_total_tls_handshakes);
+        w.field("period_tls_handshakes", _agg_period_tls_handshakes);
+        w.field("period_tls_resumed", _agg_period_tls_resumed);
+    }
+    if (_agg_total_send_syscalls) {
+        w.field("total_send_syscalls", _agg_total_send_syscalls);
+        w.field("total_queries_per_send_syscall", (double)_agg_total_syscall_s_count / _agg_total_send_syscalls);
+    }
+    if (_agg_total_max_streams) {
+        w.field("total_max_streams", _agg_total_max_streams);
+        w.field("period_max_streams", _agg_period_max_streams);
+    }
+    if (_agg_total_kernel_timed) {
+        w.field("total_kernel_timed", _agg_total_kernel_timed);
+        w.field("total_hw_timed", _agg_total_hw_timed);
+        w.field("total_send_overhead_avg_us", to_us((double)_agg_total_send_overhead_ns / _agg_total_kernel_timed));
+        w.field("total_send_overhead_max_us", to_us(_agg_total_send_overhead_max_ns));
+        w.field("total_recv_overhead_avg_us", to_us((double)_agg_total_recv_overhead_ns / _agg_total_kernel_timed));
+        w.field("total_recv_overhead_max_us", to_us(_agg_total_recv_overhead_max_ns));
+        w.field("period_kernel_timed", _agg_period_kernel_timed);
+        if (_agg_period_kernel_timed) {
+            w.field("period_send_overhead_avg_us", to_us((double)_agg_period_send_overhead_ns / _agg_period_kernel_timed));
+            w.field("period_recv_overhead_avg_us", to_us((double)_agg_period_recv_overhead_ns / _agg_period_kernel_timed));
+        }
+    }
+    w.field("total_pkt_size_avg", avg_size(_agg_total_s_bytes, _agg_total_s_count));
+    w.field("period_net_errors", _agg_period_net_errors);
+    w.field("period_pkt_size_avg", avg_size(_agg_period_s_bytes, _agg_period_s_count));
+    w.field("runtime_s", _runtime_s);
+    w.field("run_id", _run_id);
+    if (_agg_total_r_count > _agg_total_bad_count) {
+        w.begin_object("total_responses");
+        for (size_t i = 0; i < _response_codes.size(); i++) {
+            if (_response_codes[i]) {
+                w.field(rcode_name(i), _response_codes[i]);
+            }
+        }
+        w.end_object();
+    }
+    if (_pacer_metrics && _pacer_metrics->_total_count) {
+        auto &pm = *_pacer_metrics;
+        w.field("total_pacing_lag_avg_us", (double)pm._total_lag_sum / pm._total_count * Metrics::HR_TO_USEC_MULT);
+        w.field("total_pacing_lag_max_us", pm._total_lag_max * Metrics::HR_TO_USEC_MULT);
+        w.field("total_pacing_jitter_avg_us", (pm._total_ticks ? (double)pm._total_jitter_sum / pm._total_ticks : 0.0) * Metrics::HR_TO_USEC_MULT);
+        w.field("total_pacing_jitter_max_us", pm._total_jitter_max * Metrics::HR_TO_USEC_MULT);
+        if (pm._period_count) {
+            w.field("period_pacing_lag_avg_us", (double)pm._period_lag_sum / pm._period_count * Metrics::HR_TO_USEC_MULT);
+            w.field("period_pacing_lag_max_us", pm._period_lag_max * Metrics::HR_TO_USEC_MULT);
+            w.field("period_pacing_jitter_avg_us", (pm._period_ticks ? (double)pm._period_jitter_sum / pm._period_ticks : 0.0) * Metrics::HR_TO_USEC_MULT);
+            w.field("period_pacing_jitter_max_us", pm._period_jitter_max * Metrics::HR_TO_USEC_MULT);
+        }
+    }
+    if (_flow_metrics && _flow_metrics->_total_periods) {
+        auto &fm = *_flow_metrics;
+        w.field("total_flow_error_avg_pct", fm._total_abs_error_pct / fm._total_periods);
+        w.field("total_flow_error_max_pct", fm._total_max_error_pct);
+        if (fm._period_valid) {
+            w.field("period_flow_error_pct", fm._period_error_pct);
+        }
+    }
+    if (_loop_metrics && _loop_metrics->_total_wall) {
+        auto &lm = *_loop_metrics;
+#ifdef HAVE_UV_METRICS_IDLE_TIME
+        w.field("total_loop_busy_pct", pct(lm._total_busy, lm._total_wall));
+#endif
+        w.field("total_loop_cpu_pct", pct(lm._total_loop_cpu, lm._total_wall));
+        w.field("total_cpu_pct", pct(lm._total_cpu, lm._total_wall));
+        w.field("total_loop_iteration_max_us", lm._total_iteration_max * Metrics::HR_TO_USEC_MULT);
+        for (size_t i = LoopMetrics::SEND; i < LoopMetrics::SECTIONS; i++) {
+            if (shown(lm, i)) {
+                w.field(TOTAL_LOOP_KEYS[i], pct(lm._total_section[i], lm._total_wall));
+            }
+        }
+        if (lm._perf) {
+            // hardware counts per query, by section
+            w.field("total_perf_user_only", lm._perf->user_only());
+            w.begin_object("total_perf_per_query");
+            for (size_t i = 0; i < LoopMetrics::SECTIONS; i++) {
+                u_long queries = perf_queries(i, _agg_total_s_count, _agg_total_r_count, _agg_total_timeouts);
+                if (!queries) {
+                    continue;
+                }
+                w.begin_object(LOOP_SECTIONS[i]);
+                for (size_t c = 0; c < PerfCounters::COUNTERS; c++) {
+                    w.field(PerfCounters::name(static_cast<PerfCounters::Counter>(c)), (double)lm._perf_section[i][c] / queries);
+                }
+                w.end_object();
+            }
+            w.end_object();
+        }
+        if (lm._total_timer_count) {
+            w.field("total_send_timer_late_avg_us", (double)lm._total_timer_late_sum / lm._total_timer_count * Metrics::HR_TO_USEC_MULT);
+            w.field("total_send_timer_late_max_us", lm._total_timer_late_max * Metrics::HR_TO_USEC_MULT);
+        }
+        w.field("total_client_bound_periods", lm._total_bound_periods);
+        if (lm._period_wall) {
+            if (lm._period_busy_pct >= 0) {
+                w.field("period_loop_busy_pct", lm._period_busy_pct);
+            }
+            w.field("period_loop_cpu_pct", lm._period_loop_cpu_pct);
+            w.field("period_cpu_pct", lm._period_cpu_pct);
+            w.field("period_loop_iteration_max_us", lm._period_iteration_max * Metrics::HR_TO_USEC_MULT);
+            for (size_t i = LoopMetrics::SEND; i < LoopMetrics::SECTIONS; i++) {
+                if (!shown(lm, i)) {
+                    continue;
+                }
+                w.field(PERIOD_LOOP_KEYS[i], pct(lm._period_section[i], lm._period_wall));
+            }
+            if (lm._period_timer_count) {
+                w.field("period_send_timer_late_avg_us", (double)lm._period_timer_late_sum / lm._period_timer_count * Metrics::HR_TO_USEC_MULT);
+                w.field("period_send_timer_late_max_us", lm._period_timer_late_max * Metrics::HR_TO_USEC_MULT);
+            }
+            w.field("period_client_bound", lm._period_bound != nullptr);
+            if (lm._period_bound) {
+                w.field("period_client_bound_reason", lm._period_bound);
+            }
+        }
+    }
+    if (_socket_metrics) {
+        auto &sm = *_socket_metrics;
+        auto s = spread(sm._s_count);
+        auto r = spread(sm._r_count);
+        w.begin_object("sockets");
+        w.field("count", sm._ports.size());
+        w.begin_object("total_s_count");
+        w.field("min", std::get<0>(s));
+        w.field("avg", std::get<1>(s));
+        w.field("max", std::get<2>(s));
+        w.end_object();
+        w.begin_object("total_r_count");
+        w.field("min", std::get<0>(r));
+        w.field("avg", std::get<1>(r));
+        w.field("max", std::get<2>(r));
+        w.end_object();
+        if (sm._detail) {
+            w.begin_array("list");
+            for (size_t i = 0; i < sm._ports.size(); i++) {
+                w.begin_object();
+                w.field("address", sm._addresses[i]);
+                w.field("port", sm._ports[i]);
+                w.field("total_s_count", sm._s_count[i]);
+                w.field("total_r_count", sm._r_count[i]);
+                w.field("total_net_errors", sm._net_errors[i]);
+                w.end_object();
+            }
+            w.end_array();
+        }
+        w.end_object();
+    }
+    w.end_object();
+}
+
+// latency histogram buckets exported, nanoseconds: 100us to 10s
+static const std::vector<uint64_t> EXPORT_BUCKETS{100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000,
+    25000000, 50000000, 100000000, 250000000, 500000000, 1000000000, 2500000000, 5000000000, 10000000000};
+
+std::string MetricsMgr::openmetrics()
+{
+    update_runtime();
+    std::ostringstream out;
+    auto counter = [&out](const std::string &name, const std::string &help, u_long value) {
+        out << "# TYPE flame_" << name << " counter\n# HELP flame_" << name << " " << help << "\n"
+            << "flame_" << name << "_total " << value << "\n";
+    };
+    auto gauge = [&out](const std::string &name, const std::string &help, double value) {
+        out << "# TYPE flame_" << name << " gauge\n# HELP flame_" << name << " " << help << "\n"
+            << "flame_" << name << " " << value << "\n";
+    };
+
+    out << "# TYPE flame_run info\n# HELP flame_run Run being measured.\n"
+        << "flame_run_info{run_id=\"" << _run_id << "\",version=\"" << FLAME_VERSION_NUM << "\"} 1\n";
+    gauge("runtime_seconds", "Seconds since the run started.", _runtime_s);
+    counter("queries_sent", "Queries sent.", _agg_total_s_count);
+    counter("responses_received", "Responses received, including bad ones.", _agg_total_r_count);
+    counter("bad_responses", "Responses that failed to parse or matched no query in flight.", _agg_total_bad_count);
+    counter("timeouts", "Queries that timed out.", _agg_total_timeouts);
+    counter("net_errors", "Network errors.", _agg_total_net_errors);
+    counter("tcp_connections", "TCP connections opened.", _agg_total_tcp_connections);
+    counter("tls_handshakes", "TLS handshakes completed.", _agg_total_tls_handshakes);
+    counter("tls_resumed", "TLS handshakes that resumed a session.", _agg_total_tls_resumed);
+    gauge("in_flight", "Queries in flight at the end of the last period.", _agg_period_in_flight);
+
+    out << "# TYPE flame_responses counter\n# HELP flame_responses Responses by rcode.\n";
+    for (size_t i = 0; i < _response_codes.size(); i++) {
+        if (_response_codes[i]) {
+            out << "flame_responses_total{rcode=\"" << rcode_name(i) << "\"} " << _response_codes[i] << "\n";
+        }
+    }
+
+    // seconds, the OpenMetrics base unit
+    auto &h = _agg_total_latency;
+    auto counts = h.cumulative(EXPORT_BUCKETS);
+    out << "# TYPE flame_response_latency_seconds histogram\n"
+        << "# HELP flame_response_latency_seconds Response latency.\n";
+    for (size_t i = 0; i < EXPORT_BUCKETS.size(); i++) {
+        out << "flame_response_latency_seconds_bucket{le=\"" << EXPORT_BUCKETS[i] * Metrics::HR_TO_SEC_MULT << "\"} "
+            << counts[i] << "\n";
+    }
+    out << "flame_response_latency_seconds_bucket{le=\"+Inf\"} " << h.count() << "\n"
+        << "flame_response_latency_seconds_sum " << h.sum() * Metrics::HR_TO_SEC_MULT << "\n"
+        << "flame_response_latency_seconds_count " << h.count() << "\n";
+
+    out << "# EOF\n";
+    return out.str();
 }
 
 void MetricsMgr::display_final_text()
@@ -117,21 +547,119 @@ void MetricsMgr::display_final_text()
     std::cout << "runtime     : " << _runtime_s << " s" << std::endl;
     std::cout << "total sent  : " << _agg_total_s_count << std::endl;
     std::cout << "total rcvd  : " << _agg_total_r_count << std::endl;
-    std::cout << "min resp    : " << _agg_total_response_min_ms << " ms" << std::endl;
-    std::cout << "avg resp    : " << _agg_total_response_avg_ms << " ms" << std::endl;
-    std::cout << "max resp    : " << _agg_total_response_max_ms << " ms" << std::endl;
+    std::cout << "min resp    : " << to_ms(_agg_total_latency.min()) << " ms" << std::endl;
+    std::cout << "avg resp    : " << to_ms(_agg_total_latency.mean()) << " ms" << std::endl;
+    std::cout << "max resp    : " << to_ms(_agg_total_latency.max()) << " ms" << std::endl;
+    std::cout << "resp pctl   : " << percentiles_text(_agg_total_latency) << " ms" << std::endl;
     std::cout << "avg r qps   : " << _agg_total_qps_r_avg << std::endl;
     std::cout << "avg s qps   : " << _agg_total_qps_s_avg << std::endl;
-    std::cout << "avg pkt     : " << _agg_total_pkt_size_avg << " bytes" << std::endl;
+    std::cout << "avg pkt     : " << avg_size(_agg_total_s_bytes, _agg_total_s_count) << " bytes" << std::endl;
     std::cout << "tcp conn.   : " << _agg_total_tcp_connections << std::endl;
+    if (_agg_total_tls_handshakes) {
+        std::cout << "tls hshakes : " << _agg_total_tls_handshakes << " ("
+                  << (((double)_agg_total_tls_resumed / _agg_total_tls_handshakes) * 100) << "% resumed)" << std::endl;
+        std::cout << "avg hshake  : " << (_agg_total_tls_handshake_ms / _agg_total_tls_handshakes) << " ms, "
+                  << (_agg_total_tls_handshake_cpu_ms / _agg_total_tls_handshakes) << " ms cpu" << std::endl;
+    }
+    if (_agg_total_send_syscalls) {
+        std::cout << "send calls  : " << _agg_total_send_syscalls << " ("
+                  << ((double)_agg_total_syscall_s_count / _agg_total_send_syscalls) << " queries per call)" << std::endl;
+    }
+    if (_agg_total_max_streams) {
+        std::cout << "max streams : " << _agg_total_max_streams << " per connection" << std::endl;
+    }
+    if (_agg_total_kernel_timed) {
+        std::cout << "timestamps  : " << _agg_total_kernel_timed << " of " << _agg_total_r_count << " responses kernel timed ("
+                  << _agg_total_hw_timed << " in hardware)" << std::endl;
+        std::cout << "user space  : send avg/max " << to_us((double)_agg_total_send_overhead_ns / _agg_total_kernel_timed) << "/"
+                  << to_us(_agg_total_send_overhead_max_ns) << " us, receive avg/max "
+                  << to_us((double)_agg_total_recv_overhead_ns / _agg_total_kernel_timed) << "/"
+                  << to_us(_agg_total_recv_overhead_max_ns) << " us" << std::endl;
+    }
     std::cout << "timeouts    : " << _agg_total_timeouts << " ("
               << (((double)_agg_total_timeouts / _agg_total_s_count) * 100) << "%) " << std::endl;
     std::cout << "bad recv    : " << _agg_total_bad_count << std::endl;
     std::cout << "net errors  : " << _agg_total_net_errors << std::endl;
-    if (_response_codes.size()) {
+    if (_pacer_metrics && _pacer_metrics->_total_count) {
+        auto &pm = *_pacer_metrics;
+        std::cout << "pacing      : lag avg/max " << ((double)pm._total_lag_sum / pm._total_count * Metrics::HR_TO_USEC_MULT) << "/"
+                  << (pm._total_lag_max * Metrics::HR_TO_USEC_MULT) << " us, jitter avg/max "
+                  << ((pm._total_ticks ? (double)pm._total_jitter_sum / pm._total_ticks : 0.0) * Metrics::HR_TO_USEC_MULT) << "/"
+                  << (pm._total_jitter_max * Metrics::HR_TO_USEC_MULT) << " us" << std::endl;
+    }
+    if (_flow_metrics && _flow_metrics->_total_periods) {
+        auto &fm = *_flow_metrics;
+        std::cout << "flow error  : avg/max " << (fm._total_abs_error_pct / fm._total_periods) << "/"
+                  << fm._total_max_error_pct << " % off the QPS flow per period" << std::endl;
+    }
+    if (_loop_metrics && _loop_metrics->_total_wall) {
+        auto &lm = *_loop_metrics;
+        std::cout << "event loop  : ";
+#ifdef HAVE_UV_METRICS_IDLE_TIME
+        std::cout << "busy " << std::lround(pct(lm._total_busy, lm._total_wall)) << "%, ";
+#endif
+        std::cout << "cpu " << std::lround(pct(lm._total_loop_cpu, lm._total_wall)) << "% (process "
+                  << std::lround(pct(lm._total_cpu, lm._total_wall)) << "%)";
+        if (lm._total_iteration_max) {
+            std::cout << ", longest iteration " << (lm._total_iteration_max * Metrics::HR_TO_MSEC_MULT) << "ms";
+        }
+        std::cout << std::endl;
+        std::cout << "loop time   : ";
+        for (size_t i = LoopMetrics::SEND; i < LoopMetrics::SECTIONS; i++) {
+            if (shown(lm, i)) {
+                std::cout << (i == LoopMetrics::SEND ? "" : ", ") << LOOP_SECTIONS[i] << " "
+                          << pct(lm._total_section[i], lm._total_wall) << "%";
+            }
+        }
+        std::cout << std::endl;
+        if (lm._perf) {
+            std::cout << "per query   : hardware counts" << (lm._perf->user_only() ? ", user space only" : "") << std::endl;
+            for (size_t i = 0; i < LoopMetrics::SECTIONS; i++) {
+                u_long queries = perf_queries(i, _agg_total_s_count, _agg_total_r_count, _agg_total_timeouts);
+                if (!queries) {
+                    continue;
+                }
+                auto &counts = lm._perf_section[i];
+                std::cout << "  " << LOOP_SECTIONS[i] << ": " << ((double)counts[PerfCounters::CYCLES] / queries) << " cycles, "
+                          << ((double)counts[PerfCounters::INSTRUCTIONS] / queries) << " instructions, "
+                          << ((double)counts[PerfCounters::CACHE_MISSES] / queries) << " cache misses, "
+                          << ((double)counts[PerfCounters::BRANCH_MISSES] / queries) << " branch misses";
+                if (counts[PerfCounters::CYCLES]) {
+                    std::cout << ", IPC " << ((double)counts[PerfCounters::INSTRUCTIONS] / counts[PerfCounters::CYCLES]);
+                }
+                std::cout << std::endl;
+            }
+        }
+        if (lm._total_timer_count) {
+            std::cout << "send timers : late avg/max " << ((double)lm._total_timer_late_sum / lm._total_timer_count * Metrics::HR_TO_USEC_MULT)
+                      << "/" << (lm._total_timer_late_max * Metrics::HR_TO_USEC_MULT) << " us" << std::endl;
+        }
+        if (lm._total_bound_periods) {
+            std::cout << "client bound: " << lm._total_bound_periods << " of " << lm._total_periods
+                      << " periods, flame rather than the server limited the load" << std::endl;
+        }
+    }
+    if (_socket_metrics) {
+        // spread of sends and receives over the socket pool, each as min/avg/max per socket
+        auto &sm = *_socket_metrics;
+        auto s = spread(sm._s_count);
+        auto r = spread(sm._r_count);
+        std::cout << "sockets     : " << sm._ports.size() << ", min/avg/max sent " << std::get<0>(s) << "/"
+                  << std::get<1>(s) << "/" << std::get<2>(s) << ", rcvd " << std::get<0>(r) << "/" << std::get<1>(r)
+                  << "/" << std::get<2>(r) << std::endl;
+        if (sm._detail) {
+            for (size_t i = 0; i < sm._ports.size(); i++) {
+                std::cout << "  " << sm._addresses[i] << " port " << sm._ports[i] << ": sent " << sm._s_count[i]
+                          << ", rcvd " << sm._r_count[i] << ", net errors " << sm._net_errors[i] << std::endl;
+            }
+        }
+    }
+    if (_agg_total_r_count > _agg_total_bad_count) {
         std::cout << "responses   :" << std::endl;
-        for (auto i : _response_codes) {
-            std::cout << "  " << ldns_lookup_by_id(ldns_rcodes, i.first)->name << ": " << i.second << std::endl;
+        for (size_t i = 0; i < _response_codes.size(); i++) {
+            if (_response_codes[i]) {
+                std::cout << "  " << rcode_name(i) << ": " << _response_codes[i] << std::endl;
+            }
         }
     }
 }
@@ -139,10 +667,35 @@ void MetricsMgr::display_final_text()
 void MetricsMgr::aggregate(bool no_avgs)
 {
 
-    _aggregate_count++;
-
     for (const auto &i : _metrics) {
-        aggregate_trafgen(i.get());
+        aggregate_trafgen(i.get(), i->swap());
+    }
+
+    if (_pacer_metrics) {
+        auto &pm = *_pacer_metrics;
+        pm._total_count += pm._period_count;
+        pm._total_lag_sum += pm._period_lag_sum;
+        pm._total_ticks += pm._period_ticks;
+        pm._total_jitter_sum += pm._period_jitter_sum;
+        pm._total_lag_max = std::max(pm._total_lag_max, pm._period_lag_max);
+        pm._total_jitter_max = std::max(pm._total_jitter_max, pm._period_jitter_max);
+    }
+
+    if (_flow_metrics) {
+        // periods asking for less than a query say nothing about tracking
+        auto &fm = *_flow_metrics;
+        fm._period_valid = fm._period_expected >= 1.0;
+        if (fm._period_valid) {
+            fm._period_error_pct = 100.0 * (_agg_period_s_count - fm._period_expected) / fm._period_expected;
+            fm._total_periods++;
+            fm._total_abs_error_pct += std::abs(fm._period_error_pct);
+            fm._total_max_error_pct = std::max(fm._total_max_error_pct, std::abs(fm._period_error_pct));
+        }
+    }
+
+    // the final aggregation comes after the loop has stopped, there's no loop load to speak of
+    if (_loop_metrics && !no_avgs) {
+        aggregate_loop();
     }
 
     if (!no_avgs) {
@@ -162,27 +715,65 @@ void MetricsMgr::aggregate(bool no_avgs)
                 _agg_total_qps_r_avg = (_agg_period_r_count + (_agg_total_qps_r_avg * (_avg_qps_calc_r_count - 1))) / _avg_qps_calc_r_count;
             }
         }
+    }
 
-        // TODO avg of averages, here be dragons
-        for (const auto &i : _metrics) {
-            _agg_period_response_avg_ms += i->_period_response_avg_ms;
-            _agg_period_pkt_size_avg += i->_period_pkt_size_avg;
-        }
-        _agg_period_response_avg_ms /= _metrics.size();
-        _agg_period_pkt_size_avg /= _metrics.size();
-        if (_agg_period_response_avg_ms) {
-            _agg_total_response_avg_ms = (_agg_period_response_avg_ms + (_agg_total_response_avg_ms * (_aggregate_count - 1))) / _aggregate_count;
-        }
-        if (_agg_period_pkt_size_avg) {
-            _agg_total_pkt_size_avg = (_agg_period_pkt_size_avg + (_agg_total_pkt_size_avg * (_aggregate_count - 1))) / _aggregate_count;
-        }
+    _qps_clock = std::chrono::high_resolution_clock::now();
+}
+
+void MetricsMgr::aggregate_loop()
+{
+    auto &lm = *_loop_metrics;
+    auto now = LoopMetrics::clock::now();
+    u_long wall = std::chrono::duration_cast<std::chrono::nanoseconds>(now - lm._period_start).count();
+    if (!wall) {
+        return;
+    }
+    u_long idle = lm.idle_time();
+    u_long cpu = LoopMetrics::cpu_time();
+    u_long loop_cpu = LoopMetrics::loop_cpu_time();
+
+    lm._period_wall = wall;
+#ifdef HAVE_UV_METRICS_IDLE_TIME
+    u_long busy = wall - std::min(wall, idle - lm._period_idle_start);
+    lm._period_busy_pct = 100.0 * busy / wall;
+    lm._total_busy += busy;
+#endif
+    lm._period_cpu_pct = 100.0 * (cpu - lm._period_cpu_start) / wall;
+    lm._period_loop_cpu_pct = 100.0 * (loop_cpu - lm._period_loop_cpu_start) / wall;
+
+    // client bound: the loop can't keep up, so the load offered is less than asked for
+    u_long late = std::chrono::duration_cast<std::chrono::nanoseconds>(LoopMetrics::LATE).count();
+    lm._period_bound = nullptr;
+    if (lm._period_busy_pct >= LoopMetrics::SATURATED_PCT) {
+        lm._period_bound = "event loop saturated";
+    } else if (lm._period_loop_cpu_pct >= LoopMetrics::SATURATED_PCT) {
+        lm._period_bound = "loop thread CPU saturated";
+    } else if (lm._period_timer_count && lm._period_timer_late_sum / lm._period_timer_count >= late) {
+        lm._period_bound = "send timers late";
+    } else if (_pacer_metrics && _pacer_metrics->_period_count
+        && _pacer_metrics->_period_lag_sum / _pacer_metrics->_period_count >= late) {
+        lm._period_bound = "pacer behind schedule";
     }
 
-    for (const auto &i : _metrics) {
-        i->reset_periodic_stats();
+    lm._total_wall += wall;
+    lm._total_cpu += cpu - lm._period_cpu_start;
+    lm._total_loop_cpu += loop_cpu - lm._period_loop_cpu_start;
+    lm._total_iteration_max = std::max(lm._total_iteration_max, lm._period_iteration_max);
+    lm._total_timer_count += lm._period_timer_count;
+    lm._total_timer_late_sum += lm._period_timer_late_sum;
+    lm._total_timer_late_max = std::max(lm._total_timer_late_max, lm._period_timer_late_max);
+    for (size_t i = 0; i < LoopMetrics::SECTIONS; i++) {
+        lm._total_section[i] += lm._period_section[i];
+    }
+    lm._total_periods++;
+    if (lm._period_bound) {
+        lm._total_bound_periods++;
     }
 
-    _qps_clock = std::chrono::high_resolution_clock::now();
+    lm._period_start = now;
+    lm._period_idle_start = idle;
+    lm._period_cpu_start = cpu;
+    lm._period_loop_cpu_start = loop_cpu;
 }
 
 void MetricsMgr::periodic_stats()
@@ -190,22 +781,48 @@ void MetricsMgr::periodic_stats()
 
     // COLLECT/AGGREGATE
     aggregate();
+    FLAME_PROBE4(metrics__period, _agg_period_s_count, _agg_period_r_count, _agg_period_timeouts, _agg_period_in_flight);
 
     // DISPLAY
     if (_config->verbosity()) {
         display_periodic_stats();
     }
 
+    if (_on_period) {
+        _on_period(PeriodStats{_agg_period_s_count, _agg_period_r_count, _agg_period_bad_count, _agg_period_timeouts, _agg_period_latency});
+    }
+
     // FLUSH
-    if (_metric_file.is_open()) {
+    if (_writer) {
         flush_to_disk();
+        // the period's per trafgen records too
+        _writer->commit();
+    }
+    if (_exporter) {
+        _exporter->update(openmetrics());
     }
 
     // RESET
     // ints
     _agg_period_r_count = _agg_period_s_count = _agg_period_in_flight = _agg_period_timeouts = _agg_period_bad_count = _agg_period_net_errors = _agg_period_tcp_connections = 0;
-    // doubles
-    _agg_period_response_avg_ms = _agg_period_response_max_ms = _agg_period_response_min_ms = _agg_period_pkt_size_avg = 0.0;
+    _agg_period_tls_handshakes = _agg_period_tls_resumed = _agg_period_max_streams = _agg_period_s_bytes = 0;
+    _agg_period_kernel_timed = _agg_period_send_overhead_ns = _agg_period_recv_overhead_ns = 0;
+    _agg_period_latency.reset();
+    if (_pacer_metrics) {
+        auto &pm = *_pacer_metrics;
+        pm._period_count = pm._period_lag_sum = pm._period_lag_max = 0;
+        pm._period_ticks = pm._period_jitter_sum = pm._period_jitter_max = 0;
+    }
+    if (_flow_metrics) {
+        _flow_metrics->_period_expected = 0.0;
+    }
+    if (_loop_metrics) {
+        auto &lm = *_loop_metrics;
+        lm._period_wall = lm._period_iteration_max = lm._period_timer_count = lm._period_timer_late_sum = lm._period_timer_late_max = 0;
+        lm._period_section.fill(0);
+        lm._period_busy_pct = -1.0;
+        lm._period_bound = nullptr;
+    }
 }
 
 void MetricsMgr::display_periodic_stats()
@@ -214,10 +831,30 @@ void MetricsMgr::display_periodic_stats()
     std::cout << _runtime_s << "s: "
               << "send: " << _agg_period_s_count << ", avg send: " << _agg_total_qps_s_avg << ", recv: "
               << _agg_period_r_count << ", avg recv: " << _agg_total_qps_r_avg << ", min/avg/max resp: "
-              << _agg_period_response_min_ms << "/" << _agg_period_response_avg_ms << "/" << _agg_period_response_max_ms
-              << "ms"
+              << to_ms(_agg_period_latency.min()) << "/" << to_ms(_agg_period_latency.mean()) << "/"
+              << to_ms(_agg_period_latency.max()) << "ms, " << percentiles_text(_agg_period_latency) << "ms"
               << ", in flight: " << _agg_period_in_flight
-              << ", timeouts: " << _agg_period_timeouts << std::endl;
+              << ", timeouts: " << _agg_period_timeouts;
+    if (_pacer_metrics && _pacer_metrics->_period_count) {
+        auto &pm = *_pacer_metrics;
+        std::cout << ", pacing lag/jitter: " << ((double)pm._period_lag_sum / pm._period_count * Metrics::HR_TO_USEC_MULT)
+                  << "/" << ((pm._period_ticks ? (double)pm._period_jitter_sum / pm._period_ticks : 0.0) * Metrics::HR_TO_USEC_MULT) << "us";
+    }
+    if (_flow_metrics && _flow_metrics->_period_valid) {
+        std::cout << ", flow error: " << _flow_metrics->_period_error_pct << "%";
+    }
+    if (_loop_metrics && _loop_metrics->_period_wall) {
+        auto &lm = *_loop_metrics;
+        if (lm._period_busy_pct >= 0) {
+            std::cout << ", loop busy/cpu: " << std::lround(lm._period_busy_pct) << "/" << std::lround(lm._period_loop_cpu_pct) << "%";
+        } else {
+            std::cout << ", loop cpu: " << std::lround(lm._period_loop_cpu_pct) << "%";
+        }
+        if (lm._period_bound) {
+            std::cout << ", CLIENT BOUND (" << lm._period_bound << ")";
+        }
+    }
+    std::cout << std::endl;
 }
 
 void MetricsMgr::finalize()
@@ -230,139 +867,131 @@ void MetricsMgr::finalize()
         }
         display_final_text();
     }
-    if (_metric_file.is_open()) {
+    if (_writer) {
         flush_to_disk();
-        _metric_file.close();
+        _writer->close();
     }
 }
 
-void MetricsMgr::aggregate_trafgen(const Metrics *m)
+void MetricsMgr::aggregate_trafgen(const Metrics *m, const MetricCounters &p)
 {
 
     update_runtime();
 
-    if (_per_trafgen_metrics && _metric_file.is_open()) {
+    if (_per_trafgen_metrics && _writer) {
         // record per trafgen metrics to out file
-        json j;
-        j["period_s_count"] = m->_period_s_count;
-        j["period_r_count"] = m->_period_r_count;
-        j["run_id"] = _run_id;
-        j["trafgen_id"] = m->_trafgen_id;
-        j["runtime_s"] = _runtime_s;
-        j["period_timeouts"] = m->_period_timeouts;
-        j["in_flight"] = m->_in_flight;
-        j["period_bad_count"] = m->_period_bad_count;
-        j["period_response_avg_ms"] = m->_period_response_avg_ms;
-        j["period_response_min_ms"] = m->_period_response_min_ms;
-        j["period_response_max_ms"] = m->_period_response_max_ms;
-        j["period_net_errors"] = m->_period_net_errors;
-        j["period_tcp_connections"] = m->_period_tcp_connections;
-        j["pkt_size_avg"] = m->_period_pkt_size_avg;
-        for (auto i : m->_response_codes) {
-            j["responses"][ldns_lookup_by_id(ldns_rcodes, i.first)->name] = i.second;
+        auto &w = *_writer;
+        w.begin_object();
+        w.field("period_s_count", p.s_count);
+        w.field("period_r_count", p.r_count);
+        w.field("run_id", _run_id);
+        w.field("trafgen_id", m->_trafgen_id);
+        w.field("runtime_s", _runtime_s);
+        w.field("period_timeouts", p.timeouts);
+        w.field("in_flight", m->_in_flight);
+        w.field("period_bad_count", p.bad_count);
+        write_latency(w, PERIOD_RESPONSE_KEYS, p.latency);
+        w.field("period_net_errors", p.net_errors);
+        w.field("period_tcp_connections", p.tcp_connections);
+        if (p.tls_handshakes) {
+            w.field("period_tls_handshakes", p.tls_handshakes);
+            w.field("period_tls_resumed", p.tls_resumed);
+            w.field("period_tls_handshake_avg_ms", to_ms(static_cast<double>(p.tls_handshake_ns) / p.tls_handshakes));
+            w.field("period_tls_handshake_cpu_avg_ms", to_ms(static_cast<double>(p.tls_handshake_cpu_ns) / p.tls_handshakes));
+        }
+        if (p.send_syscalls) {
+            w.field("period_send_syscalls", p.send_syscalls);
+        }
+        if (p.max_streams) {
+            w.field("period_max_streams", p.max_streams);
+        }
+        if (p.kernel_timed) {
+            w.field("period_kernel_timed", p.kernel_timed);
+            w.field("period_send_overhead_avg_us", to_us(static_cast<double>(p.send_overhead_ns) / p.kernel_timed));
+            w.field("period_recv_overhead_avg_us", to_us(static_cast<double>(p.recv_overhead_ns) / p.kernel_timed));
         }
-        _metric_file << j << std::endl;
+        w.field("pkt_size_avg", avg_size(p.s_bytes, p.s_count));
+        if (p.r_count > p.bad_count) {
+            w.begin_object("responses");
+            for (size_t i = 0; i < p.responses.size(); i++) {
+                if (p.responses[i]) {
+                    w.field(rcode_name(i), p.responses[i]);
+                }
+            }
+            w.end_object();
+        }
+        w.end_object();
     }
 
     // aggregate this trafgen
-    _agg_total_r_count += m->_period_r_count;
-    _agg_total_s_count += m->_period_s_count;
+    _agg_total_r_count += p.r_count;
+    _agg_total_s_count += p.s_count;
 
-    _agg_period_s_count += m->_period_s_count;
-    _agg_period_r_count += m->_period_r_count;
+    _agg_period_s_count += p.s_count;
+    _agg_period_r_count += p.r_count;
 
     _agg_period_in_flight += m->_in_flight;
 
-    _agg_period_timeouts += m->_period_timeouts;
-    _agg_total_timeouts += m->_period_timeouts;
-
-    _agg_period_bad_count += m->_period_bad_count;
-    _agg_period_net_errors += m->_period_net_errors;
-    _agg_period_tcp_connections += m->_period_tcp_connections;
-    _agg_total_tcp_connections += m->_period_tcp_connections;
-
-    if (_agg_total_response_min_ms == 0) {
-        _agg_total_response_min_ms = m->_period_response_min_ms;
-    } else if (m->_period_response_min_ms && m->_period_response_min_ms < _agg_total_response_min_ms) {
-        _agg_total_response_min_ms = m->_period_response_min_ms;
-    }
-
-    if (_agg_period_response_min_ms == 0) {
-        _agg_period_response_min_ms = m->_period_response_min_ms;
-    } else if (m->_period_response_min_ms && m->_period_response_min_ms < _agg_period_response_min_ms) {
-        _agg_period_response_min_ms = m->_period_response_min_ms;
-    }
-
-    if (_agg_total_response_max_ms == 0) {
-        _agg_total_response_max_ms = m->_period_response_max_ms;
-    } else if (m->_period_response_max_ms && m->_period_response_max_ms > _agg_period_response_max_ms) {
-        _agg_total_response_max_ms = m->_period_response_max_ms;
-    }
-
-    if (_agg_period_response_max_ms == 0) {
-        _agg_period_response_max_ms = m->_period_response_max_ms;
-    } else if (m->_period_response_max_ms && m->_period_response_max_ms > _agg_period_response_max_ms) {
-        _agg_period_response_max_ms = m->_period_response_max_ms;
-    }
-
-    for (auto i : m->_response_codes) {
-        _response_codes[i.first] += i.second;
+    _agg_period_timeouts += p.timeouts;
+    _agg_total_timeouts += p.timeouts;
+
+    _agg_period_bad_count += p.bad_count;
+    _agg_total_bad_count += p.bad_count;
+    _agg_period_net_errors += p.net_errors;
+    _agg_total_net_errors += p.net_errors;
+    _agg_period_tcp_connections += p.tcp_connections;
+    _agg_total_tcp_connections += p.tcp_connections;
+
+    _agg_period_tls_handshakes += p.tls_handshakes;
+    _agg_period_tls_resumed += p.tls_resumed;
+    _agg_total_tls_handshakes += p.tls_handshakes;
+    _agg_total_tls_resumed += p.tls_resumed;
+    _agg_total_tls_handshake_ms += to_ms(p.tls_handshake_ns);
+    _agg_total_tls_handshake_cpu_ms += to_ms(p.tls_handshake_cpu_ns);
+    _agg_total_send_syscalls += p.send_syscalls;
+    _agg_total_syscall_s_count += p.syscall_s_count;
+    _agg_period_s_bytes += p.s_bytes;
+    _agg_total_s_bytes += p.s_bytes;
+    _agg_period_max_streams = std::max(_agg_period_max_streams, p.max_streams);
+    _agg_total_max_streams = std::max(_agg_total_max_streams, p.max_streams);
+    _agg_period_kernel_timed += p.kernel_timed;
+    _agg_total_kernel_timed += p.kernel_timed;
+    _agg_total_hw_timed += p.hw_timed;
+    _agg_period_send_overhead_ns += p.send_overhead_ns;
+    _agg_total_send_overhead_ns += p.send_overhead_ns;
+    _agg_total_send_overhead_max_ns = std::max(_agg_total_send_overhead_max_ns, p.send_overhead_max_ns);
+    _agg_period_recv_overhead_ns += p.recv_overhead_ns;
+    _agg_total_recv_overhead_ns += p.recv_overhead_ns;
+    _agg_total_recv_overhead_max_ns = std::max(_agg_total_recv_overhead_max_ns, p.recv_overhead_max_ns);
+
+    _agg_period_latency.merge(p.latency);
+    _agg_total_latency.merge(p.latency);
+
+    for (size_t i = 0; i < p.responses.size(); i++) {
+        _response_codes[i] += p.responses[i];
     }
 }
 
 // ----------------------
 
-void Metrics::timeout(u_long in_f)
+void MetricCounters::reset()
 {
-    _period_timeouts++;
-    _in_flight = in_f;
+    r_count = s_count = s_bytes = bad_count = net_errors = timeouts = tcp_connections = 0;
+    tls_handshakes = tls_resumed = tls_handshake_ns = tls_handshake_cpu_ns = 0;
+    max_streams = send_syscalls = syscall_s_count = 0;
+    kernel_timed = hw_timed = send_overhead_ns = send_overhead_max_ns = recv_overhead_ns = recv_overhead_max_ns = 0;
+    responses.fill(0);
+    latency.reset();
 }
 
-void Metrics::net_error()
+void Metrics::tls_handshake(std::chrono::high_resolution_clock::duration latency, std::chrono::nanoseconds cpu, bool resumed)
 {
-    _period_net_errors++;
-}
-
-void Metrics::send(u_long size, u_long i, u_long in_f)
-{
-    _in_flight = in_f;
-    _total_s_count += i;
-    _period_s_count += i;
-    _period_pkt_size_avg = (size + (_period_pkt_size_avg * (_period_s_count - i))) / _period_s_count;
-}
-
-void Metrics::bad_receive(u_long in_f)
-{
-    _in_flight = in_f;
-    _period_bad_count++;
-    _total_r_count++;
-    _period_r_count++;
-}
-
-void Metrics::receive(const std::chrono::high_resolution_clock::time_point &rcv_time, uint8_t rcode, u_long in_f)
-{
-    auto now = std::chrono::high_resolution_clock::now();
-    auto q_latency = now - rcv_time;
-    double q_latency_ms = q_latency.count() * Metrics::HR_TO_MSEC_MULT;
-    _in_flight = in_f;
-    _response_codes[rcode]++;
-    _total_r_count++;
-    _period_r_count++;
-    _period_response_avg_ms = (q_latency_ms + (_period_response_avg_ms * (_period_r_count - 1))) / _period_r_count;
-    if (q_latency_ms > _period_response_max_ms) {
-        _period_response_max_ms = q_latency_ms;
-    }
-    if (_period_response_min_ms == 0 || q_latency_ms < _period_response_min_ms) {
-        _period_response_min_ms = q_latency_ms;
+    _period->tls_handshakes++;
+    if (resumed) {
+        _period->tls_resumed++;
     }
-}
-
-void Metrics::reset_periodic_stats()
-{
-    // reset counters for period
-    _period_r_count = _period_s_count = _period_bad_count = _period_net_errors = _period_timeouts = _period_tcp_connections = 0;
-    _period_response_avg_ms = _period_response_max_ms = _period_response_min_ms = _period_pkt_size_avg = 0.0;
-    _response_codes.clear();
+    _period->tls_handshake_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count();
+    _period->tls_handshake_cpu_ns += cpu.count();
 }
 
 void Metrics::trafgen_id(u_int port)
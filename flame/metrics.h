@@ -3,15 +3,81 @@
 #pragma once
 
 #include "config.h"
+#include "histogram.h"
+#include "perfcounters.h"
 
+#include <algorithm>
+#include <array>
 #include <chrono>
-#include <fstream>
+#include <functional>
 #include <memory>
-#include <unordered_map>
+#include <vector>
 
 #include <uvw.hpp>
 
+// libuv can tell how long the loop has waited for i/o since 1.39
+#if UV_VERSION_HEX >= 0x012700
+#define HAVE_UV_METRICS_IDLE_TIME
+#endif
+
+class FlowMetrics;
+class LoopMetrics;
 class Metrics;
+class MetricsExporter;
+class MetricsWriter;
+class PacerMetrics;
+class SocketMetrics;
+
+// totals of one metrics period, for controllers that adjust the load as the run goes
+struct PeriodStats {
+    u_long s_count;
+    u_long r_count;
+    // responses that matched no query in flight, e.g. after it timed out, or failed to parse
+    u_long bad_count;
+    u_long timeouts;
+    const LatencyHistogram &latency;
+};
+
+/**
+ * One period of a generator's counts: plain integers, responses by rcode in a fixed array and the
+ * latency histogram, so accounting a packet is a few increments with no division or hashing.
+ */
+struct MetricCounters {
+    // rcodes as parsed from the header, all fit in a uint8_t
+    static const size_t RCODES = 256;
+
+    u_long r_count{0};
+    u_long s_count{0};
+    // bytes sent, for the average query size
+    u_long s_bytes{0};
+    u_long bad_count{0};
+    u_long net_errors{0};
+    u_long timeouts{0};
+    u_long tcp_connections{0};
+    u_long tls_handshakes{0};
+    u_long tls_resumed{0};
+    // sums, nanoseconds, so the manager can compute exact averages
+    u_long tls_handshake_ns{0};
+    u_long tls_handshake_cpu_ns{0};
+    // most DoH streams open at once on one connection
+    u_long max_streams{0};
+    // batched (GSO) sends: syscalls made and the queries they carried
+    u_long send_syscalls{0};
+    u_long syscall_s_count{0};
+    // responses timed by kernel timestamps (in hardware at both ends), and the user space time
+    // either side, nanoseconds: query send to kernel send, kernel receive to response handling
+    u_long kernel_timed{0};
+    u_long hw_timed{0};
+    u_long send_overhead_ns{0};
+    u_long send_overhead_max_ns{0};
+    u_long recv_overhead_ns{0};
+    u_long recv_overhead_max_ns{0};
+    std::array<u_long, RCODES> responses{};
+    // response latencies, nanoseconds. min, max and mean come from here too.
+    LatencyHistogram latency;
+
+    void reset();
+};
 
 class MetricsMgr
 {
@@ -25,12 +91,27 @@ class MetricsMgr
     std::shared_ptr<uvw::TimerHandle> _metric_period_timer;
 
     // metric output file, if enabled
-    std::ofstream _metric_file;
+    std::unique_ptr<MetricsWriter> _writer;
 
     // metric counters, one per TrafGen
     std::vector<std::shared_ptr<Metrics>> _metrics;
 
-    std::unordered_map<uint8_t, u_long> _response_codes;
+    // per socket counters of the shared UDP socket pool, if there is one
+    std::shared_ptr<SocketMetrics> _socket_metrics;
+
+    // send time accuracy of the pacer, if sends are paced
+    std::shared_ptr<PacerMetrics> _pacer_metrics;
+
+    // offered load against a QPS flow, if there is one
+    std::shared_ptr<FlowMetrics> _flow_metrics;
+
+    // flame's own event loop and CPU load
+    std::shared_ptr<LoopMetrics> _loop_metrics;
+
+    // serves the run totals to Prometheus, if enabled
+    std::shared_ptr<MetricsExporter> _exporter;
+
+    std::array<u_long, MetricCounters::RCODES> _response_codes{};
 
     // command line XXX move to config
     std::string _cmdline;
@@ -45,9 +126,6 @@ class MetricsMgr
     u_long _avg_qps_calc_s_count{0};
     std::chrono::high_resolution_clock::time_point _qps_clock;
 
-    // times we've aggregated (used in avg calcs)
-    u_long _aggregate_count{0};
-
     // aggregated totals throughout entire run
     u_long _agg_total_r_count{0};
     u_long _agg_total_s_count{0};
@@ -57,15 +135,23 @@ class MetricsMgr
     u_long _agg_total_bad_count{0};
     u_long _agg_total_net_errors{0};
     u_long _agg_total_tcp_connections{0};
-    double _agg_total_response_min_ms{0.0};
-    double _agg_total_response_max_ms{0.0};
-
-    // TODO current avg of avgs, switch to percentiles
-    double _agg_total_pkt_size_avg{0.0};
-    double _agg_total_response_avg_ms{0.0};
+    u_long _agg_total_tls_handshakes{0};
+    u_long _agg_total_tls_resumed{0};
+    double _agg_total_tls_handshake_ms{0.0};
+    double _agg_total_tls_handshake_cpu_ms{0.0};
+    u_long _agg_total_max_streams{0};
+    u_long _agg_total_send_syscalls{0};
+    u_long _agg_total_syscall_s_count{0};
+    u_long _agg_total_s_bytes{0};
+    u_long _agg_total_kernel_timed{0};
+    u_long _agg_total_hw_timed{0};
+    u_long _agg_total_send_overhead_ns{0};
+    u_long _agg_total_send_overhead_max_ns{0};
+    u_long _agg_total_recv_overhead_ns{0};
+    u_long _agg_total_recv_overhead_max_ns{0};
+    LatencyHistogram _agg_total_latency;
 
     // aggregated totals for single time period
-    // these all need to be reset in reset_periodic_stats()
     u_long _agg_period_r_count{0};
     u_long _agg_period_s_count{0};
     u_long _agg_period_in_flight{0};
@@ -73,20 +159,27 @@ class MetricsMgr
     u_long _agg_period_bad_count{0};
     u_long _agg_period_net_errors{0};
     u_long _agg_period_tcp_connections{0};
-    double _agg_period_response_min_ms{0.0};
-    double _agg_period_response_max_ms{0.0};
-
-    // TODO avg of avgs, switch to percentiles
-    double _agg_period_pkt_size_avg{0.0};
-    double _agg_period_response_avg_ms{0.0};
+    u_long _agg_period_tls_handshakes{0};
+    u_long _agg_period_tls_resumed{0};
+    u_long _agg_period_max_streams{0};
+    u_long _agg_period_s_bytes{0};
+    u_long _agg_period_kernel_timed{0};
+    u_long _agg_period_send_overhead_ns{0};
+    u_long _agg_period_recv_overhead_ns{0};
+    LatencyHistogram _agg_period_latency;
 
     // do we record each individual trafgen, or only aggregate?
     bool _per_trafgen_metrics{true};
 
+    std::function<void(const PeriodStats &)> _on_period;
+
     void header_to_disk();
     void flush_to_disk();
     void periodic_stats();
 
+    // run totals in OpenMetrics text format
+    std::string openmetrics();
+
     // console display
     void display_periodic_stats();
     void display_final_text();
@@ -94,15 +187,13 @@ class MetricsMgr
     void update_runtime();
 
     void aggregate(bool no_avgs = false);
-    void aggregate_trafgen(const Metrics *m);
+    void aggregate_trafgen(const Metrics *m, const MetricCounters &p);
+    void aggregate_loop();
 
 public:
-    MetricsMgr(std::shared_ptr<uvw::Loop> l, std::shared_ptr<Config> c, const std::string &cmdline)
-        : _loop(l)
-        , _config(c)
-        , _cmdline(cmdline)
-    {
-    }
+    MetricsMgr(std::shared_ptr<uvw::Loop> l, std::shared_ptr<Config> c, const std::string &cmdline);
+
+    ~MetricsMgr();
 
     void start();
 
@@ -111,9 +202,314 @@ public:
     void finalize();
 
     std::shared_ptr<Metrics> create_trafgen_metrics();
+
+    /**
+     * @param detail list every socket in the report and metric output, otherwise only the spread
+     *        (min/avg/max) over sockets is shown
+     */
+    std::shared_ptr<SocketMetrics> create_socket_metrics(size_t count, bool detail);
+
+    std::shared_ptr<PacerMetrics> create_pacer_metrics();
+
+    std::shared_ptr<FlowMetrics> create_flow_metrics();
+
+    std::shared_ptr<LoopMetrics> create_loop_metrics();
+
+    // publish the run totals on this exporter, updated every period
+    void export_to(std::shared_ptr<MetricsExporter> exporter)
+    {
+        _exporter = std::move(exporter);
+    }
+
+    // called with the aggregated totals at the end of every period
+    void on_period(std::function<void(const PeriodStats &)> cb)
+    {
+        _on_period = std::move(cb);
+    }
+};
+
+/**
+ * How accurately paced sends keep to their intended times: lag is how late each query went out
+ * (client side delay, not part of the reported latency), jitter how far the gap from the previous
+ * send was from the intended gap, once per wake up of the pacer: the queries of one wake up go out
+ * together.
+ */
+class PacerMetrics
+{
+    friend class MetricsMgr;
+
+    // nanoseconds
+    u_long _period_count{0};
+    u_long _period_lag_sum{0};
+    u_long _period_lag_max{0};
+    u_long _period_ticks{0};
+    u_long _period_jitter_sum{0};
+    u_long _period_jitter_max{0};
+
+    u_long _total_count{0};
+    u_long _total_lag_sum{0};
+    u_long _total_lag_max{0};
+    u_long _total_ticks{0};
+    u_long _total_jitter_sum{0};
+    u_long _total_jitter_max{0};
+
+public:
+    void sent(std::chrono::nanoseconds lag)
+    {
+        u_long l = lag.count();
+        _period_count++;
+        _period_lag_sum += l;
+        if (l > _period_lag_max) {
+            _period_lag_max = l;
+        }
+    }
+
+    void tick(std::chrono::nanoseconds jitter)
+    {
+        u_long j = jitter.count();
+        _period_ticks++;
+        _period_jitter_sum += j;
+        if (j > _period_jitter_max) {
+            _period_jitter_max = j;
+        }
+    }
+};
+
+/**
+ * How closely the offered load follows a QPS flow: each period's sends against the queries the
+ * flow asked for, as a percentage error.
+ */
+class FlowMetrics
+{
+    friend class MetricsMgr;
+
+    double _period_expected{0.0};
+    double _period_error_pct{0.0};
+    bool _period_valid{false};
+
+    u_long _total_periods{0};
+    double _total_abs_error_pct{0.0};
+    double _total_max_error_pct{0.0};
+
+public:
+    void expected(double queries)
+    {
+        _period_expected += queries;
+    }
+};
+
+/**
+ * Flame's own load, to tell whether a plateau is the server's limit or the client's: how busy the
+ * event loop is (the time it isn't waiting for i/o) and its longest iteration, how late send timers
+ * fire, how loop time splits between sending, receiving and timeouts, and CPU usage. A period is
+ * client bound when the loop or its thread's CPU is saturated, or sends fall behind their timers
+ * or the pacer.
+ *
+ * With PerfCounters, the loop thread's hardware counts are split over the same sections, and
+ * query generation is broken out of sending.
+ */
+class LoopMetrics
+{
+    friend class MetricsMgr;
+
+public:
+    enum Section {
+        OTHER,
+        SEND,
+        // only with PerfCounters
+        GENERATE,
+        RECEIVE,
+        TIMEOUTS,
+        SECTIONS,
+    };
+
+    // loop busy or loop thread CPU share, percent, from which the client is saturated
+    static constexpr double SATURATED_PCT = 90.0;
+    // average lateness of send timers or paced sends from which sends fall behind
+    static constexpr std::chrono::microseconds LATE{1000};
+
+    /**
+     * Charges the loop time until it goes out of scope to a section, less that of nested scopes,
+     * e.g. sends made while processing a response.
+     */
+    class Scope
+    {
+        LoopMetrics *_metrics;
+        Section _outer{OTHER};
+
+    public:
+        Scope(LoopMetrics *metrics, Section section)
+            : _metrics(metrics)
+        {
+            if (_metrics) {
+                _outer = _metrics->enter(section);
+            }
+        }
+
+        ~Scope()
+        {
+            if (_metrics) {
+                _metrics->enter(_outer);
+            }
+        }
+
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+    };
+
+    explicit LoopMetrics(std::shared_ptr<uvw::Loop> loop);
+
+    // a send timer fired this long after it was due
+    void timer_late(std::chrono::nanoseconds late)
+    {
+        u_long l = late.count();
+        _period_timer_count++;
+        _period_timer_late_sum += l;
+        if (l > _period_timer_late_max) {
+            _period_timer_late_max = l;
+        }
+    }
+
+    // count hardware events by section from now on
+    void perf_counters(std::shared_ptr<PerfCounters> perf);
+
+    bool counting() const
+    {
+        return _perf != nullptr;
+    }
+
+    void close();
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    std::shared_ptr<uvw::Loop> _loop;
+    std::shared_ptr<uvw::PrepareHandle> _prepare;
+
+    // the section running now, and since when
+    Section _section{OTHER};
+    clock::time_point _mark;
+
+    // where the current period started: wall clock, loop idle time and CPU times, nanoseconds
+    clock::time_point _period_start;
+    u_long _period_idle_start{0};
+    u_long _period_cpu_start{0};
+    u_long _period_loop_cpu_start{0};
+    // start of the last loop iteration
+    clock::time_point _iteration_start;
+    u_long _iteration_idle_start{0};
+
+    // nanoseconds
+    u_long _period_iteration_max{0};
+    u_long _period_timer_count{0};
+    u_long _period_timer_late_sum{0};
+    u_long _period_timer_late_max{0};
+    std::array<u_long, SECTIONS> _period_section{};
+
+    // the period as summed up by the manager: its length, 0 until then, and percentages of it.
+    // busy is < 0 if unknown.
+    u_long _period_wall{0};
+    double _period_busy_pct{-1.0};
+    double _period_cpu_pct{0.0};
+    double _period_loop_cpu_pct{0.0};
+    // why the period was client bound, null if it wasn't
+    const char *_period_bound{nullptr};
+
+    u_long _total_wall{0};
+    u_long _total_busy{0};
+    u_long _total_cpu{0};
+    u_long _total_loop_cpu{0};
+    u_long _total_iteration_max{0};
+    u_long _total_timer_count{0};
+    u_long _total_timer_late_sum{0};
+    u_long _total_timer_late_max{0};
+    std::array<u_long, SECTIONS> _total_section{};
+    u_long _total_periods{0};
+    u_long _total_bound_periods{0};
+
+    // hardware counts, if counting: the reading at _mark, and the run's counts by section
+    std::shared_ptr<PerfCounters> _perf;
+    PerfCounters::Values _perf_mark{};
+    std::array<PerfCounters::Values, SECTIONS> _perf_section{};
+
+    Section enter(Section section)
+    {
+        auto now = clock::now();
+        _period_section[_section] += std::chrono::duration_cast<std::chrono::nanoseconds>(now - _mark).count();
+        _mark = now;
+        if (_perf) {
+            count_perf();
+        }
+        auto outer = _section;
+        _section = section;
+        return outer;
+    }
+
+    // charge the hardware counts since _perf_mark to the current section
+    void count_perf();
+
+    // loop idle time so far, 0 if libuv can't tell
+    u_long idle_time() const;
+    // process and loop thread CPU time so far
+    static u_long cpu_time();
+    static u_long loop_cpu_time();
+};
+
+/**
+ * Lifetime send and receive counts for each socket of a UDPSocketPool, to spot ports (and so
+ * server receive queues) or source addresses that get more or less than their share.
+ */
+class SocketMetrics
+{
+    friend class MetricsMgr;
+
+    bool _detail;
+    std::vector<std::string> _addresses;
+    std::vector<unsigned int> _ports;
+    std::vector<u_long> _s_count;
+    std::vector<u_long> _r_count;
+    std::vector<u_long> _net_errors;
+
+public:
+    SocketMetrics(size_t count, bool detail)
+        : _detail(detail)
+        , _addresses(count)
+        , _ports(count)
+        , _s_count(count)
+        , _r_count(count)
+        , _net_errors(count)
+    {
+    }
+
+    void socket(size_t socket, const std::string &address, unsigned int port)
+    {
+        _addresses[socket] = address;
+        _ports[socket] = port;
+    }
+
+    void send(size_t socket)
+    {
+        _s_count[socket]++;
+    }
+
+    void receive(size_t socket)
+    {
+        _r_count[socket]++;
+    }
+
+    void net_error(size_t socket)
+    {
+        _net_errors[socket]++;
+    }
 };
 
-class Metrics
+/**
+ * Counters of one TrafGen, only ever updated from the thread it runs on. The period counters are
+ * double buffered: the generator counts into one set while the manager reads the set swapped out
+ * at the end of the previous period, so taking a period never touches the live counters. Each set
+ * starts on its own cache line, as does the object, so that generators' counters never share one.
+ */
+class alignas(64) Metrics
 {
     friend class MetricsMgr;
 
@@ -122,30 +518,31 @@ class Metrics
 
     std::string _trafgen_id;
 
-    // total sends entire lifetime
-    u_long _total_r_count{0};
-    u_long _total_s_count{0};
-
-    // period counters, reset each flush to MetricsMgr
-    u_long _period_r_count{0};
-    u_long _period_s_count{0};
-    u_long _period_bad_count{0};
-    u_long _period_net_errors{0};
-    u_long _period_timeouts{0};
-    u_long _period_tcp_connections{0};
-    double _period_response_avg_ms{0.0};
-    double _period_response_min_ms{0.0};
-    double _period_response_max_ms{0.0};
-    double _period_pkt_size_avg{0.0};
-
     // updated during operations that adjust in_flight like send, recv, timeout
     u_long _in_flight{0};
 
-    std::unordered_map<uint8_t, u_long> _response_codes;
+    struct alignas(64) Buffer {
+        MetricCounters c;
+    };
+    std::array<Buffer, 2> _buffers;
+    // the counters being updated
+    MetricCounters *_period{&_buffers[0].c};
+
+    // end the current period: counting moves to the other buffer, cleared before it is switched to,
+    // and the finished counters stay readable until the next swap
+    const MetricCounters &swap()
+    {
+        MetricCounters *done = _period;
+        MetricCounters *next = (done == &_buffers[0].c) ? &_buffers[1].c : &_buffers[0].c;
+        next->reset();
+        _period = next;
+        return *done;
+    }
 
 public:
     constexpr static const double HR_TO_SEC_MULT = 0.000000001;
     constexpr static const double HR_TO_MSEC_MULT = 0.000001;
+    constexpr static const double HR_TO_USEC_MULT = 0.001;
 
     Metrics(std::shared_ptr<uvw::Loop> l, MetricsMgr &m)
         : _loop(l)
@@ -153,22 +550,81 @@ public:
     {
     }
 
+    // counters point into the object
+    Metrics(const Metrics &) = delete;
+    Metrics &operator=(const Metrics &) = delete;
+
     void trafgen_id(u_int port);
 
-    void receive(const std::chrono::high_resolution_clock::time_point &rcv_time, uint8_t rcode, u_long in_f);
+    void receive(std::chrono::nanoseconds latency, uint8_t rcode, u_long in_f)
+    {
+        _period->latency.record(latency.count());
+        _period->responses[rcode]++;
+        _period->r_count++;
+        _in_flight = in_f;
+    }
 
-    void reset_periodic_stats();
+    // a response timed by kernel timestamps: latency is kernel to kernel (or NIC to NIC), the
+    // overheads are the user space time before the send and after the receive
+    void receive(std::chrono::nanoseconds latency, std::chrono::nanoseconds send_overhead,
+        std::chrono::nanoseconds recv_overhead, bool hardware, uint8_t rcode, u_long in_f)
+    {
+        _period->latency.record(latency.count());
+        _period->responses[rcode]++;
+        _period->r_count++;
+        _period->kernel_timed++;
+        _period->hw_timed += hardware;
+        u_long send_ns = std::max<long>(send_overhead.count(), 0);
+        u_long recv_ns = std::max<long>(recv_overhead.count(), 0);
+        _period->send_overhead_ns += send_ns;
+        _period->send_overhead_max_ns = std::max(_period->send_overhead_max_ns, send_ns);
+        _period->recv_overhead_ns += recv_ns;
+        _period->recv_overhead_max_ns = std::max(_period->recv_overhead_max_ns, recv_ns);
+        _in_flight = in_f;
+    }
 
-    void timeout(u_long in_f);
+    void timeout(u_long in_f)
+    {
+        _period->timeouts++;
+        _in_flight = in_f;
+    }
 
-    void net_error();
+    void net_error()
+    {
+        _period->net_errors++;
+    }
 
-    void send(u_long size, u_long i, u_long in_f);
+    void send(u_long size, u_long i, u_long in_f)
+    {
+        _period->s_count += i;
+        _period->s_bytes += size;
+        _in_flight = in_f;
+    }
 
     void tcp_connection()
     {
-        _period_tcp_connections++;
+        _period->tcp_connections++;
+    }
+
+    void bad_receive(u_long in_f)
+    {
+        _period->bad_count++;
+        _period->r_count++;
+        _in_flight = in_f;
+    }
+
+    void send_syscall(u_long queries)
+    {
+        _period->send_syscalls++;
+        _period->syscall_s_count += queries;
+    }
+
+    void streams(u_long open)
+    {
+        if (open > _period->max_streams) {
+            _period->max_streams = open;
+        }
     }
 
-    void bad_receive(u_long in_f);
+    void tls_handshake(std::chrono::high_resolution_clock::duration latency, std::chrono::nanoseconds cpu, bool resumed);
 };
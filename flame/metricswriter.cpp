@@ -0,0 +1,314 @@
+// Copyright 2019 NSONE, Inc
+
+#include <cerrno>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "metricswriter.h"
+
+static bool ends_with(const std::string &s, const std::string &suffix)
+{
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+MetricsWriter::MetricsWriter(const std::string &path)
+{
+    std::string name{path};
+    if (ends_with(name, ".zst")) {
+#ifdef HAVE_ZSTD
+        _compress = true;
+        name.resize(name.size() - 4);
+#else
+        throw std::runtime_error("zstd compressed metric output needs flame built with zstd");
+#endif
+    }
+    if (ends_with(name, ".cbor")) {
+        _format = Format::CBOR;
+    }
+
+    _fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (_fd < 0) {
+        throw std::runtime_error("unable to open metric output file");
+    }
+#ifdef HAVE_ZSTD
+    if (_compress) {
+        _zstd = ZSTD_createCCtx();
+        _zbuf.resize(ZSTD_CStreamOutSize());
+    }
+#endif
+    _thread = std::thread(&MetricsWriter::run, this);
+}
+
+MetricsWriter::~MetricsWriter()
+{
+    close();
+}
+
+void MetricsWriter::begin_object(const char *key)
+{
+    name(key);
+    _buffer.push_back((_format == Format::CBOR) ? '\xbf' : '{');
+    _empty[_depth++] = true;
+}
+
+void MetricsWriter::end_object()
+{
+    _buffer.push_back((_format == Format::CBOR) ? '\xff' : '}');
+    if (--_depth == 0 && _format == Format::NDJSON) {
+        _buffer.push_back('\n');
+    }
+}
+
+void MetricsWriter::begin_array(const char *key)
+{
+    name(key);
+    _buffer.push_back((_format == Format::CBOR) ? '\x9f' : '[');
+    _empty[_depth++] = true;
+}
+
+void MetricsWriter::end_array()
+{
+    _buffer.push_back((_format == Format::CBOR) ? '\xff' : ']');
+    _depth--;
+}
+
+void MetricsWriter::field(const char *key, bool value)
+{
+    name(key);
+    if (_format == Format::CBOR) {
+        _buffer.push_back(value ? '\xf5' : '\xf4');
+        return;
+    }
+    _buffer.append(value ? "true" : "false");
+}
+
+void MetricsWriter::field(const char *key, double value)
+{
+    name(key);
+    if (_format == Format::CBOR) {
+        uint64_t bits;
+        std::memcpy(&bits, &value, sizeof bits);
+        _buffer.push_back('\xfb');
+        for (int shift = 56; shift >= 0; shift -= 8) {
+            _buffer.push_back(static_cast<char>(bits >> shift));
+        }
+        return;
+    }
+    if (!std::isfinite(value)) {
+        _buffer.append("null");
+        return;
+    }
+    // 15 significant digits, plenty for metrics and without binary rounding noise
+    char buf[32];
+    int len = std::snprintf(buf, sizeof buf, "%.15g", value);
+    _buffer.append(buf, len);
+}
+
+void MetricsWriter::field(const char *key, const std::string &value)
+{
+    name(key);
+    text(value.data(), value.size());
+}
+
+void MetricsWriter::name(const char *key)
+{
+    if (!_depth) {
+        return;
+    }
+    if (_format == Format::CBOR) {
+        if (key) {
+            text(key, std::strlen(key));
+        }
+        return;
+    }
+    if (!_empty[_depth - 1]) {
+        _buffer.push_back(',');
+    }
+    _empty[_depth - 1] = false;
+    if (key) {
+        text(key, std::strlen(key));
+        _buffer.push_back(':');
+    }
+}
+
+void MetricsWriter::integer(uint64_t value)
+{
+    if (_format == Format::CBOR) {
+        head(0, value);
+        return;
+    }
+    char buf[24];
+    auto r = std::to_chars(buf, buf + sizeof buf, value);
+    _buffer.append(buf, r.ptr);
+}
+
+void MetricsWriter::signed_integer(int64_t value)
+{
+    if (value >= 0) {
+        integer(value);
+        return;
+    }
+    if (_format == Format::CBOR) {
+        // negative integer: -1 - argument
+        head(1, static_cast<uint64_t>(-(value + 1)));
+        return;
+    }
+    char buf[24];
+    auto r = std::to_chars(buf, buf + sizeof buf, value);
+    _buffer.append(buf, r.ptr);
+}
+
+void MetricsWriter::text(const char *s, size_t len)
+{
+    if (_format == Format::CBOR) {
+        head(3, len);
+        _buffer.append(s, len);
+        return;
+    }
+    static const char HEX[] = "0123456789abcdef";
+    _buffer.push_back('"');
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            _buffer.push_back('\\');
+            _buffer.push_back(c);
+        } else if (c < 0x20) {
+            _buffer.append("\\u00");
+            _buffer.push_back(HEX[c >> 4]);
+            _buffer.push_back(HEX[c & 0xf]);
+        } else {
+            _buffer.push_back(c);
+        }
+    }
+    _buffer.push_back('"');
+}
+
+void MetricsWriter::head(uint8_t major, uint64_t value)
+{
+    major <<= 5;
+    if (value < 24) {
+        _buffer.push_back(static_cast<char>(major | value));
+        return;
+    }
+    int bytes;
+    if (value <= 0xff) {
+        _buffer.push_back(static_cast<char>(major | 24));
+        bytes = 1;
+    } else if (value <= 0xffff) {
+        _buffer.push_back(static_cast<char>(major | 25));
+        bytes = 2;
+    } else if (value <= 0xffffffff) {
+        _buffer.push_back(static_cast<char>(major | 26));
+        bytes = 4;
+    } else {
+        _buffer.push_back(static_cast<char>(major | 27));
+        bytes = 8;
+    }
+    for (int shift = (bytes - 1) * 8; shift >= 0; shift -= 8) {
+        _buffer.push_back(static_cast<char>(value >> shift));
+    }
+}
+
+void MetricsWriter::commit()
+{
+    if (_buffer.empty()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    _queue.push_back(std::move(_buffer));
+    if (_free.empty()) {
+        _buffer = std::string();
+    } else {
+        _buffer = std::move(_free.back());
+        _free.pop_back();
+    }
+    _ready.notify_one();
+}
+
+void MetricsWriter::close()
+{
+    if (!_thread.joinable()) {
+        return;
+    }
+    commit();
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _closing = true;
+    }
+    _ready.notify_one();
+    _thread.join();
+#ifdef HAVE_ZSTD
+    ZSTD_freeCCtx(_zstd);
+    _zstd = nullptr;
+#endif
+    ::close(_fd);
+    _fd = -1;
+}
+
+void MetricsWriter::run()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true) {
+        _ready.wait(lock, [this] { return !_queue.empty() || _closing; });
+        if (_queue.empty()) {
+            break;
+        }
+        std::string data = std::move(_queue.front());
+        _queue.pop_front();
+        lock.unlock();
+        write(data, false);
+        data.clear();
+        lock.lock();
+        // keeps its capacity for the next commit
+        _free.push_back(std::move(data));
+    }
+    lock.unlock();
+    write(std::string(), true);
+}
+
+void MetricsWriter::write(const std::string &data, bool last)
+{
+#ifdef HAVE_ZSTD
+    if (_compress) {
+        // flush every commit, so the file can be followed as it grows
+        ZSTD_inBuffer in{data.data(), data.size(), 0};
+        size_t remaining;
+        do {
+            ZSTD_outBuffer out{&_zbuf[0], _zbuf.size(), 0};
+            remaining = ZSTD_compressStream2(_zstd, &out, &in, last ? ZSTD_e_end : ZSTD_e_flush);
+            if (ZSTD_isError(remaining)) {
+                std::cerr << "metric output compression failed: " << ZSTD_getErrorName(remaining) << std::endl;
+                _fd_failed = true;
+                return;
+            }
+            write_fd(_zbuf.data(), out.pos);
+        } while (remaining);
+        return;
+    }
+#endif
+    write_fd(data.data(), data.size());
+}
+
+void MetricsWriter::write_fd(const char *data, size_t len)
+{
+    while (len && !_fd_failed) {
+        ssize_t r = ::write(_fd, data, len);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "unable to write metric output: " << std::strerror(errno) << std::endl;
+            _fd_failed = true;
+            return;
+        }
+        data += r;
+        len -= r;
+    }
+}
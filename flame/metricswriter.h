@@ -0,0 +1,124 @@
+// Copyright 2019 NSONE, Inc
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/**
+ * Writes metric records to a file from a background thread. Records are formatted straight into a
+ * reusable buffer, without building a JSON document, and commit() hands the buffer over to the
+ * writer thread for the file i/o (and compression), swapping in one it has finished with. The loop
+ * thread never waits on the disk, and once the buffers have grown to a period's output nothing is
+ * allocated either.
+ *
+ * The format follows from the file name:
+ *
+ *   NAME          newline delimited JSON, one record per line
+ *   NAME.cbor     a CBOR sequence (RFC 8742), one map per record, with the same keys and values
+ *   NAME[.cbor].zst  either of the above, zstd compressed (if built with zstd)
+ *
+ * Files are appended to, each run adding to what is there. Compressed runs add a zstd frame, and
+ * concatenated frames decompress as one stream.
+ */
+class MetricsWriter
+{
+public:
+    enum class Format {
+        NDJSON,
+        CBOR,
+    };
+
+    // deepest nesting of objects and arrays in a record
+    static const int MAX_DEPTH = 8;
+
+    // throws std::runtime_error if the file can't be opened or zstd is needed but not built in
+    explicit MetricsWriter(const std::string &path);
+
+    ~MetricsWriter();
+
+    MetricsWriter(const MetricsWriter &) = delete;
+    MetricsWriter &operator=(const MetricsWriter &) = delete;
+
+    // start a record, or a nested object: named within an object, unnamed within an array
+    void begin_object(const char *key = nullptr);
+    void end_object();
+
+    void begin_array(const char *key);
+    void end_array();
+
+    template <typename T, typename std::enable_if<std::is_unsigned<T>::value, int>::type = 0>
+    void field(const char *key, T value)
+    {
+        name(key);
+        integer(value);
+    }
+
+    template <typename T, typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value, int>::type = 0>
+    void field(const char *key, T value)
+    {
+        name(key);
+        signed_integer(value);
+    }
+
+    void field(const char *key, bool value);
+    void field(const char *key, double value);
+    void field(const char *key, const std::string &value);
+    void field(const char *key, const char *value)
+    {
+        field(key, std::string(value));
+    }
+
+    // hand the records so far to the writer thread
+    void commit();
+
+    // commit, write everything and close the file
+    void close();
+
+private:
+    Format _format{Format::NDJSON};
+    bool _compress{false};
+    int _fd{-1};
+    // writer thread: stop writing after the first error, which has been reported
+    bool _fd_failed{false};
+
+    // loop thread: the buffer being filled, and the nesting within the current record
+    std::string _buffer;
+    int _depth{0};
+    // NDJSON: whether the current object or array has no member yet
+    bool _empty[MAX_DEPTH];
+
+    // shared with the writer thread
+    std::mutex _mutex;
+    std::condition_variable _ready;
+    std::deque<std::string> _queue;
+    std::vector<std::string> _free;
+    bool _closing{false};
+    std::thread _thread;
+
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx *_zstd{nullptr};
+    std::string _zbuf;
+#endif
+
+    void name(const char *key);
+    void integer(uint64_t value);
+    void signed_integer(int64_t value);
+    void text(const char *s, size_t len);
+    // CBOR item head: major type and argument
+    void head(uint8_t major, uint64_t value);
+
+    void run();
+    void write(const std::string &data, bool last);
+    void write_fd(const char *data, size_t len);
+};
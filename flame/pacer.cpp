@@ -0,0 +1,163 @@
+// Copyright 2019 NSONE, Inc
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef __linux__
+#include <sys/timerfd.h>
+#include <unistd.h>
+#endif
+
+#include "metrics.h"
+#include "pacer.h"
+
+constexpr std::chrono::microseconds Pacer::MIN_TICK;
+
+Pacer::Pacer(std::shared_ptr<uvw::Loop> loop, std::shared_ptr<PacerMetrics> metrics, Arrival arrival,
+    long burst_size, send_cb send)
+    : _loop(loop)
+    , _metrics(metrics)
+    , _arrival(arrival)
+    , _burst_size(std::max(burst_size, 1L))
+    , _send(std::move(send))
+    , _rng(std::random_device{}())
+{
+    _due.reserve(MAX_BURST);
+#ifdef __linux__
+    _timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (_timer_fd < 0) {
+        throw std::runtime_error(std::string("unable to create pacing timer: ") + strerror(errno));
+    }
+    _poll = _loop->resource<uvw::PollHandle>(_timer_fd);
+    _poll->on<uvw::PollEvent>([this](const uvw::PollEvent &, uvw::PollHandle &) {
+        uint64_t expirations;
+        if (read(_timer_fd, &expirations, sizeof(expirations)) > 0) {
+            tick();
+        }
+    });
+    _poll->start(uvw::PollHandle::Event::READABLE);
+#else
+    _timer = _loop->resource<uvw::TimerHandle>();
+    _timer->on<uvw::TimerEvent>([this](const uvw::TimerEvent &, uvw::TimerHandle &) {
+        tick();
+    });
+#endif
+}
+
+Pacer::~Pacer()
+{
+    stop();
+}
+
+void Pacer::rate(uint64_t qps)
+{
+    if (_stopped) {
+        return;
+    }
+    bool running = _qps;
+    _qps = qps;
+    if (!_qps) {
+        return;
+    }
+    // start over at the new rate from the next query's time, so frequent changes (a QPS flow
+    // ramp) don't add a query each, but no later than one new interval from now
+    auto now = clock::now();
+    auto now_hr = std::chrono::high_resolution_clock::now();
+    _start = running ? std::min(_next, now + std::chrono::nanoseconds(1000000000 / _qps)) : now;
+    _start_hr = now_hr + std::chrono::duration_cast<time_point::duration>(_start - now);
+    _gap = std::exponential_distribution<double>(static_cast<double>(_qps));
+    _poisson_offset = 0.0;
+    _index = 0;
+    _next = _start;
+    _last_send = clock::time_point{};
+    arm(_next);
+}
+
+void Pacer::advance()
+{
+    _index++;
+    switch (_arrival) {
+    case Arrival::CONSTANT:
+        _next = intended(_index);
+        break;
+    case Arrival::POISSON:
+        _poisson_offset += _gap(_rng);
+        _next = _start + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(_poisson_offset));
+        break;
+    case Arrival::BURST:
+        _next = intended(_index - _index % _burst_size);
+        break;
+    }
+}
+
+void Pacer::stop()
+{
+    if (_stopped) {
+        return;
+    }
+    _stopped = true;
+    _qps = 0;
+#ifdef __linux__
+    _poll->stop();
+    _poll->close();
+    close(_timer_fd);
+    _timer_fd = -1;
+#else
+    _timer->stop();
+    _timer->close();
+#endif
+}
+
+void Pacer::arm(clock::time_point when)
+{
+#ifdef __linux__
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(when.time_since_epoch()).count();
+    itimerspec spec{};
+    spec.it_value.tv_sec = ns / 1000000000;
+    spec.it_value.tv_nsec = ns % 1000000000;
+    if (!spec.it_value.tv_sec && !spec.it_value.tv_nsec) {
+        // zero would disarm the timer
+        spec.it_value.tv_nsec = 1;
+    }
+    timerfd_settime(_timer_fd, TFD_TIMER_ABSTIME, &spec, nullptr);
+#else
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(when - clock::now()).count();
+    _timer->start(uvw::TimerHandle::Time{std::max<long long>(ms, 1)}, uvw::TimerHandle::Time{0});
+#endif
+}
+
+void Pacer::tick()
+{
+    if (!_qps) {
+        return;
+    }
+
+    auto now = clock::now();
+    _due.clear();
+    if (_next <= now) {
+        // jitter, once for the queries sent together: how far the gap since the last send is off
+        // the intended gap
+        if (_last_send != clock::time_point{}) {
+            auto gap = (now - _last_send) - (_next - _last_intended);
+            _metrics->tick((gap.count() < 0) ? -gap : gap);
+        }
+        _last_send = now;
+    }
+    while (_next <= now && _due.size() < MAX_BURST) {
+        _metrics->sent(now - _next);
+        _last_intended = _next;
+        _due.push_back(_start_hr + std::chrono::duration_cast<time_point::duration>(_next - _start));
+        advance();
+    }
+    if (_due.size()) {
+        _send(_due);
+    }
+
+    // sleep until the next query is due, but not so briefly that waking up costs more than sending
+    auto wake = _next;
+    if (wake < now + MIN_TICK && _due.size() < MAX_BURST) {
+        wake = now + MIN_TICK;
+    }
+    arm(wake);
+}
@@ -0,0 +1,99 @@
+// Copyright 2019 NSONE, Inc
+
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include <uvw.hpp>
+
+class PacerMetrics;
+
+/**
+ * Drives sends open loop: every query gets an intended send time from an arrival process at the
+ * configured rate, independent of how earlier queries fared, and the pacer wakes up as those times
+ * come due instead of on a millisecond timer tick. When the loop runs late, the queries that came
+ * due meanwhile are sent on the next wake up, so the long run rate stays exact.
+ *
+ * On Linux the wake ups come from a timerfd with nanosecond resolution, watched by a uvw poll
+ * handle on the normal event loop. Elsewhere a 1 ms libuv timer is used, which still spreads
+ * queries evenly over each millisecond.
+ */
+class Pacer
+{
+public:
+    using clock = std::chrono::steady_clock;
+    // the clock query send times and latencies are measured with
+    using time_point = std::chrono::high_resolution_clock::time_point;
+
+    // called with the intended send times of the queries to send now, oldest first
+    using send_cb = std::function<void(const std::vector<time_point> &intended)>;
+
+    enum class Arrival {
+        // evenly spaced
+        CONSTANT,
+        // exponentially distributed gaps, as from many independent clients
+        POISSON,
+        // groups of burst_size queries at once, the groups evenly spaced
+        BURST,
+    };
+
+    // shortest sleep between wake ups: at high rates several queries go out on each
+    static constexpr std::chrono::microseconds MIN_TICK{20};
+    // most queries sent on one wake up when catching up, the rest follow on the next
+    static const long MAX_BURST = 1000;
+
+    /**
+     * @param burst_size queries per group, for Arrival::BURST
+     */
+    Pacer(std::shared_ptr<uvw::Loop> loop, std::shared_ptr<PacerMetrics> metrics, Arrival arrival,
+        long burst_size, send_cb send);
+    ~Pacer();
+
+    // start or change the rate, queries per second. 0 pauses sending.
+    void rate(uint64_t qps);
+
+    void stop();
+
+private:
+    std::shared_ptr<uvw::Loop> _loop;
+    std::shared_ptr<PacerMetrics> _metrics;
+    Arrival _arrival;
+    uint64_t _burst_size;
+    send_cb _send;
+
+    int _timer_fd{-1};
+    std::shared_ptr<uvw::PollHandle> _poll;
+    std::shared_ptr<uvw::TimerHandle> _timer;
+
+    bool _stopped{false};
+    uint64_t _qps{0};
+    // start of the current rate, on both clocks
+    clock::time_point _start;
+    time_point _start_hr;
+    // index and intended time of the next query. constant and burst times are computed from the
+    // index, query n n / qps seconds after _start exactly, so the rate doesn't drift with a
+    // rounded interval
+    uint64_t _index{0};
+    clock::time_point _next;
+    // poisson: sum of the gaps so far, in seconds
+    double _poisson_offset{0.0};
+    std::mt19937_64 _rng;
+    std::exponential_distribution<double> _gap;
+
+    clock::time_point _last_send;
+    clock::time_point _last_intended;
+    std::vector<time_point> _due;
+
+    clock::time_point intended(uint64_t index) const
+    {
+        return _start + std::chrono::seconds(index / _qps) + std::chrono::nanoseconds((index % _qps) * 1000000000 / _qps);
+    }
+
+    void advance();
+    void tick();
+    void arm(clock::time_point when);
+};
@@ -0,0 +1,347 @@
+// Copyright 2019 NSONE, Inc
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/udp.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "packetsender.h"
+
+// ring geometry: 4096 frames of 2KB, enough for a standard MTU frame each
+static const unsigned int BLOCK_SIZE = 1 << 16;
+static const unsigned int BLOCK_COUNT = 128;
+static const unsigned int FRAME_SIZE = 2048;
+// where the frame data starts, behind the tpacket header
+static const size_t TX_DATA_OFFSET = TPACKET_ALIGN(sizeof(tpacket2_hdr));
+
+static uint32_t csum_add(uint32_t sum, const void *data, size_t len)
+{
+    // summed as stored (network order) 16 bit words, so the result can be stored as is
+    auto p = static_cast<const unsigned char *>(data);
+    uint16_t word;
+    for (; len > 1; len -= 2, p += 2) {
+        memcpy(&word, p, 2);
+        sum += word;
+    }
+    if (len) {
+        word = 0;
+        memcpy(&word, p, 1);
+        sum += word;
+    }
+    return sum;
+}
+
+static uint16_t csum_fold(uint32_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return static_cast<uint16_t>(~sum);
+}
+
+static bool parse_mac(const std::string &s, unsigned char mac[6])
+{
+    unsigned int b[6];
+    char extra;
+    if (sscanf(s.c_str(), "%x:%x:%x:%x:%x:%x%c", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5], &extra) != 6) {
+        return false;
+    }
+    for (int i = 0; i < 6; i++) {
+        if (b[i] > 0xff) {
+            return false;
+        }
+        mac[i] = b[i];
+    }
+    return true;
+}
+
+// the IPv4 next hop to target on iface: its gateway from the main routing table, or itself if on link
+static in_addr_t next_hop(const std::string &iface, in_addr_t target)
+{
+    std::ifstream routes("/proc/net/route");
+    std::string line;
+    std::getline(routes, line);
+    in_addr_t hop = target;
+    int best_prefix = -1;
+    while (std::getline(routes, line)) {
+        char name[IFNAMSIZ + 1];
+        unsigned int dest, gateway, flags, mask;
+        // addresses are printed as the hex of the in memory (network order) value
+        if (sscanf(line.c_str(), "%16s %x %x %x %*d %*d %*d %x", name, &dest, &gateway, &flags, &mask) != 5) {
+            continue;
+        }
+        int prefix = __builtin_popcount(mask);
+        if (iface == name && (flags & 0x1) && (target & mask) == dest && prefix > best_prefix) {
+            best_prefix = prefix;
+            // RTF_GATEWAY
+            hop = (flags & 0x2) ? gateway : target;
+        }
+    }
+    return hop;
+}
+
+static bool arp_lookup(const std::string &iface, in_addr_t addr, unsigned char mac[6])
+{
+    std::ifstream arp("/proc/net/arp");
+    std::string line;
+    std::getline(arp, line);
+    while (std::getline(arp, line)) {
+        std::istringstream fields(line);
+        std::string ip, hw_type, flags, hw_addr, mask, dev;
+        fields >> ip >> hw_type >> flags >> hw_addr >> mask >> dev;
+        in_addr entry;
+        // ATF_COM: the entry is resolved
+        if (dev == iface && inet_pton(AF_INET, ip.c_str(), &entry) == 1 && entry.s_addr == addr
+            && (std::stoul(flags, nullptr, 16) & 0x2)) {
+            return parse_mac(hw_addr, mac);
+        }
+    }
+    return false;
+}
+
+PacketSender::PacketSender(const std::string &iface, int family, const std::string &target_address, unsigned int port,
+    const std::string &dst_mac)
+    : _family(family)
+{
+    sockaddr_storage dst{};
+    socklen_t dst_len;
+    if (family == AF_INET) {
+        auto sin = reinterpret_cast<sockaddr_in *>(&dst);
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(port);
+        dst_len = sizeof(sockaddr_in);
+        if (inet_pton(AF_INET, target_address.c_str(), &sin->sin_addr) != 1) {
+            throw std::runtime_error("invalid target address: " + target_address);
+        }
+    } else {
+        auto sin6 = reinterpret_cast<sockaddr_in6 *>(&dst);
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(port);
+        dst_len = sizeof(sockaddr_in6);
+        if (inet_pton(AF_INET6, target_address.c_str(), &sin6->sin6_addr) != 1) {
+            throw std::runtime_error("invalid target address: " + target_address);
+        }
+    }
+
+    // let the kernel pick the source address it would use for the target
+    sockaddr_storage src{};
+    socklen_t src_len{sizeof(src)};
+    int probe = socket(family, SOCK_DGRAM, 0);
+    if (probe < 0 || connect(probe, reinterpret_cast<sockaddr *>(&dst), dst_len) != 0
+        || getsockname(probe, reinterpret_cast<sockaddr *>(&src), &src_len) != 0) {
+        int err = errno;
+        if (probe >= 0) {
+            close(probe);
+        }
+        throw std::runtime_error(std::string("no route to target: ") + strerror(err));
+    }
+
+    ifreq ifr{};
+    if (iface.size() >= IFNAMSIZ) {
+        close(probe);
+        throw std::runtime_error("invalid interface: " + iface);
+    }
+    strncpy(ifr.ifr_name, iface.c_str(), IFNAMSIZ - 1);
+    if (ioctl(probe, SIOCGIFINDEX, &ifr) != 0) {
+        close(probe);
+        throw std::runtime_error("unknown interface: " + iface);
+    }
+    int ifindex = ifr.ifr_ifindex;
+    ioctl(probe, SIOCGIFFLAGS, &ifr);
+    bool loopback = ifr.ifr_flags & IFF_LOOPBACK;
+    ioctl(probe, SIOCGIFMTU, &ifr);
+    size_t mtu = ifr.ifr_mtu;
+    unsigned char src_mac[6] = {0};
+    if (ioctl(probe, SIOCGIFHWADDR, &ifr) == 0) {
+        memcpy(src_mac, ifr.ifr_hwaddr.sa_data, 6);
+    }
+    close(probe);
+
+    unsigned char next_mac[6] = {0};
+    if (!dst_mac.empty()) {
+        if (!parse_mac(dst_mac, next_mac)) {
+            throw std::runtime_error("invalid MAC address: " + dst_mac);
+        }
+    } else if (!loopback) {
+        if (family != AF_INET) {
+            throw std::runtime_error("unable to look up the next hop MAC address for IPv6, it must be given");
+        }
+        in_addr_t hop = next_hop(iface, reinterpret_cast<sockaddr_in *>(&dst)->sin_addr.s_addr);
+        if (!arp_lookup(iface, hop, next_mac)) {
+            char ip[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &hop, ip, sizeof(ip));
+            throw std::runtime_error(std::string("next hop ") + ip + " is not in the ARP table, ping it first or give its MAC address");
+        }
+    }
+
+    _fd = socket(AF_PACKET, SOCK_RAW, 0);
+    if (_fd < 0) {
+        throw std::runtime_error(std::string("unable to create packet socket (needs CAP_NET_RAW): ") + strerror(errno));
+    }
+    int version = TPACKET_V2;
+    if (setsockopt(_fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) != 0) {
+        close(_fd);
+        throw std::runtime_error(std::string("unable to set packet socket version: ") + strerror(errno));
+    }
+    // straight to the driver. frames the device queue can't take are dropped, not queued.
+    int one = 1;
+    setsockopt(_fd, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one));
+
+    tpacket_req req{};
+    req.tp_block_size = BLOCK_SIZE;
+    req.tp_block_nr = BLOCK_COUNT;
+    req.tp_frame_size = FRAME_SIZE;
+    req.tp_frame_nr = (BLOCK_SIZE / FRAME_SIZE) * BLOCK_COUNT;
+    if (setsockopt(_fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) != 0) {
+        close(_fd);
+        throw std::runtime_error(std::string("unable to set up packet TX ring: ") + strerror(errno));
+    }
+    _frame_count = req.tp_frame_nr;
+    _ring_size = static_cast<size_t>(BLOCK_SIZE) * BLOCK_COUNT;
+    void *ring = mmap(nullptr, _ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    if (ring == MAP_FAILED) {
+        close(_fd);
+        throw std::runtime_error(std::string("unable to map packet TX ring: ") + strerror(errno));
+    }
+    _ring = static_cast<char *>(ring);
+
+    // protocol 0: send only, the socket doesn't get a copy of every received frame
+    sockaddr_ll ll{};
+    ll.sll_family = AF_PACKET;
+    ll.sll_ifindex = ifindex;
+    if (bind(_fd, reinterpret_cast<sockaddr *>(&ll), sizeof(ll)) != 0) {
+        munmap(_ring, _ring_size);
+        close(_fd);
+        throw std::runtime_error(std::string("unable to bind packet socket: ") + strerror(errno));
+    }
+
+    build_header(src_mac, next_mac, src, dst);
+    size_t ip_udp_len = _header.size() - _ip_offset;
+    _max_payload = std::min(FRAME_SIZE - TX_DATA_OFFSET - _header.size(), mtu - ip_udp_len);
+}
+
+PacketSender::~PacketSender()
+{
+    if (_ring) {
+        munmap(_ring, _ring_size);
+    }
+    if (_fd >= 0) {
+        close(_fd);
+    }
+}
+
+void PacketSender::build_header(const unsigned char src_mac[6], const unsigned char dst_mac[6],
+    const sockaddr_storage &src, const sockaddr_storage &dst)
+{
+    ether_header eth{};
+    memcpy(eth.ether_dhost, dst_mac, 6);
+    memcpy(eth.ether_shost, src_mac, 6);
+    _ip_offset = sizeof(eth);
+
+    udphdr udp{};
+    uint16_t dport;
+    if (_family == AF_INET) {
+        auto s4 = reinterpret_cast<const sockaddr_in *>(&src);
+        auto d4 = reinterpret_cast<const sockaddr_in *>(&dst);
+        eth.ether_type = htons(ETHERTYPE_IP);
+        iphdr ip{};
+        ip.version = 4;
+        ip.ihl = sizeof(ip) / 4;
+        ip.frag_off = htons(IP_DF);
+        ip.ttl = 64;
+        ip.protocol = IPPROTO_UDP;
+        ip.saddr = s4->sin_addr.s_addr;
+        ip.daddr = d4->sin_addr.s_addr;
+        // length, ID and checksum are per packet and still 0 here
+        _ip_sum = csum_add(0, &ip, sizeof(ip));
+        _pseudo_sum = csum_add(0, &ip.saddr, 8);
+        dport = d4->sin_port;
+        _udp_offset = _ip_offset + sizeof(ip);
+        _header.resize(_udp_offset + sizeof(udp));
+        memcpy(_header.data() + _ip_offset, &ip, sizeof(ip));
+    } else {
+        auto s6 = reinterpret_cast<const sockaddr_in6 *>(&src);
+        auto d6 = reinterpret_cast<const sockaddr_in6 *>(&dst);
+        eth.ether_type = htons(ETHERTYPE_IPV6);
+        ip6_hdr ip6{};
+        ip6.ip6_flow = htonl(6 << 28);
+        ip6.ip6_nxt = IPPROTO_UDP;
+        ip6.ip6_hops = 64;
+        ip6.ip6_src = s6->sin6_addr;
+        ip6.ip6_dst = d6->sin6_addr;
+        _pseudo_sum = csum_add(0, &ip6.ip6_src, 32);
+        dport = d6->sin6_port;
+        _udp_offset = _ip_offset + sizeof(ip6);
+        _header.resize(_udp_offset + sizeof(udp));
+        memcpy(_header.data() + _ip_offset, &ip6, sizeof(ip6));
+    }
+    memcpy(_header.data(), &eth, sizeof(eth));
+    udp.dest = dport;
+    memcpy(_header.data() + _udp_offset, &udp, sizeof(udp));
+    uint16_t proto = htons(IPPROTO_UDP);
+    _pseudo_sum = csum_add(_pseudo_sum, &proto, 2);
+    _pseudo_sum = csum_add(_pseudo_sum, &dport, 2);
+}
+
+bool PacketSender::send(uint16_t src_port, const char data[], size_t len)
+{
+    if (len > _max_payload) {
+        return false;
+    }
+    auto tp = reinterpret_cast<tpacket2_hdr *>(_ring + static_cast<size_t>(_frame_index) * FRAME_SIZE);
+    uint32_t status = __atomic_load_n(&tp->tp_status, __ATOMIC_ACQUIRE);
+    // a frame the kernel rejected is free again too
+    if (status != TP_STATUS_AVAILABLE && status != TP_STATUS_WRONG_FORMAT) {
+        return false;
+    }
+
+    char *frame = reinterpret_cast<char *>(tp) + TX_DATA_OFFSET;
+    memcpy(frame, _header.data(), _header.size());
+    memcpy(frame + _header.size(), data, len);
+
+    uint16_t udp_len = htons(sizeof(udphdr) + len);
+    uint16_t sport = htons(src_port);
+    auto udp = reinterpret_cast<udphdr *>(frame + _udp_offset);
+    udp->source = sport;
+    udp->len = udp_len;
+    // pseudo header and UDP header both carry the length
+    uint32_t sum = _pseudo_sum + sport + udp_len + udp_len;
+    uint16_t check = csum_fold(csum_add(sum, data, len));
+    udp->check = check ? check : 0xffff;
+
+    if (_family == AF_INET) {
+        auto ip = reinterpret_cast<iphdr *>(frame + _ip_offset);
+        ip->tot_len = htons(sizeof(iphdr) + sizeof(udphdr) + len);
+        ip->id = htons(_ip_id++);
+        ip->check = csum_fold(_ip_sum + ip->tot_len + ip->id);
+    } else {
+        auto ip6 = reinterpret_cast<ip6_hdr *>(frame + _ip_offset);
+        ip6->ip6_plen = udp_len;
+    }
+
+    tp->tp_len = _header.size() + len;
+    __atomic_store_n(&tp->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+    _frame_index = (_frame_index + 1) % _frame_count;
+    return true;
+}
+
+void PacketSender::flush()
+{
+    // with a TX ring, an empty send transmits every frame marked TP_STATUS_SEND_REQUEST
+    ::send(_fd, nullptr, 0, MSG_DONTWAIT);
+}
@@ -0,0 +1,65 @@
+// Copyright 2019 NSONE, Inc
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <netinet/in.h>
+
+/**
+ * Sends UDP datagrams as complete Ethernet frames through an AF_PACKET socket with a mmaped
+ * PACKET_TX_RING, bypassing the kernel's UDP and IP stack. The Ethernet, IP and UDP headers are
+ * built once, and only the per packet fields (lengths, source port, IP ID, checksums) are filled
+ * in for each datagram. Nothing is received on this socket: the source port of each datagram
+ * should belong to a normal UDP socket, which receives the responses.
+ */
+class PacketSender
+{
+public:
+    /**
+     * @param iface interface to send on, the target must be reachable through it
+     * @param family AF_INET or AF_INET6
+     * @param dst_mac next hop MAC address (aa:bb:cc:dd:ee:ff). empty to look it up, which is only
+     *        supported for loopback and for IPv4 targets or gateways already in the ARP table.
+     */
+    PacketSender(const std::string &iface, int family, const std::string &target_address, unsigned int port,
+        const std::string &dst_mac);
+    ~PacketSender();
+
+    // largest UDP payload that fits in both a ring frame and the interface MTU
+    size_t max_payload() const
+    {
+        return _max_payload;
+    }
+
+    /**
+     * Queue a datagram from src_port to the target in the next free frame. Returns false if the
+     * ring is full or the payload is larger than max_payload(). Frames are transmitted on flush().
+     */
+    bool send(uint16_t src_port, const char data[], size_t len);
+
+    // have the kernel transmit all queued frames, without waiting for them
+    void flush();
+
+private:
+    int _fd{-1};
+    int _family;
+    char *_ring{nullptr};
+    size_t _ring_size{0};
+    unsigned int _frame_count{0};
+    unsigned int _frame_index{0};
+    size_t _max_payload{0};
+
+    // prebuilt Ethernet + IP + UDP headers
+    std::vector<char> _header;
+    size_t _ip_offset;
+    size_t _udp_offset;
+    uint16_t _ip_id{0};
+    // partial ones' complement sums over the header fields that never change
+    uint32_t _ip_sum{0};
+    uint32_t _pseudo_sum{0};
+
+    void build_header(const unsigned char src_mac[6], const unsigned char dst_mac[6],
+        const sockaddr_storage &src, const sockaddr_storage &dst);
+};
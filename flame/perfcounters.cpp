@@ -0,0 +1,119 @@
+// Copyright 2019 NSONE, Inc
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "perfcounters.h"
+
+#ifdef __linux__
+
+static const uint64_t EVENTS[PerfCounters::COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+static int open_counter(uint64_t event, int group, bool user_only)
+{
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof attr);
+    attr.size = sizeof attr;
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = event;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    // the group starts when its leader is enabled
+    attr.disabled = (group == -1);
+    attr.exclude_kernel = user_only;
+    attr.exclude_hv = 1;
+    // this thread, on any CPU
+    return syscall(__NR_perf_event_open, &attr, 0, -1, group, PERF_FLAG_FD_CLOEXEC);
+}
+
+PerfCounters::PerfCounters()
+{
+    _fd.fill(-1);
+    for (int attempt = 0; attempt < 2; attempt++) {
+        for (size_t i = 0; i < COUNTERS; i++) {
+            _fd[i] = open_counter(EVENTS[i], i ? _fd[0] : -1, _user_only);
+            if (_fd[i] >= 0) {
+                continue;
+            }
+            int err = errno;
+            for (size_t j = 0; j < i; j++) {
+                close(_fd[j]);
+                _fd[j] = -1;
+            }
+            if ((err == EACCES || err == EPERM) && !_user_only) {
+                // kernel counts need perf_event_paranoid <= 1
+                _user_only = true;
+                break;
+            }
+            throw std::runtime_error(std::string("hardware performance counters unavailable: ") + std::strerror(err));
+        }
+        if (_fd[0] >= 0) {
+            break;
+        }
+    }
+    ioctl(_fd[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(_fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+PerfCounters::~PerfCounters()
+{
+    for (auto fd : _fd) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+}
+
+PerfCounters::Values PerfCounters::read() const
+{
+    // nr, time enabled, time running, then the values in the order the events were added
+    uint64_t buf[3 + COUNTERS];
+    Values v{};
+    if (::read(_fd[0], buf, sizeof buf) != sizeof buf || !buf[2]) {
+        return v;
+    }
+    double scale = static_cast<double>(buf[1]) / buf[2];
+    for (size_t i = 0; i < COUNTERS; i++) {
+        v[i] = (buf[1] == buf[2]) ? buf[3 + i] : static_cast<uint64_t>(buf[3 + i] * scale);
+    }
+    return v;
+}
+
+#else
+
+PerfCounters::PerfCounters()
+{
+    _fd.fill(-1);
+    throw std::runtime_error("hardware performance counters need Linux");
+}
+
+PerfCounters::~PerfCounters()
+{
+}
+
+PerfCounters::Values PerfCounters::read() const
+{
+    return Values{};
+}
+
+#endif
+
+const char *PerfCounters::name(Counter c)
+{
+    static const char *const NAMES[COUNTERS] = {"cycles", "instructions", "cache_misses", "branch_misses"};
+    return NAMES[c];
+}
@@ -0,0 +1,50 @@
+// Copyright 2019 NSONE, Inc
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+/**
+ * Hardware performance counters of the calling thread, as one perf_event_open group so all are
+ * read at once: cycles, instructions, cache misses and branch misses. Kernel time is counted too
+ * where perf_event_paranoid allows, otherwise user space only. Linux only.
+ *
+ * A read is a syscall, so counting slows the thread down: counts are for comparing the hot paths
+ * between releases, not absolute costs.
+ */
+class PerfCounters
+{
+public:
+    enum Counter {
+        CYCLES,
+        INSTRUCTIONS,
+        CACHE_MISSES,
+        BRANCH_MISSES,
+        COUNTERS,
+    };
+
+    using Values = std::array<uint64_t, COUNTERS>;
+
+    // throws std::runtime_error if the counters aren't available, e.g. in a VM without a PMU
+    PerfCounters();
+
+    ~PerfCounters();
+
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters &operator=(const PerfCounters &) = delete;
+
+    // counts so far, scaled up if the counters had to share the PMU with others
+    Values read() const;
+
+    bool user_only() const
+    {
+        return _user_only;
+    }
+
+    static const char *name(Counter c);
+
+private:
+    std::array<int, COUNTERS> _fd;
+    bool _user_only{false};
+};
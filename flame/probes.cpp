@@ -0,0 +1,13 @@
+// Copyright 2019 NSONE, Inc
+
+#include "probes.h"
+
+#ifdef HAVE_SYS_SDT_H
+
+// the semaphores a tracer increments when it attaches to a probe, in the section it looks for them
+#define FLAME_PROBE_SEMAPHORE(name) \
+    __extension__ unsigned short flame_##name##_semaphore __attribute__((unused)) __attribute__((section(".probes")));
+FLAME_PROBES(FLAME_PROBE_SEMAPHORE)
+#undef FLAME_PROBE_SEMAPHORE
+
+#endif
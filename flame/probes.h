@@ -0,0 +1,87 @@
+// Copyright 2019 NSONE, Inc
+
+#pragma once
+
+/**
+ * USDT probes (provider "flame") for tracing a run live with bpftrace, perf or SystemTap:
+ *
+ *   query__send(id, size, port)                    a UDP query went out from source port
+ *   query__response(id, latency_ns, size, rcode)   an answer to an in flight query
+ *   query__timeout(id, age_ns)
+ *   tcp__connect(port, connect_ns)                 a TCP (DoT, DoH) connection from port is up
+ *   tcp__close(port, in_flight)                    it closed, with queries left unanswered
+ *   metrics__period(sent, received, timeouts, in_flight)   totals of a metrics period
+ *
+ * e.g. bpftrace -e 'usdt:./flame:flame:query__response { @ns = hist(arg1); }'
+ *
+ * A probe is a nop until a tracer attaches, and its arguments are only worked out while its
+ * semaphore says one is attached. Without sys/sdt.h at build time probes compile to nothing.
+ */
+
+#ifdef HAVE_SYS_SDT_H
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define FLAME_PROBES(X) \
+    X(query__send)      \
+    X(query__response)  \
+    X(query__timeout)   \
+    X(tcp__connect)     \
+    X(tcp__close)       \
+    X(metrics__period)
+
+#define FLAME_PROBE_SEMAPHORE(name) __extension__ extern unsigned short flame_##name##_semaphore __attribute__((unused));
+FLAME_PROBES(FLAME_PROBE_SEMAPHORE)
+#undef FLAME_PROBE_SEMAPHORE
+
+#define FLAME_PROBE_ENABLED(name) __builtin_expect(flame_##name##_semaphore, 0)
+
+#define FLAME_PROBE2(name, a, b)                    \
+    do {                                            \
+        if (FLAME_PROBE_ENABLED(name)) {            \
+            DTRACE_PROBE2(flame, name, a, b);       \
+        }                                           \
+    } while (0)
+#define FLAME_PROBE3(name, a, b, c)                 \
+    do {                                            \
+        if (FLAME_PROBE_ENABLED(name)) {            \
+            DTRACE_PROBE3(flame, name, a, b, c);    \
+        }                                           \
+    } while (0)
+#define FLAME_PROBE4(name, a, b, c, d)              \
+    do {                                            \
+        if (FLAME_PROBE_ENABLED(name)) {            \
+            DTRACE_PROBE4(flame, name, a, b, c, d); \
+        }                                           \
+    } while (0)
+
+#else
+
+// arguments are referenced, so variables kept for a probe aren't unused, but never evaluated
+#define FLAME_PROBE2(name, a, b) \
+    do {                         \
+        if (false) {             \
+            (void)(a);           \
+            (void)(b);           \
+        }                        \
+    } while (0)
+#define FLAME_PROBE3(name, a, b, c) \
+    do {                            \
+        if (false) {                \
+            (void)(a);              \
+            (void)(b);              \
+            (void)(c);              \
+        }                           \
+    } while (0)
+#define FLAME_PROBE4(name, a, b, c, d) \
+    do {                               \
+        if (false) {                   \
+            (void)(a);                 \
+            (void)(b);                 \
+            (void)(c);                 \
+            (void)(d);                 \
+        }                              \
+    } while (0)
+
+#endif
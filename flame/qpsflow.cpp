@@ -0,0 +1,222 @@
+// Copyright 2019 NSONE, Inc
+
+#include <cctype>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+#include "metrics.h"
+#include "qpsflow.h"
+#include "utils.h"
+
+constexpr std::chrono::milliseconds QPSFlow::TICK;
+
+static double number(const std::string &s)
+{
+    size_t end;
+    double v = std::stod(s, &end);
+    if (end != s.size() || v < 0 || !std::isfinite(v)) {
+        throw std::invalid_argument(s);
+    }
+    return v;
+}
+
+QPSFlow::QPSFlow(const std::string &spec)
+{
+    auto groups = split(spec, ';');
+    for (size_t i = 0; i < groups.size(); i++) {
+        const auto &g = groups[i];
+        if (g.empty()) {
+            continue;
+        }
+        if (_loop) {
+            throw std::invalid_argument("loop must be the last QPS flow group");
+        }
+        if (g == "loop") {
+            _loop = true;
+            continue;
+        }
+        if (g.rfind("file:", 0) == 0) {
+            _groups.push_back("replaying " + g.substr(5));
+            add_file(g.substr(5), _groups.size() - 1);
+            continue;
+        }
+        auto parts = split(g, ',');
+        if (parts.size() != 2) {
+            throw std::invalid_argument("bad QPS flow group: " + g);
+        }
+        auto shape = split(parts[0], ':');
+        Segment s{Shape::HOLD, 0, 0, 0, 0, _groups.size()};
+        try {
+            s.ms = number(parts[1]);
+            if (shape.size() == 1) {
+                s.from = number(shape[0]);
+                _groups.push_back(shape[0] + " for " + parts[1] + "ms");
+            } else if (shape[0] == "ramp" && shape.size() == 3) {
+                s.shape = Shape::RAMP;
+                s.from = number(shape[1]);
+                s.to = number(shape[2]);
+                _groups.push_back("ramping " + shape[1] + " to " + shape[2] + " over " + parts[1] + "ms");
+            } else if (shape[0] == "sine" && shape.size() == 4) {
+                s.shape = Shape::SINE;
+                s.from = number(shape[1]);
+                s.to = number(shape[2]);
+                s.period_ms = number(shape[3]);
+                if (!s.period_ms) {
+                    throw std::invalid_argument(g);
+                }
+                _groups.push_back(shape[1] + " +/- " + shape[2] + " every " + shape[3] + "ms, for " + parts[1] + "ms");
+            } else {
+                throw std::invalid_argument(g);
+            }
+        } catch (const std::logic_error &) {
+            throw std::invalid_argument("bad QPS flow group: " + g);
+        }
+        _segments.push_back(s);
+    }
+    if (_segments.empty()) {
+        throw std::invalid_argument("empty QPS flow");
+    }
+    if (_loop) {
+        double length{0};
+        for (const auto &s : _segments) {
+            length += s.ms;
+        }
+        if (!length) {
+            throw std::invalid_argument("a looping QPS flow needs a length");
+        }
+    }
+}
+
+void QPSFlow::add_file(const std::string &path, size_t group)
+{
+    std::ifstream in(path);
+    if (!in) {
+        throw std::invalid_argument("unable to read QPS flow file " + path);
+    }
+    // (seconds, qps) points, the series is followed linearly from one to the next
+    std::vector<std::pair<double, double>> points;
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.size() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (line.empty() || !(isdigit(line[0]) || line[0] == '.')) {
+            // header or comment
+            continue;
+        }
+        auto cols = split(line, ',');
+        try {
+            if (cols.size() == 1) {
+                points.emplace_back(points.size(), number(cols[0]));
+            } else if (cols.size() == 2) {
+                points.emplace_back(number(cols[0]), number(cols[1]));
+            } else {
+                throw std::invalid_argument(line);
+            }
+        } catch (const std::logic_error &) {
+            throw std::invalid_argument("bad line in QPS flow file " + path + ": " + line);
+        }
+        if (points.size() > 1 && points.back().first <= points[points.size() - 2].first) {
+            throw std::invalid_argument("times must increase in QPS flow file " + path + ": " + line);
+        }
+    }
+    if (points.empty()) {
+        throw std::invalid_argument("no rates in QPS flow file " + path);
+    }
+    for (size_t i = 0; i + 1 < points.size(); i++) {
+        _segments.push_back(Segment{Shape::RAMP, points[i].second, points[i + 1].second, 0,
+            (points[i + 1].first - points[i].first) * 1000, group});
+    }
+    // the last point holds for a second, like the others
+    _segments.push_back(Segment{Shape::HOLD, points.back().second, 0, 0, 1000, group});
+}
+
+void QPSFlow::start(std::shared_ptr<uvw::Loop> loop, std::shared_ptr<FlowMetrics> metrics, rate_cb set_rate, int verbosity)
+{
+    _metrics = metrics;
+    _set_rate = std::move(set_rate);
+    _verbosity = verbosity;
+    _start = _last_tick = std::chrono::steady_clock::now();
+    _timer = loop->resource<uvw::TimerHandle>();
+    _timer->on<uvw::TimerEvent>([this](const auto &, auto &) { tick(); });
+    announce();
+    tick();
+    _timer->start(uvw::TimerHandle::Time{TICK}, uvw::TimerHandle::Time{TICK});
+}
+
+void QPSFlow::stop()
+{
+    if (_timer) {
+        _timer->stop();
+        _timer->close();
+        _timer.reset();
+    }
+}
+
+void QPSFlow::announce() const
+{
+    if (!_verbosity) {
+        return;
+    }
+    const auto &s = _segments[_segment];
+    bool last = !_loop && s.group == _segments.back().group;
+    std::cout << "QPS flow now " << _groups[s.group];
+    if (last) {
+        std::cout << ", then holding until completion";
+    } else {
+        std::cout << ", flows left: " << (_groups.size() - s.group - 1);
+        if (_loop) {
+            std::cout << " (looping)";
+        }
+    }
+    std::cout << std::endl;
+}
+
+void QPSFlow::tick()
+{
+    auto now = std::chrono::steady_clock::now();
+    // queries the flow asked for since the last tick, at the rate set then
+    _metrics->expected(_rate * std::chrono::duration<double>(now - _last_tick).count());
+    _last_tick = now;
+
+    double t = std::chrono::duration<double, std::milli>(now - _start).count();
+    size_t group = _segments[_segment].group;
+    while (t >= _segment_start_ms + _segments[_segment].ms) {
+        if (_segment + 1 < _segments.size()) {
+            _segment_start_ms += _segments[_segment].ms;
+            _segment++;
+        } else if (_loop) {
+            _segment_start_ms += _segments[_segment].ms;
+            _segment = 0;
+        } else {
+            // the last segment holds
+            break;
+        }
+    }
+    if (_segments[_segment].group != group) {
+        announce();
+    }
+
+    const auto &s = _segments[_segment];
+    double offset = t - _segment_start_ms;
+    switch (s.shape) {
+    case Shape::HOLD:
+        _rate = s.from;
+        break;
+    case Shape::RAMP:
+        _rate = s.from + (s.to - s.from) * std::min(s.ms ? offset / s.ms : 1.0, 1.0);
+        break;
+    case Shape::SINE:
+        _rate = std::max(s.from + s.to * std::sin(2 * M_PI * offset / s.period_ms), 0.0);
+        break;
+    }
+
+    auto qps = static_cast<uint64_t>(std::llround(_rate));
+    if (qps != _qps) {
+        _qps = qps;
+        _set_rate(_qps);
+    }
+}
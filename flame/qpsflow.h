@@ -0,0 +1,86 @@
+// Copyright 2019 NSONE, Inc
+
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <uvw.hpp>
+
+class FlowMetrics;
+
+/**
+ * A schedule of rates over time, given as --qps-flow groups separated by ';':
+ *
+ *   QPS,MS                            hold QPS for MS
+ *   ramp:FROM:TO,MS                   change linearly from FROM to TO QPS over MS
+ *   sine:MEAN:AMPLITUDE:PERIOD_MS,MS  MEAN +/- AMPLITUDE QPS, one cycle every PERIOD_MS, for MS
+ *   file:PATH                         replay a CSV time series, one line per second: either QPS,
+ *                                     or SECONDS,QPS with SECONDS the time since the start
+ *   loop                              (last) start over from the first group
+ *
+ * Without loop, the rate of the final group holds until the run ends. The rate is recomputed every
+ * TICK, so ramps, curves and replayed series are followed between their points rather than in
+ * steps.
+ */
+class QPSFlow
+{
+public:
+    using rate_cb = std::function<void(uint64_t qps)>;
+
+    static constexpr std::chrono::milliseconds TICK{10};
+
+    // throws std::invalid_argument on a bad spec
+    explicit QPSFlow(const std::string &spec);
+
+    /**
+     * Follow the schedule from now on.
+     *
+     * @param set_rate called whenever the rate changes
+     */
+    void start(std::shared_ptr<uvw::Loop> loop, std::shared_ptr<FlowMetrics> metrics, rate_cb set_rate, int verbosity);
+
+    void stop();
+
+private:
+    enum class Shape {
+        HOLD,
+        RAMP,
+        SINE,
+    };
+
+    struct Segment {
+        Shape shape;
+        // HOLD: from; RAMP: from and to; SINE: mean, amplitude and period
+        double from;
+        double to;
+        double period_ms;
+        double ms;
+        // spec group the segment comes from, and its description
+        size_t group;
+    };
+
+    std::vector<Segment> _segments;
+    std::vector<std::string> _groups;
+    bool _loop{false};
+
+    std::shared_ptr<uvw::TimerHandle> _timer;
+    std::shared_ptr<FlowMetrics> _metrics;
+    rate_cb _set_rate;
+    int _verbosity{0};
+
+    std::chrono::steady_clock::time_point _start;
+    std::chrono::steady_clock::time_point _last_tick;
+    // current segment, and the flow time it started at
+    size_t _segment{0};
+    double _segment_start_ms{0};
+    double _rate{0};
+    uint64_t _qps{0};
+
+    void add_file(const std::string &path, size_t group);
+    void tick();
+    void announce() const;
+};
@@ -180,6 +180,51 @@ QueryGenerator::QueryTpt QueryGenerator::next_udp(uint16_t id)
     return std::make_tuple(std::move(buf), len);
 }
 
+std::pair<size_t, QueryGenerator::WireTpt> QueryGenerator::next_wire()
+{
+
+    size_t index = _reqs++ % _wire_buffers.size();
+    return std::make_pair(index, _wire_buffers[index]);
+}
+
+const std::string &QueryGenerator::wire_b64url(size_t index)
+{
+
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+    if (_b64url_buffers.size() != _wire_buffers.size()) {
+        _b64url_buffers.resize(_wire_buffers.size());
+    }
+    std::string &enc = _b64url_buffers[index];
+    if (!enc.empty()) {
+        return enc;
+    }
+
+    // RFC 4648 section 5, without padding as required by RFC 8484
+    const uint8_t *in = _wire_buffers[index].first;
+    size_t len = _wire_buffers[index].second;
+    enc.reserve((len * 4 + 2) / 3);
+    size_t i = 0;
+    for (; i + 2 < len; i += 3) {
+        uint32_t n = (in[i] << 16) | (in[i + 1] << 8) | in[i + 2];
+        enc.push_back(alphabet[(n >> 18) & 0x3f]);
+        enc.push_back(alphabet[(n >> 12) & 0x3f]);
+        enc.push_back(alphabet[(n >> 6) & 0x3f]);
+        enc.push_back(alphabet[n & 0x3f]);
+    }
+    if (i + 1 == len) {
+        uint32_t n = in[i] << 16;
+        enc.push_back(alphabet[(n >> 18) & 0x3f]);
+        enc.push_back(alphabet[(n >> 12) & 0x3f]);
+    } else if (i + 2 == len) {
+        uint32_t n = (in[i] << 16) | (in[i + 1] << 8);
+        enc.push_back(alphabet[(n >> 18) & 0x3f]);
+        enc.push_back(alphabet[(n >> 12) & 0x3f]);
+        enc.push_back(alphabet[(n >> 6) & 0x3f]);
+    }
+    return enc;
+}
+
 QueryGenerator::~QueryGenerator()
 {
     for (auto i : _wire_buffers) {
@@ -258,7 +303,8 @@ void QueryGenerator::new_rec(uint8_t **dest, size_t *dest_len, const char *qname
         std::cerr << ".\"\n";
     }
 
-    if (id) {
+    // udp/tcp overwrite the id of stored queries on send, DoH sends it as is
+    if (id || _zero_id) {
         ldns_pkt_set_id(query, id);
     }
 
@@ -565,6 +611,12 @@ QueryGenerator::QueryTpt NumberNameQueryGenerator::next_tcp(const std::vector<ui
     throw std::runtime_error("tcp unsupported");
 }
 
+std::pair<size_t, QueryGenerator::WireTpt> NumberNameQueryGenerator::next_wire()
+{
+
+    throw std::runtime_error("doh unsupported");
+}
+
 QueryGenerator::QueryTpt NumberNameQueryGenerator::next_udp(uint16_t id)
 {
 
@@ -574,6 +626,7 @@ QueryGenerator::QueryTpt NumberNameQueryGenerator::next_udp(uint16_t id)
     long n{0};
 
     n = _namedist(_generator);
+    _last = n;
     qname << n << '.' << _qname;
 
     new_rec(&buf, &buf_len, qname.str().c_str(), qname.str().length(), _qtype, false, id);
@@ -24,7 +24,17 @@ class Query
 public:
     // XXX ip we send query to, so we can track mismatched ips
     // XXX qname we sent to ^
-    std::chrono::high_resolution_clock::time_point send_time;
+    // stamp of the generator's QueryClock
+    uint32_t send_time{0};
+    // for the trace log, only filled in when tracing: the query's index(), and its size and
+    // source port (UDP)
+    uint32_t index{0};
+    uint16_t size{0};
+    uint16_t port{0};
+    // kernel send timestamps, with --timestamps: software, as a QueryClock stamp, and hardware
+    // where the NIC took one, as ticks of its clock. 0 if not taken, stamps that are 0 are made 1.
+    uint32_t tx_time{0};
+    uint32_t tx_hw{0};
 };
 
 class QueryGenerator
@@ -38,12 +48,16 @@ protected:
     std::string _qname;
     std::string _qtype;
     bool _dnssec{false};
+    // give stored queries DNS ID 0, as DoH sends them (RFC 8484 4.1), instead of the one ldns picks
+    bool _zero_id{false};
     std::vector<std::string> _positional_args;
     std::map<std::string, std::string> _kv_args;
     GeneratorArgFmt _args_fmt;
 
     std::shared_ptr<Config> _config;
     std::vector<WireTpt> _wire_buffers;
+    // base64url encoded _wire_buffers for DoH GET, filled in lazily
+    std::vector<std::string> _b64url_buffers;
     unsigned long _reqs{0};
     ldns_rr_type cvt_qtype(const std::string &t);
 
@@ -65,8 +79,18 @@ public:
 
     virtual QueryTpt next_udp(uint16_t);
     virtual QueryTpt next_tcp(const std::vector<uint16_t> &);
+    // next query as stored, without copying, along with its index for wire_b64url()
+    virtual std::pair<size_t, WireTpt> next_wire();
+    const std::string &wire_b64url(size_t index);
     bool finished();
 
+    // which query the last next_* call returned: its index in the list, or for generated names
+    // the number the name was made from
+    virtual size_t index() const
+    {
+        return _wire_buffers.empty() ? 0 : (_reqs - 1) % _wire_buffers.size();
+    }
+
     virtual const char *name() = 0;
 
     void set_args(const std::vector<std::string> &args);
@@ -96,6 +120,12 @@ public:
         _dnssec = d;
     }
 
+    // store queries with DNS ID 0, for DoH. call before init().
+    void set_zero_id(bool z)
+    {
+        _zero_id = z;
+    }
+
     long loops() const
     {
         return _loops;
@@ -211,6 +241,7 @@ class NumberNameQueryGenerator : public QueryGenerator
 
     std::mt19937_64 _generator;
     std::uniform_int_distribution<> _namedist;
+    long _last{0};
 
 public:
     NumberNameQueryGenerator(std::shared_ptr<Config> c)
@@ -222,6 +253,12 @@ public:
 
     QueryTpt next_udp(uint16_t);
     QueryTpt next_tcp(const std::vector<uint16_t> &);
+    std::pair<size_t, WireTpt> next_wire();
+
+    size_t index() const
+    {
+        return _last;
+    }
 
     const char *name()
     {
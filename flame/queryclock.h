@@ -0,0 +1,74 @@
+// Copyright 2019 NSONE, Inc
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+/**
+ * Times of in flight queries as 32 bit stamps: counts of 16 ns ticks from the clock's base, taken
+ * modulo 2^32. Differences are taken modulo 2^32 too, so the base never has to move and a stamp
+ * stays usable for MAX_AGE, about 68 s (the latency histogram's range too), which bounds the
+ * response timeout. Stamping a time is a subtraction and a shift, no clock read: callers read the
+ * clock once for a batch of queries sent together, or once per response.
+ */
+class QueryClock
+{
+public:
+    using clock = std::chrono::high_resolution_clock;
+
+    static const int TICK_BITS = 4;
+    // longest difference between two stamps that can be told apart
+    static constexpr std::chrono::seconds MAX_AGE{68};
+
+    explicit QueryClock(clock::time_point base = clock::now())
+        : _base(base)
+    {
+    }
+
+    uint32_t stamp(clock::time_point t) const
+    {
+        return ticks(t - _base);
+    }
+
+    // a stamp of a duration on some other clock, such as a NIC's
+    static uint32_t ticks(clock::duration d)
+    {
+        return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count() >> TICK_BITS);
+    }
+
+    // time from stamp from to stamp to, which is no earlier
+    static std::chrono::nanoseconds between(uint32_t from, uint32_t to)
+    {
+        return std::chrono::nanoseconds(static_cast<uint64_t>(static_cast<uint32_t>(to - from)) << TICK_BITS);
+    }
+
+    // time from stamp from to stamp to, 0 if to is earlier: for stamps from different clocks, such as
+    // kernel timestamps converted from the system clock, which can be a little off either way.
+    // good for half of MAX_AGE.
+    static std::chrono::nanoseconds after(uint32_t from, uint32_t to)
+    {
+        int32_t d = static_cast<int32_t>(to - from);
+        return std::chrono::nanoseconds(d > 0 ? static_cast<int64_t>(d) << TICK_BITS : 0);
+    }
+
+    static bool before(uint32_t a, uint32_t b)
+    {
+        return static_cast<int32_t>(a - b) < 0;
+    }
+
+    // time from stamp s to now
+    std::chrono::nanoseconds since(uint32_t s, clock::time_point now) const
+    {
+        return between(s, stamp(now));
+    }
+
+    // the time stamp s stands for, taken before now
+    clock::time_point time(uint32_t s, clock::time_point now) const
+    {
+        return now - std::chrono::duration_cast<clock::duration>(since(s, now));
+    }
+
+private:
+    clock::time_point _base;
+};
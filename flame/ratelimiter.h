@@ -0,0 +1,188 @@
+// Copyright 2019 NSONE, Inc
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+
+/**
+ * Token bucket rate limiter whose rate can change on the fly. Changing the rate keeps the credit
+ * built up so far (capped to the new burst), where assigning a new TokenBucket starts over with
+ * a full bucket, so a QPS flow can adjust the rate many times a second without bursts.
+ *
+ * The generators sharing a limiter all run on the loop thread, so it needs no atomics. They take
+ * tokens through a RateShard each, in batches, and the clock is only read once the tokens at hand
+ * run out.
+ */
+class RateLimiter
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    // credit builds up for at most this long while senders are idle
+    static constexpr std::chrono::milliseconds BURST{100};
+
+    // the burst for senders that take tokens every send_delay: at least one delay's worth, or a
+    // sender ticking less often than BURST could never take its share
+    static clock::duration burst_for(std::chrono::milliseconds send_delay)
+    {
+        return std::max<clock::duration>(BURST, send_delay);
+    }
+
+    explicit RateLimiter(double qps = 0, clock::duration burst = BURST)
+        : _qps(qps)
+        , _burst(burst)
+        , _last(clock::now())
+    {
+    }
+
+    // change the rate, queries per second. 0 stops all sends.
+    void rate(double qps)
+    {
+        refill();
+        _qps = qps;
+        _tokens = std::min(_tokens, burst());
+        _generation++;
+    }
+
+    double rate() const
+    {
+        return _qps;
+    }
+
+    // bumped on every rate change, and whenever a shard comes or goes, for shards to hand back
+    // tokens taken at the old rate and resize their batches
+    uint64_t generation() const
+    {
+        return _generation;
+    }
+
+    // number of RateShards taking from this limiter, which share BATCH of the rate between them
+    size_t shards() const
+    {
+        return _shards;
+    }
+
+    void attach()
+    {
+        _shards++;
+        _generation++;
+    }
+
+    void detach()
+    {
+        _shards--;
+        _generation++;
+    }
+
+    // take up to max tokens, as many as are available
+    uint64_t take(uint64_t max)
+    {
+        if (_tokens < max) {
+            refill();
+        }
+        auto tokens = std::min(static_cast<uint64_t>(_tokens), max);
+        _tokens -= tokens;
+        return tokens;
+    }
+
+    // return tokens that were taken but not used
+    void give_back(uint64_t tokens)
+    {
+        _tokens = std::min(_tokens + tokens, burst());
+    }
+
+private:
+    double _qps;
+    clock::duration _burst;
+    double _tokens{0};
+    clock::time_point _last;
+    uint64_t _generation{0};
+    size_t _shards{0};
+
+    double burst() const
+    {
+        // at least one query, however low the rate
+        return _qps ? std::max(_qps * std::chrono::duration<double>(_burst).count(), 1.0) : 0.0;
+    }
+
+    void refill()
+    {
+        auto now = clock::now();
+        _tokens = std::min(_tokens + std::chrono::duration<double>(now - _last).count() * _qps, burst());
+        _last = now;
+    }
+};
+
+/**
+ * One sender's share of a RateLimiter. Tokens are taken from the limiter a batch at a time and
+ * then handed out locally, a batch being BATCH worth of the rate split between all the shards, so
+ * each sender asks the limiter about as often as it sends a batch rather than once per query.
+ *
+ * A shard never holds more than one batch beyond what its sender asked for: surplus given back is
+ * returned to the limiter for the other shards, as is everything it holds when the rate or the
+ * number of shards changes. All shards together hold at most BATCH of the rate, however many
+ * there are, so it is at most 1 ms of sends late, which keeps the total within a fraction of a
+ * percent of the rate over any metrics period.
+ */
+class RateShard
+{
+public:
+    static constexpr std::chrono::microseconds BATCH{1000};
+
+    explicit RateShard(std::shared_ptr<RateLimiter> limiter)
+        : _limiter(std::move(limiter))
+    {
+        _limiter->attach();
+        rebalance();
+    }
+
+    ~RateShard()
+    {
+        _limiter->give_back(_tokens);
+        _limiter->detach();
+    }
+
+    RateShard(const RateShard &) = delete;
+    RateShard &operator=(const RateShard &) = delete;
+
+    // take up to max tokens for a send, as many as are available
+    uint64_t take(uint64_t max)
+    {
+        if (_generation != _limiter->generation()) {
+            rebalance();
+        }
+        if (_tokens < max) {
+            _tokens += _limiter->take(max - _tokens + _batch);
+        }
+        auto tokens = std::min(_tokens, max);
+        _tokens -= tokens;
+        return tokens;
+    }
+
+    // return tokens that were taken but not sent
+    void give_back(uint64_t tokens)
+    {
+        _tokens += tokens;
+        if (_tokens > _batch) {
+            _limiter->give_back(_tokens - _batch);
+            _tokens = _batch;
+        }
+    }
+
+private:
+    std::shared_ptr<RateLimiter> _limiter;
+    uint64_t _tokens{0};
+    uint64_t _batch{0};
+    uint64_t _generation{0};
+
+    void rebalance()
+    {
+        _limiter->give_back(_tokens);
+        _tokens = 0;
+        _generation = _limiter->generation();
+        _batch = static_cast<uint64_t>(_limiter->rate() * std::chrono::duration<double>(BATCH).count() / _limiter->shards());
+    }
+};
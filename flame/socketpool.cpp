@@ -0,0 +1,243 @@
+// Copyright 2019 NSONE, Inc
+
+#include <cassert>
+#include <stdexcept>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "metrics.h"
+#include "socketpool.h"
+#include "udpsocket.h"
+#include "utils.h"
+
+#if defined(__linux__) && !defined(IPV6_FREEBIND)
+// linux 4.15+, missing from older libc headers
+#define IPV6_FREEBIND 78
+#endif
+
+// ranges are capped at this many addresses, so sums and products stay within 128 bits
+static const unsigned int MAX_RANGE_BITS = 100;
+
+SourceAddresses::SourceAddresses(int family, const std::string &spec)
+    : _family(family)
+{
+    unsigned int bits = (family == AF_INET) ? 32 : 128;
+    for (const auto &item : split(spec, ',')) {
+        if (item.empty()) {
+            continue;
+        }
+        std::string addr = item;
+        unsigned int prefix = bits;
+        auto slash = item.find('/');
+        if (slash != std::string::npos) {
+            addr = item.substr(0, slash);
+            try {
+                prefix = std::stoul(item.substr(slash + 1));
+            } catch (const std::exception &) {
+                prefix = bits + 1;
+            }
+            if (prefix > bits) {
+                throw std::runtime_error("invalid source prefix length: " + item);
+            }
+        }
+
+        unsigned char buf[16];
+        if (inet_pton(family, addr.c_str(), buf) != 1) {
+            throw std::runtime_error("invalid source address for this inet family: " + item);
+        }
+        uint128 value{0};
+        for (unsigned int i = 0; i < bits / 8; i++) {
+            value = (value << 8) | buf[i];
+        }
+
+        unsigned int host_bits = bits - prefix;
+        Range r;
+        if (host_bits == 0) {
+            r = {value, 1};
+        } else {
+            uint128 host_mask = (host_bits == 128) ? ~uint128(0) : ((uint128(1) << host_bits) - 1);
+            uint128 network = value & ~host_mask;
+            uint128 size = (host_bits > MAX_RANGE_BITS) ? (uint128(1) << MAX_RANGE_BITS) : host_mask + 1;
+            if (family == AF_INET && host_bits >= 2) {
+                // skip the network and broadcast addresses
+                r = {network + 1, size - 2};
+            } else if (family == AF_INET6) {
+                // skip the subnet router anycast address
+                r = {network + 1, size - 1};
+            } else {
+                r = {network, size};
+            }
+        }
+        _ranges.push_back(r);
+        _size += r.size;
+    }
+    if (_ranges.empty()) {
+        throw std::runtime_error("no source addresses given");
+    }
+}
+
+uint64_t SourceAddresses::size() const
+{
+    return (_size > std::numeric_limits<uint64_t>::max()) ? std::numeric_limits<uint64_t>::max() : static_cast<uint64_t>(_size);
+}
+
+sockaddr_storage SourceAddresses::address(size_t i, size_t count) const
+{
+    // spread count sockets evenly over every address, or cycle if there are fewer addresses
+    uint128 index = (_size >= count) ? (uint128(i) * _size / count) : (i % _size);
+    uint128 value{0};
+    for (const auto &r : _ranges) {
+        if (index < r.size) {
+            value = r.first + index;
+            break;
+        }
+        index -= r.size;
+    }
+
+    sockaddr_storage sa{};
+    if (_family == AF_INET) {
+        auto sin = reinterpret_cast<sockaddr_in *>(&sa);
+        sin->sin_family = AF_INET;
+        sin->sin_addr.s_addr = htonl(static_cast<uint32_t>(value));
+    } else {
+        auto sin6 = reinterpret_cast<sockaddr_in6 *>(&sa);
+        sin6->sin6_family = AF_INET6;
+        for (int b = 15; b >= 0; b--) {
+            sin6->sin6_addr.s6_addr[b] = static_cast<uint8_t>(value);
+            value >>= 8;
+        }
+    }
+    return sa;
+}
+
+UDPSocketPool::UDPSocketPool(std::shared_ptr<uvw::Loop> loop, std::shared_ptr<SocketMetrics> metrics,
+    const sockaddr_storage &target, bool connect, std::shared_ptr<SourceAddresses> sources,
+    size_t count, size_t members)
+    : _loop(loop)
+    , _metrics(metrics)
+    , _target(target)
+    , _connected(connect)
+    , _last_sender(count, 0)
+    , _members(members)
+{
+    assert(count > 0 && members > 0);
+
+    int family = _target.ss_family;
+    for (size_t i = 0; i < count; i++) {
+        auto handle = _loop->resource<uvw::UDPHandle>(family);
+
+        handle->on<uvw::ErrorEvent>([this, i](const uvw::ErrorEvent &, uvw::UDPHandle &) {
+            _metrics->net_error(i);
+            auto &m = _members[_last_sender[i]];
+            if (m.on_error) {
+                m.on_error();
+            }
+        });
+
+        if (sources) {
+            auto source = sources->address(i, count);
+#ifdef __linux__
+            // allow addresses not assigned to any interface, e.g. a prefix routed to lo
+            int on = 1;
+            if (family == AF_INET) {
+                setsockopt(handle->fileno(), IPPROTO_IP, IP_FREEBIND, &on, sizeof(on));
+            } else {
+                setsockopt(handle->fileno(), IPPROTO_IPV6, IPV6_FREEBIND, &on, sizeof(on));
+            }
+#endif
+            if (family == AF_INET) {
+                handle->bind(reinterpret_cast<const sockaddr &>(source));
+            } else {
+                handle->bind(reinterpret_cast<const sockaddr &>(source), uvw::UDPHandle::Bind::IPV6ONLY);
+            }
+            if (handle->sock().port == 0) {
+                auto a = (family == AF_INET) ? uvw::details::address<uvw::IPv4>(reinterpret_cast<sockaddr_in *>(&source))
+                                             : uvw::details::address<uvw::IPv6>(reinterpret_cast<sockaddr_in6 *>(&source));
+                throw std::runtime_error("unable to bind source address " + a.ip);
+            }
+        } else if (family == AF_INET) {
+            handle->bind<uvw::IPv4>("0.0.0.0", 0);
+        } else {
+            handle->bind<uvw::IPv6>("::0", 0, uvw::UDPHandle::Bind::IPV6ONLY);
+        }
+#ifdef HAVE_UV_UDP_CONNECT
+        if (_connected && uv_udp_connect(handle->raw(), reinterpret_cast<const sockaddr *>(&_target)) != 0) {
+            throw std::runtime_error("unable to connect UDP socket");
+        }
+#endif
+
+        handle->on<uvw::UDPDataEvent>([this, i](const uvw::UDPDataEvent &event, uvw::UDPHandle &) {
+            received(i, event.data.get(), event.length);
+        });
+
+        auto local = (family == AF_INET) ? handle->sock<uvw::IPv4>() : handle->sock<uvw::IPv6>();
+        _ports.push_back(local.port);
+        _metrics->socket(i, local.ip, local.port);
+        _sockets.push_back(handle);
+        handle->recv();
+    }
+    _active = true;
+}
+
+size_t UDPSocketPool::join(recv_cb on_recv, std::function<void()> on_error)
+{
+    assert(_joined < _members.size());
+    _members[_joined].on_recv = std::move(on_recv);
+    _members[_joined].on_error = std::move(on_error);
+    return _joined++;
+}
+
+void UDPSocketPool::leave()
+{
+    if (++_left < _joined) {
+        return;
+    }
+    _active = false;
+    for (auto &s : _sockets) {
+        s->stop();
+        s->close();
+    }
+}
+
+bool UDPSocketPool::send(size_t member, size_t socket, std::unique_ptr<char[]> &&data, unsigned int len)
+{
+#ifdef HAVE_UV_UDP_CONNECT
+    if (_connected) {
+        uv_buf_t buf = uv_buf_init(data.get(), len);
+        int r = uv_udp_try_send(_sockets[socket]->raw(), &buf, 1, nullptr);
+        if (r < 0) {
+            if (r != UV_EAGAIN) {
+                _metrics->net_error(socket);
+                auto &m = _members[member];
+                if (m.on_error) {
+                    m.on_error();
+                }
+            }
+            return false;
+        }
+        sent(member, socket);
+        return true;
+    }
+#endif
+    _sockets[socket]->send(reinterpret_cast<const sockaddr &>(_target), std::move(data), len);
+    sent(member, socket);
+    return true;
+}
+
+void UDPSocketPool::sent(size_t member, size_t socket)
+{
+    _last_sender[socket] = member;
+    _metrics->send(socket);
+}
+
+void UDPSocketPool::received(size_t socket, const char data[], size_t len)
+{
+    _metrics->receive(socket);
+    // too short to carry an id: let the first member count it as a bad receive
+    size_t member = (len < 2) ? 0 : ((static_cast<uint8_t>(data[0]) << 8) | static_cast<uint8_t>(data[1])) % _members.size();
+    auto &m = _members[member];
+    if (m.on_recv) {
+        m.on_recv(data, len);
+    }
+}
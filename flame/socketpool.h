@@ -0,0 +1,138 @@
+// Copyright 2019 NSONE, Inc
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+
+#include <uvw.hpp>
+
+class SocketMetrics;
+
+/**
+ * Source addresses for the sockets of a UDPSocketPool, from a list of addresses and CIDR prefixes.
+ * Prefixes are never expanded, address() picks addresses spread evenly over all of them, so a large
+ * IPv6 prefix costs nothing and a /48 split over 65536 sockets gives one address per /64.
+ */
+class SourceAddresses
+{
+public:
+    /**
+     * @param spec comma separated addresses and prefixes, e.g. 127.1.0.0/16,127.2.0.1
+     */
+    SourceAddresses(int family, const std::string &spec);
+
+    // number of usable addresses, saturating at the max of uint64_t
+    uint64_t size() const;
+
+    // address (port 0) for socket i of count
+    sockaddr_storage address(size_t i, size_t count) const;
+
+private:
+    using uint128 = unsigned __int128;
+
+    struct Range {
+        uint128 first;
+        uint128 size;
+    };
+
+    int _family;
+    std::vector<Range> _ranges;
+    uint128 _size{0};
+};
+
+/**
+ * A fixed set of UDP sockets (source ports) shared by all traffic generators, so the number
+ * of ports is independent of the number of generators. Each generator sends its queries round
+ * robin over every socket, which spreads them evenly over the ports and so over the server's
+ * receive queues.
+ *
+ * Responses are handed back to generators by query id: the 16 bit id space is split between the
+ * members, member n using only the ids where id % members == n.
+ */
+class UDPSocketPool
+{
+public:
+    using recv_cb = std::function<void(const char data[], size_t len)>;
+
+    /**
+     * @param target address and port all queries are sent to
+     * @param connect connect the sockets to target (see TrafGenConfig::udp_connect)
+     * @param sources bind the sockets to these addresses (with FREEBIND, so they need not be
+     *        local) instead of the wildcard address. may be null.
+     * @param count number of sockets, each bound to its own ephemeral port
+     * @param members number of generators that will join the pool
+     */
+    UDPSocketPool(std::shared_ptr<uvw::Loop> loop, std::shared_ptr<SocketMetrics> metrics,
+        const sockaddr_storage &target, bool connect, std::shared_ptr<SourceAddresses> sources,
+        size_t count, size_t members);
+
+    size_t size() const
+    {
+        return _sockets.size();
+    }
+
+    size_t members() const
+    {
+        return _members.size();
+    }
+
+    unsigned int port(size_t socket) const
+    {
+        return _ports[socket];
+    }
+
+    bool active() const
+    {
+        return _active;
+    }
+
+    // whether id belongs to member
+    bool owns(size_t member, uint16_t id) const
+    {
+        return id % _members.size() == member;
+    }
+
+    /**
+     * Register a generator, returning its member index. Responses with its ids are passed to
+     * on_recv. Socket errors go to on_error of the member that last sent on the socket.
+     */
+    size_t join(recv_cb on_recv, std::function<void()> on_error);
+
+    // a member is done; the sockets close when every member has left
+    void leave();
+
+    // send a query to the target from the given socket. connected sockets send right away, and
+    // return false if nothing was sent because the socket buffer is full or on error, leaving
+    // data with the caller.
+    bool send(size_t member, size_t socket, std::unique_ptr<char[]> &&data, unsigned int len);
+
+    // note a query sent from socket outside of send(), e.g. as a raw frame with its source port
+    void sent(size_t member, size_t socket);
+
+private:
+    std::shared_ptr<uvw::Loop> _loop;
+    std::shared_ptr<SocketMetrics> _metrics;
+    sockaddr_storage _target;
+    bool _connected;
+
+    std::vector<std::shared_ptr<uvw::UDPHandle>> _sockets;
+    std::vector<unsigned int> _ports;
+    // member that last sent on each socket, blamed for its errors
+    std::vector<size_t> _last_sender;
+
+    struct Member {
+        recv_cb on_recv;
+        std::function<void()> on_error;
+    };
+    std::vector<Member> _members;
+    size_t _joined{0};
+    size_t _left{0};
+    bool _active{false};
+
+    void received(size_t socket, const char data[], size_t len);
+};
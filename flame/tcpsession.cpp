@@ -0,0 +1,46 @@
+// Copyright 2019 NSONE, Inc
+
+#include <cstring>
+
+#include <netinet/in.h>
+
+#include "tcpsession.h"
+
+static const size_t MIN_DNS_QUERY_SIZE = 17;
+static const size_t MAX_DNS_QUERY_SIZE = 512;
+
+bool TCPSession::try_yield_message()
+{
+    uint16_t size = 0;
+
+    if (buffer.size() < sizeof(size)) {
+        return false;
+    }
+
+    memcpy(&size, buffer.data(), sizeof(size));
+    size = ntohs(size);
+
+    if (size < MIN_DNS_QUERY_SIZE || size > MAX_DNS_QUERY_SIZE) {
+        error();
+        return false;
+    }
+
+    if (buffer.size() >= sizeof(size) + size) {
+        auto data = std::make_unique<char[]>(size);
+        memcpy(data.get(), buffer.data() + sizeof(size), size);
+        buffer.erase(0, sizeof(size) + size);
+
+        query(std::move(data), size);
+        return true;
+    }
+
+    return false;
+}
+
+void TCPSession::received(const char data[], size_t len)
+{
+    buffer.append(data, len);
+
+    while (try_yield_message()) {
+    }
+}
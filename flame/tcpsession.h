@@ -0,0 +1,37 @@
+// Copyright 2019 NSONE, Inc
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+
+/**
+ * DNS over TCP message framing (RFC 1035 4.2.2): buffers a byte stream and yields
+ * complete, length prefixed DNS messages.
+ */
+class TCPSession
+{
+public:
+    using error_cb = std::function<void()>;
+    using query_cb = std::function<void(std::unique_ptr<char[]> data, size_t size)>;
+
+    bool try_yield_message();
+
+    void received(const char data[], size_t len);
+
+    void on_error(error_cb handler)
+    {
+        error = std::move(handler);
+    }
+
+    void on_query(query_cb handler)
+    {
+        query = std::move(handler);
+    }
+
+private:
+    std::string buffer;
+    error_cb error;
+    query_cb query;
+};
@@ -0,0 +1,185 @@
+// Copyright 2019 NSONE, Inc
+
+#include <ctime>
+#include <stdexcept>
+
+#include <arpa/inet.h>
+
+#include "tcptlssession.h"
+
+static std::chrono::nanoseconds thread_cpu_now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return std::chrono::seconds{ts.tv_sec} + std::chrono::nanoseconds{ts.tv_nsec};
+}
+
+static bool is_ip_literal(const std::string &s)
+{
+    unsigned char buf[sizeof(struct in6_addr)];
+    return inet_pton(AF_INET, s.c_str(), buf) == 1 || inet_pton(AF_INET6, s.c_str(), buf) == 1;
+}
+
+// called whenever the server hands us a session (with TLS 1.3 this is after the handshake)
+static int new_session_cb(SSL *ssl, SSL_SESSION *sess)
+{
+    auto session = static_cast<TCPTLSSession *>(SSL_get_app_data(ssl));
+    session->new_session(sess);
+    // we took ownership of the reference
+    return 1;
+}
+
+std::shared_ptr<SSL_CTX> TCPTLSSession::new_client_ctx(bool allow_resume, const std::string &alpn)
+{
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    if (!ctx) {
+        throw std::runtime_error("unable to create TLS context");
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    // we are a load generator, not a resolver: don't verify the server certificate
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, nullptr);
+    if (!alpn.empty()) {
+        // wire format: length prefixed protocol names
+        std::string protos(1, static_cast<char>(alpn.size()));
+        protos.append(alpn);
+        SSL_CTX_set_alpn_protos(ctx, reinterpret_cast<const unsigned char *>(protos.data()), protos.size());
+    }
+    if (allow_resume) {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(ctx, new_session_cb);
+    } else {
+        SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    }
+    return std::shared_ptr<SSL_CTX>(ctx, SSL_CTX_free);
+}
+
+TCPTLSSession::TCPTLSSession(SSL_CTX *ctx, const std::string &sni, SSL_SESSION *resume)
+{
+    _ssl = SSL_new(ctx);
+    if (!_ssl) {
+        throw std::runtime_error("unable to create TLS session");
+    }
+    _rbio = BIO_new(BIO_s_mem());
+    _wbio = BIO_new(BIO_s_mem());
+    SSL_set_bio(_ssl, _rbio, _wbio);
+    SSL_set_connect_state(_ssl);
+    SSL_set_app_data(_ssl, this);
+    if (!sni.empty() && !is_ip_literal(sni)) {
+        SSL_set_tlsext_host_name(_ssl, sni.c_str());
+    }
+    if (resume) {
+        SSL_set_session(_ssl, resume);
+    }
+}
+
+TCPTLSSession::~TCPTLSSession()
+{
+    // also frees the BIOs
+    SSL_free(_ssl);
+}
+
+void TCPTLSSession::start()
+{
+    // the first do_handshake() writes the ClientHello
+    _handshake_start = std::chrono::high_resolution_clock::now();
+    do_handshake();
+}
+
+bool TCPTLSSession::handshake_done() const
+{
+    return SSL_is_init_finished(_ssl);
+}
+
+bool TCPTLSSession::resumed() const
+{
+    return SSL_session_reused(_ssl);
+}
+
+void TCPTLSSession::new_session(SSL_SESSION *sess)
+{
+    _session = std::shared_ptr<SSL_SESSION>(sess, SSL_SESSION_free);
+}
+
+void TCPTLSSession::do_handshake()
+{
+    auto cpu_start = thread_cpu_now();
+    int r = SSL_do_handshake(_ssl);
+    _handshake_cpu += thread_cpu_now() - cpu_start;
+
+    // send whatever the handshake produced, even on failure (it may be an alert)
+    flush();
+
+    if (r == 1) {
+        _handshake_time = std::chrono::high_resolution_clock::now() - _handshake_start;
+        handshake_complete();
+        return;
+    }
+    int err = SSL_get_error(_ssl, r);
+    if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+        _error();
+    }
+}
+
+void TCPTLSSession::handshake_complete()
+{
+    _handshake();
+}
+
+void TCPTLSSession::received_plaintext(const char data[], size_t len)
+{
+    _dns.received(data, len);
+}
+
+void TCPTLSSession::received(const char data[], size_t len)
+{
+    BIO_write(_rbio, data, len);
+
+    if (!handshake_done()) {
+        do_handshake();
+        if (!handshake_done()) {
+            return;
+        }
+    }
+
+    char buf[16384];
+    int r;
+    while ((r = SSL_read(_ssl, buf, sizeof(buf))) > 0) {
+        received_plaintext(buf, r);
+    }
+    int err = SSL_get_error(_ssl, r);
+    // reading may have generated protocol data (e.g. a key update response)
+    flush();
+    if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_ZERO_RETURN) {
+        _error();
+    }
+}
+
+void TCPTLSSession::write(const char data[], size_t len)
+{
+    if (SSL_write(_ssl, data, len) <= 0) {
+        _error();
+        return;
+    }
+    flush();
+}
+
+void TCPTLSSession::close()
+{
+    // without a close_notify, OpenSSL treats the session as bad and it won't resume
+    if (handshake_done()) {
+        SSL_shutdown(_ssl);
+        flush();
+    }
+}
+
+void TCPTLSSession::flush()
+{
+    size_t pending = BIO_ctrl_pending(_wbio);
+    if (!pending) {
+        return;
+    }
+    auto buf = std::make_unique<char[]>(pending);
+    BIO_read(_wbio, buf.get(), pending);
+    _write(std::move(buf), pending);
+}
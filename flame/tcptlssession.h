@@ -0,0 +1,128 @@
+// Copyright 2019 NSONE, Inc
+
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include <openssl/ssl.h>
+
+#include "tcpsession.h"
+
+/**
+ * DNS over TLS (RFC 7858) client session. This does no socket i/o itself: ciphertext
+ * from the socket is passed to received(), and ciphertext to be sent on the socket
+ * is handed to the write callback. Decrypted DNS messages are framed by TCPSession.
+ */
+class TCPTLSSession
+{
+public:
+    using error_cb = std::function<void()>;
+    using handshake_cb = std::function<void()>;
+    using query_cb = TCPSession::query_cb;
+    using write_cb = std::function<void(std::unique_ptr<char[]> data, size_t size)>;
+
+    /**
+     * @param ctx client context, see new_client_ctx()
+     * @param sni server name to send, empty for none
+     * @param resume session from a previous connection to resume, may be null
+     */
+    TCPTLSSession(SSL_CTX *ctx, const std::string &sni, SSL_SESSION *resume);
+    virtual ~TCPTLSSession();
+
+    /**
+     * @param allow_resume enable session tickets and client side session caching
+     * @param alpn ALPN protocol to offer (e.g. "h2"), empty for none
+     */
+    static std::shared_ptr<SSL_CTX> new_client_ctx(bool allow_resume, const std::string &alpn = "");
+
+    // start the client handshake, fires handshake callback when complete
+    void start();
+
+    // ciphertext received from the peer
+    void received(const char data[], size_t len);
+
+    // plaintext to encrypt and send, only valid once the handshake has completed
+    void write(const char data[], size_t len);
+
+    // send close_notify, call before shutting down the connection
+    void close();
+
+    bool handshake_done() const;
+
+    // whether the completed handshake resumed a previous session
+    bool resumed() const;
+
+    // thread cpu time spent inside the handshake
+    std::chrono::nanoseconds handshake_cpu() const
+    {
+        return _handshake_cpu;
+    }
+
+    // time from writing the ClientHello to the handshake completing, without the TCP connect
+    std::chrono::nanoseconds handshake_time() const
+    {
+        return _handshake_time;
+    }
+
+    // most recent resumable session received from the server, for use on the next connection. may be null.
+    std::shared_ptr<SSL_SESSION> session() const
+    {
+        return _session;
+    }
+
+    // new session callback, only used when the context allows resumption
+    void new_session(SSL_SESSION *sess);
+
+    void on_error(error_cb handler)
+    {
+        // malformed DNS framing inside the TLS stream is an error too
+        _dns.on_error(handler);
+        _error = std::move(handler);
+    }
+
+    void on_handshake(handshake_cb handler)
+    {
+        _handshake = std::move(handler);
+    }
+
+    void on_query(query_cb handler)
+    {
+        _query = handler;
+        _dns.on_query(std::move(handler));
+    }
+
+    void on_write(write_cb handler)
+    {
+        _write = std::move(handler);
+    }
+
+protected:
+    // decrypted application data, framed as DNS over TCP by default
+    virtual void received_plaintext(const char data[], size_t len);
+
+    // the handshake completed, fires the handshake callback by default
+    virtual void handshake_complete();
+
+    SSL *_ssl;
+    // memory BIOs, owned by _ssl
+    BIO *_rbio;
+    BIO *_wbio;
+
+    TCPSession _dns;
+    std::shared_ptr<SSL_SESSION> _session;
+    std::chrono::nanoseconds _handshake_cpu{0};
+    std::chrono::high_resolution_clock::time_point _handshake_start;
+    std::chrono::nanoseconds _handshake_time{0};
+
+    error_cb _error;
+    handshake_cb _handshake;
+    query_cb _query;
+    write_cb _write;
+
+private:
+    void do_handshake();
+    void flush();
+};
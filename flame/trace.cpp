@@ -0,0 +1,93 @@
+// Copyright 2019 NSONE, Inc
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+constexpr std::chrono::milliseconds Tracer::DRAIN_INTERVAL;
+
+Tracer::Tracer(const std::string &path, uint64_t every)
+    : _path(path)
+    , _every(std::max<uint64_t>(every, 1))
+    , _ring(CAPACITY)
+{
+    _fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (_fd < 0) {
+        throw std::runtime_error("unable to open trace file " + path + ": " + std::strerror(errno));
+    }
+    char header[16] = {'F', 'L', 'A', 'M', 'E', 'T', 'R', 'C'};
+    uint32_t version = VERSION;
+    uint32_t record_size = sizeof(Record);
+    std::memcpy(header + 8, &version, sizeof version);
+    std::memcpy(header + 12, &record_size, sizeof record_size);
+    write(header, sizeof header);
+    _thread = std::thread(&Tracer::run, this);
+}
+
+Tracer::~Tracer()
+{
+    close();
+}
+
+void Tracer::close()
+{
+    if (!_thread.joinable()) {
+        return;
+    }
+    _closing.store(true, std::memory_order_release);
+    _thread.join();
+    ::close(_fd);
+    _fd = -1;
+}
+
+void Tracer::run()
+{
+    while (true) {
+        uint64_t tail = _tail.load(std::memory_order_relaxed);
+        uint64_t head = _head.load(std::memory_order_acquire);
+        if (head == tail) {
+            if (_closing.load(std::memory_order_acquire)) {
+                // the producer is done once closing is set, one last look for what it added before
+                if (_head.load(std::memory_order_acquire) == tail) {
+                    return;
+                }
+                continue;
+            }
+            std::this_thread::sleep_for(DRAIN_INTERVAL);
+            continue;
+        }
+        // straight from the ring, up to where it wraps
+        size_t start = tail & (_ring.size() - 1);
+        size_t count = std::min<uint64_t>(head - tail, _ring.size() - start);
+        write(&_ring[start], count * sizeof(Record));
+        if (!_fd_failed) {
+            _written += count;
+        }
+        _tail.store(tail + count, std::memory_order_release);
+    }
+}
+
+void Tracer::write(const void *data, size_t len)
+{
+    auto p = static_cast<const char *>(data);
+    while (len && !_fd_failed) {
+        ssize_t r = ::write(_fd, p, len);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "unable to write trace file: " << std::strerror(errno) << std::endl;
+            _fd_failed = true;
+            return;
+        }
+        p += r;
+        len -= r;
+    }
+}
@@ -0,0 +1,154 @@
+// Copyright 2019 NSONE, Inc
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "query.h"
+
+/**
+ * Per query trace for debugging tail latency: every Nth completed query (answered or timed out)
+ * is appended to a lock-free single producer, single consumer ring, which a writer thread drains
+ * to a binary file. The loop thread only ever appends; if the writer falls behind and the ring is
+ * full, records are dropped and counted rather than waited for.
+ *
+ * The file is a 16 byte header (magic "FLAMETRC", then version and record size as uint32) followed
+ * by Records, all in host byte order.
+ */
+class Tracer
+{
+public:
+    static const uint32_t VERSION = 1;
+    // records the ring holds, a power of two: 8 MB, a couple of seconds at 100k QPS
+    static const size_t CAPACITY = 1 << 18;
+    // how often the writer looks for new records when the ring is empty
+    static constexpr std::chrono::milliseconds DRAIN_INTERVAL{5};
+
+    enum Status : uint8_t {
+        ANSWERED = 0,
+        TIMEOUT = 1,
+    };
+
+    struct Record {
+        // nanoseconds since the epoch; receive_ns is 0 for timeouts
+        uint64_t send_ns;
+        uint64_t receive_ns;
+        // position of the query in the generator's list
+        uint32_t index;
+        uint16_t id;
+        // query size and source port, UDP only
+        uint16_t size;
+        uint16_t port;
+        uint8_t rcode;
+        uint8_t status;
+        uint32_t reserved;
+    };
+    static_assert(sizeof(Record) == 32, "trace records are 32 bytes");
+
+    /**
+     * @param every trace one in every this many queries
+     * @throws std::runtime_error if the file can't be opened
+     */
+    Tracer(const std::string &path, uint64_t every);
+
+    ~Tracer();
+
+    Tracer(const Tracer &) = delete;
+    Tracer &operator=(const Tracer &) = delete;
+
+    void answered(uint16_t id, const Query &q, std::chrono::high_resolution_clock::time_point send_time,
+        std::chrono::high_resolution_clock::time_point receive_time, uint8_t rcode)
+    {
+        if (sample()) {
+            push(id, q, send_time.time_since_epoch(), receive_time.time_since_epoch(), rcode, ANSWERED);
+        }
+    }
+
+    void timed_out(uint16_t id, const Query &q, std::chrono::high_resolution_clock::time_point send_time)
+    {
+        if (sample()) {
+            push(id, q, send_time.time_since_epoch(), std::chrono::nanoseconds(0), 0, TIMEOUT);
+        }
+    }
+
+    // write out what is in the ring and close the file
+    void close();
+
+    const std::string &path() const
+    {
+        return _path;
+    }
+
+    // only once closed
+    uint64_t written() const
+    {
+        return _written;
+    }
+
+    uint64_t dropped() const
+    {
+        return _dropped;
+    }
+
+private:
+    std::string _path;
+    uint64_t _every;
+    int _fd{-1};
+    std::vector<Record> _ring;
+
+    // producer (loop thread)
+    uint64_t _seen{0};
+    uint64_t _dropped{0};
+    // the consumer's position as last read, so a push only reads _tail when the ring looks full
+    uint64_t _tail_cache{0};
+    alignas(64) std::atomic<uint64_t> _head{0};
+
+    // consumer (writer thread)
+    alignas(64) std::atomic<uint64_t> _tail{0};
+    uint64_t _written{0};
+    bool _fd_failed{false};
+
+    std::atomic<bool> _closing{false};
+    std::thread _thread;
+
+    bool sample()
+    {
+        if (++_seen < _every) {
+            return false;
+        }
+        _seen = 0;
+        return true;
+    }
+
+    void push(uint16_t id, const Query &q, std::chrono::high_resolution_clock::duration send_time,
+        std::chrono::high_resolution_clock::duration receive_time, uint8_t rcode, Status status)
+    {
+        uint64_t head = _head.load(std::memory_order_relaxed);
+        if (head - _tail_cache == _ring.size()) {
+            _tail_cache = _tail.load(std::memory_order_acquire);
+            if (head - _tail_cache == _ring.size()) {
+                _dropped++;
+                return;
+            }
+        }
+        auto &r = _ring[head & (_ring.size() - 1)];
+        r.send_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(send_time).count();
+        r.receive_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(receive_time).count();
+        r.index = q.index;
+        r.id = id;
+        r.size = q.size;
+        r.port = q.port;
+        r.rcode = rcode;
+        r.status = status;
+        r.reserved = 0;
+        _head.store(head + 1, std::memory_order_release);
+    }
+
+    void run();
+    void write(const void *data, size_t len);
+};
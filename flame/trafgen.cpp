@@ -6,87 +6,38 @@
 #include <random>
 #include <string>
 
+#include "socketpool.h"
+#include "tcpsession.h"
+#include "trace.h"
 #include "trafgen.h"
+#ifdef HAVE_IO_URING
+#include "uring.h"
+#endif
+#ifdef HAVE_PACKET_RING
+#include "packetsender.h"
+#endif
 
 #include <ldns/rbtree.h>
 
 #include <ldns/host2wire.h>
 #include <ldns/wire2host.h>
 
-static const size_t MIN_DNS_QUERY_SIZE = 17;
-static const size_t MAX_DNS_QUERY_SIZE = 512;
-
-class TCPSession
-{
-public:
-    using error_cb = std::function<void()>;
-    using query_cb = std::function<void(std::unique_ptr<char[]> data, size_t size)>;
-
-    bool try_yield_message()
-    {
-        uint16_t size = 0;
-
-        if (buffer.size() < sizeof(size)) {
-            return false;
-        }
-
-        memcpy(&size, buffer.data(), sizeof(size));
-        size = ntohs(size);
-
-        if (size < MIN_DNS_QUERY_SIZE || size > MAX_DNS_QUERY_SIZE) {
-            error();
-            return false;
-        }
-
-        if (buffer.size() >= sizeof(size) + size) {
-            auto data = std::make_unique<char[]>(size);
-            memcpy(data.get(), buffer.data() + sizeof(size), size);
-            buffer.erase(0, sizeof(size) + size);
-
-            query(std::move(data), size);
-            return true;
-        }
-
-        return false;
-    }
-
-    void received(const char data[], size_t len)
-    {
-        buffer.append(data, len);
-
-        while (try_yield_message()) {
-        }
-    }
-
-    void on_error(error_cb handler)
-    {
-        error = std::move(handler);
-    }
-
-    void on_query(query_cb handler)
-    {
-        query = std::move(handler);
-    }
-
-private:
-    std::string buffer;
-    error_cb error;
-    query_cb query;
-};
-
 TrafGen::TrafGen(std::shared_ptr<uvw::Loop> l,
     std::shared_ptr<Metrics> s,
     std::shared_ptr<Config> c,
     std::shared_ptr<TrafGenConfig> tgc,
     std::shared_ptr<QueryGenerator> q,
-    std::shared_ptr<TokenBucket> r)
+    std::shared_ptr<RateLimiter> r)
     : _loop(l)
     , _metrics(s)
     , _config(c)
     , _traf_config(tgc)
     , _qgen(q)
-    , _rate_limit(r)
+    , _rate_limit(r ? std::make_unique<RateShard>(r) : nullptr)
     , _stopping(false)
+    , _tracer(tgc->tracer.get())
+    , _loop_metrics(tgc->loop_metrics.get())
+    , _generate_metrics((_loop_metrics && _loop_metrics->counting()) ? _loop_metrics : nullptr)
 {
     // build a list of random ids we will use for queries
     for (uint16_t i = 0; i < std::numeric_limits<uint16_t>::max(); i++)
@@ -99,8 +50,9 @@ TrafGen::TrafGen(std::shared_ptr<uvw::Loop> l,
     _in_flight.reserve(std::numeric_limits<uint16_t>::max());
 }
 
-void TrafGen::process_wire(const char data[], size_t len)
+void TrafGen::process_wire(const char data[], size_t len, const UDPSocket::Timestamp *rx)
 {
+    LoopMetrics::Scope scope(_loop_metrics, LoopMetrics::RECEIVE);
 
     ldns_pkt *query{0};
     int r = ldns_wire2pkt(&query, (uint8_t *)data, len);
@@ -118,16 +70,107 @@ void TrafGen::process_wire(const char data[], size_t len)
         return;
     }
 
-    _metrics->receive(_in_flight[id].send_time, ldns_pkt_get_rcode(query), _in_flight.size());
+    auto &q = _in_flight[id];
+    auto now = std::chrono::high_resolution_clock::now();
+    auto latency = _clock.since(q.send_time, now);
+    if (rx && rx->software.time_since_epoch().count() && q.tx_time) {
+        // on the wire from kernel to kernel, NIC to NIC where both ends were stamped in hardware,
+        // and the user space time either side of that apart
+        bool hardware = rx->hardware.count() && q.tx_hw;
+        _metrics->receive(hardware ? QueryClock::after(q.tx_hw, QueryClock::ticks(rx->hardware)) : QueryClock::after(q.tx_time, _clock.stamp(rx->software)),
+            QueryClock::after(q.send_time, q.tx_time),
+            std::chrono::duration_cast<std::chrono::nanoseconds>(now - rx->software),
+            hardware, ldns_pkt_get_rcode(query), _in_flight.size());
+    } else {
+        _metrics->receive(latency, ldns_pkt_get_rcode(query), _in_flight.size());
+    }
+    FLAME_PROBE4(query__response, id, latency.count(), len, ldns_pkt_get_rcode(query));
+    if (_tracer) {
+        _tracer->answered(id, q, now - std::chrono::duration_cast<std::chrono::high_resolution_clock::duration>(latency), now,
+            ldns_pkt_get_rcode(query));
+    }
     _in_flight.erase(id);
     _free_id_list.push_back(id);
 
     ldns_pkt_free(query);
+
+    refill();
 }
 
 void TrafGen::start_udp()
 {
 
+    if (_traf_config->socket_pool) {
+        auto &pool = _traf_config->socket_pool;
+        _pool_member = pool->join([this](const char data[], size_t len) { process_wire(data, len); },
+            [this]() { _metrics->net_error(); });
+        // the pool routes responses by id, so only our share of the id space may be used
+        _free_id_list.erase(std::remove_if(_free_id_list.begin(), _free_id_list.end(),
+                                [this, &pool](uint16_t id) { return !pool->owns(_pool_member, id); }),
+            _free_id_list.end());
+        // members start on different sockets, so batches smaller than the pool still spread
+        _pool_socket = _pool_member % pool->size();
+        _metrics->trafgen_id(pool->port(_pool_socket));
+        return;
+    }
+
+    if (_traf_config->udp_gso || _traf_config->io_uring || _traf_config->timestamps) {
+#ifdef HAVE_IO_URING
+        if (_traf_config->io_uring) {
+            _udp_socket = std::make_shared<UringUDPSocket>(_loop, _traf_config->io_uring, _traf_config->family,
+                _traf_config->target_address, _traf_config->port, _traf_config->udp_gso);
+        }
+#endif
+        if (!_udp_socket) {
+            _udp_socket = std::make_shared<UDPSocket>(_loop, _traf_config->family, _traf_config->target_address,
+                _traf_config->port, true);
+        }
+        _udp_socket->on_error([this]() {
+            _metrics->net_error();
+        });
+        _udp_socket->on_recv([this](const char data[], size_t len) {
+            process_wire(data, len, _udp_socket->rx_timestamp());
+        });
+        if (_traf_config->timestamps) {
+            bool on = _udp_socket->timestamps();
+            static bool ts_warned{false};
+            if (!on && !ts_warned) {
+                std::cerr << "kernel does not support SO_TIMESTAMPING, timing responses in user space" << std::endl;
+                ts_warned = true;
+            }
+            _udp_socket->on_tx_time([this](uint16_t id, const UDPSocket::Timestamp &ts) {
+                auto i = _in_flight.find(id);
+                uint32_t sw = ts.software.time_since_epoch().count() ? _clock.stamp(ts.software) : 0;
+                // answered or timed out already, or the id is on a query sent since
+                if (i == _in_flight.end() || (sw && QueryClock::before(sw, i->second.send_time))) {
+                    return;
+                }
+                // software and hardware timestamps may come apart
+                if (ts.software.time_since_epoch().count()) {
+                    i->second.tx_time = sw ? sw : 1;
+                }
+                if (ts.hardware.count()) {
+                    uint32_t hw = QueryClock::ticks(ts.hardware);
+                    i->second.tx_hw = hw ? hw : 1;
+                }
+            });
+        }
+        if (_traf_config->udp_connect && !_udp_socket->connect()) {
+            // keep going unconnected
+            _metrics->net_error();
+        }
+        _udp_port = _udp_socket->port();
+        _metrics->trafgen_id(_udp_port);
+        static bool warned{false};
+        if (_traf_config->udp_gso && !_udp_socket->gso() && !warned && _config->verbosity()) {
+            std::cerr << "kernel does not support UDP GSO, falling back to batched sendmmsg" << std::endl;
+            warned = true;
+        }
+        _gso_buffer.reserve(UDPSocket::MAX_GSO_SIZE);
+        _udp_socket->start();
+        return;
+    }
+
     _udp_handle = _loop->resource<uvw::UDPHandle>(_traf_config->family);
 
     _udp_handle->on<uvw::ErrorEvent>([this](const uvw::ErrorEvent &e, uvw::UDPHandle &) {
@@ -140,7 +183,18 @@ void TrafGen::start_udp()
         _udp_handle->bind<uvw::IPv6>("::0", 0, uvw::UDPHandle::Bind::IPV6ONLY);
     }
 
-    _metrics->trafgen_id(_udp_handle->sock().port);
+#ifdef HAVE_UV_UDP_CONNECT
+    if (_traf_config->udp_connect) {
+        _udp_connected = (uv_udp_connect(_udp_handle->raw(), reinterpret_cast<const sockaddr *>(&_traf_config->target_sockaddr)) == 0);
+        if (!_udp_connected) {
+            // keep going unconnected
+            _metrics->net_error();
+        }
+    }
+#endif
+
+    _udp_port = _udp_handle->sock().port;
+    _metrics->trafgen_id(_udp_port);
 
     _udp_handle->on<uvw::UDPDataEvent>([this](const uvw::UDPDataEvent &event, uvw::UDPHandle &h) {
         process_wire(event.data.get(), event.length);
@@ -162,12 +216,14 @@ void TrafGen::start_tcp_session()
         _tcp_handle->bind<uvw::IPv6>("::0", 0, uvw::TcpHandle::Bind::IPV6ONLY);
     }
 
-    _metrics->trafgen_id(_tcp_handle->sock().port);
+    unsigned int port = _tcp_handle->sock().port;
+    _metrics->trafgen_id(port);
 
     /** SOCKET CALLBACKS **/
 
     // SOCKET: local socket was closed, cleanup resources and possibly restart another connection
-    _tcp_handle->on<uvw::CloseEvent>([this](uvw::CloseEvent &event, uvw::TcpHandle &h) {
+    _tcp_handle->on<uvw::CloseEvent>([this, port](uvw::CloseEvent &event, uvw::TcpHandle &h) {
+        FLAME_PROBE2(tcp__close, port, _in_flight.size());
         // if timer is still going (e.g. we got here through EndEvent), cancel it
         if (_finish_session_timer.get()) {
             _finish_session_timer->stop();
@@ -175,6 +231,13 @@ void TrafGen::start_tcp_session()
         }
         if (_tcp_handle.get()) {
             _tcp_handle->stop();
+            if (_traf_config->tls() && _traf_config->tls_resume && _tcp_handle->data()) {
+                // keep the most recent session (ticket) to resume on the next connection
+                auto session = std::static_pointer_cast<TCPTLSSession>(_tcp_handle->data());
+                if (auto resumable = session->session()) {
+                    _tls_session = resumable;
+                }
+            }
         }
         _tcp_handle.reset();
         _finish_session_timer.reset();
@@ -192,6 +255,7 @@ void TrafGen::start_tcp_session()
 
     // INCOMING: remote peer closed connection, EOF
     _tcp_handle->on<uvw::EndEvent>([this](uvw::EndEvent &event, uvw::TcpHandle &h) {
+        tls_close();
         _tcp_handle->shutdown();
     });
 
@@ -202,18 +266,33 @@ void TrafGen::start_tcp_session()
 
     // INCOMING: remote peer sends data, pass to session
     _tcp_handle->on<uvw::DataEvent>([this](uvw::DataEvent &event, uvw::TcpHandle &h) {
-        auto session = std::static_pointer_cast<TCPSession>(_tcp_handle->data());
-        session->received(event.data.get(), event.length);
+        if (_traf_config->tls()) {
+            auto session = std::static_pointer_cast<TCPTLSSession>(_tcp_handle->data());
+            session->received(event.data.get(), event.length);
+        } else {
+            auto session = std::static_pointer_cast<TCPSession>(_tcp_handle->data());
+            session->received(event.data.get(), event.length);
+        }
     });
 
     // OUTGOING: write operation has finished
     _tcp_handle->on<uvw::WriteEvent>([this](uvw::WriteEvent &event, uvw::TcpHandle &h) {
-        start_wait_timer_for_tcp_finish();
+        // DoT/DoH sessions are persistent and write many times, they finish in tls_send()
+        if (_traf_config->protocol == Protocol::TCP) {
+            start_wait_timer_for_tcp_finish();
+        }
     });
 
     // SOCKET: on connect
-    _tcp_handle->on<uvw::ConnectEvent>([this](uvw::ConnectEvent &event, uvw::TcpHandle &h) {
+    _tcp_handle->on<uvw::ConnectEvent>([this, port](uvw::ConnectEvent &event, uvw::TcpHandle &h) {
         _metrics->tcp_connection();
+        FLAME_PROBE2(tcp__connect, port,
+            std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - _connect_start).count());
+
+        if (_traf_config->tls()) {
+            start_tls_session();
+            return;
+        }
 
         auto session = std::make_shared<TCPSession>();
         // user data on the handle is our TCP session
@@ -235,12 +314,14 @@ void TrafGen::start_tcp_session()
         /** SEND DATA **/
         uint16_t id{0};
         std::vector<uint16_t> id_list;
+        // the batch goes in one write
+        auto now = std::chrono::high_resolution_clock::now();
         for (int i = 0; i < _traf_config->batch_count; i++) {
             if (_free_id_list.empty()) {
                 // out of ids, have to limit
                 break;
             }
-            if (_rate_limit && !_rate_limit->consume(1))
+            if (_rate_limit && !_rate_limit->take(1))
                 break;
             id = _free_id_list.back();
             _free_id_list.pop_back();
@@ -248,7 +329,7 @@ void TrafGen::start_tcp_session()
             id_list.push_back(id);
             // might be better to do this after write (in WriteEvent) but it needs to be available
             // by the time DataEvent fires, and we don't want a race there
-            _in_flight[id].send_time = std::chrono::high_resolution_clock::now();
+            _in_flight[id].send_time = _clock.stamp(now);
         }
 
         if (id_list.size() == 0) {
@@ -269,6 +350,8 @@ void TrafGen::start_tcp_session()
     });
 
     // fires ConnectEvent when connected
+    _connect_start = std::chrono::high_resolution_clock::now();
+    _session_query_count = 0;
     if (_traf_config->family == AF_INET) {
         _tcp_handle->connect<uvw::IPv4>(_traf_config->target_address, _traf_config->port);
     } else {
@@ -302,62 +385,437 @@ void TrafGen::start_wait_timer_for_tcp_finish()
         _finish_session_timer->stop();
         _finish_session_timer->close();
         _tcp_handle->stop();
+        tls_close();
         _tcp_handle->shutdown();
     });
     _finish_session_timer->start(uvw::TimerHandle::Time{1}, uvw::TimerHandle::Time{50});
 }
 
-void TrafGen::udp_send()
+/**
+ * Start TLS on a newly connected TCP handle. Once the handshake completes, queries are
+ * pipelined on the session by tls_send() until the peer closes it or session_queries is reached.
+ */
+void TrafGen::start_tls_session()
 {
 
-    if (_udp_handle.get() && !_udp_handle->active())
+    std::shared_ptr<TCPTLSSession> session;
+    if (_traf_config->protocol == Protocol::DOH) {
+        auto https = std::make_shared<HTTPSSession>(_tls_ctx.get(), _traf_config->tls_sni, _tls_session.get(),
+            _traf_config->doh_authority, _traf_config->doh_path, _traf_config->doh_method, _traf_config->doh_max_streams);
+        // define session callback for failed streams
+        https->on_bad_response([this](uint16_t id) {
+            if (_in_flight.erase(id)) {
+                _free_id_list.push_back(id);
+            }
+            _metrics->bad_receive(_in_flight.size());
+        });
+        // the first batch waits for the server's SETTINGS, which tell us its stream limit
+        https->on_ready([this]() {
+            tls_send();
+        });
+        session = https;
+    } else {
+        session = std::make_shared<TCPTLSSession>(_tls_ctx.get(), _traf_config->tls_sni, _tls_session.get());
+    }
+    // user data on the handle is our TLS session. always stored as the base class so it can be cast back as such.
+    _tcp_handle->data(session);
+
+    /** SESSION CALLBACKS **/
+    // define session callback for TLS failure or malformed data received
+    session->on_error([this]() {
+        _metrics->net_error();
+        handle_timeouts(true);
+        _tcp_handle->close();
+    });
+
+    // define session callback for complete DNS message received
+    session->on_query([this](std::unique_ptr<const char[]> data, size_t size) {
+        process_wire(data.get(), size);
+    });
+
+    // define session callback for encrypted data to send to the peer
+    session->on_write([this](std::unique_ptr<char[]> data, size_t size) {
+        _tcp_handle->write(std::move(data), size);
+    });
+
+    session->on_handshake([this]() {
+        auto session = std::static_pointer_cast<TCPTLSSession>(_tcp_handle->data());
+        _metrics->tls_handshake(session->handshake_time(), session->handshake_cpu(), session->resumed());
+        // send the first batch right away instead of waiting for the sender timer
+        if (_traf_config->protocol == Protocol::DOT) {
+            tls_send();
+        }
+    });
+
+    // start reading from incoming stream, fires DataEvent when receiving
+    _tcp_handle->read();
+    session->start();
+}
+
+void TrafGen::tls_close()
+{
+
+    if (!_traf_config->tls() || !_tcp_handle->data())
+        return;
+    auto session = std::static_pointer_cast<TCPTLSSession>(_tcp_handle->data());
+    session->close();
+}
+
+void TrafGen::tls_send()
+{
+    LoopMetrics::Scope scope(_loop_metrics, LoopMetrics::SEND);
+
+    if (!_tcp_handle.get() || _tcp_handle->closing() || _finish_session_timer.get())
+        return;
+    auto session = std::static_pointer_cast<TCPTLSSession>(_tcp_handle->data());
+    if (!session || !session->handshake_done())
         return;
     if (_qgen->finished())
         return;
-    if (_free_id_list.size() == 0) {
-        std::cerr << "max in flight reached" << std::endl;
+
+    if (_traf_config->protocol == Protocol::DOH) {
+        doh_send(std::static_pointer_cast<HTTPSSession>(session));
         return;
     }
+
     uint16_t id{0};
+    std::vector<uint16_t> id_list;
+    // the batch goes in one write
+    auto now = std::chrono::high_resolution_clock::now();
     for (int i = 0; i < _traf_config->batch_count; i++) {
-        if (_rate_limit && !_rate_limit->consume(1))
-            return;
-        if (_free_id_list.size() == 0) {
-            std::cerr << "max in flight reached" << std::endl;
-            return;
+        if (_traf_config->session_queries && _session_query_count >= _traf_config->session_queries) {
+            break;
+        }
+        if (_free_id_list.empty()) {
+            // out of ids, have to limit
+            break;
         }
+        if (_rate_limit && !_rate_limit->take(1))
+            break;
         id = _free_id_list.back();
         _free_id_list.pop_back();
         assert(_in_flight.find(id) == _in_flight.end());
-        auto qt = _qgen->next_udp(id);
-        if (_traf_config->family == AF_INET) {
-            _udp_handle->send<uvw::IPv4>(_traf_config->target_address, _traf_config->port,
-                std::move(std::get<0>(qt)),
-                std::get<1>(qt));
+        id_list.push_back(id);
+        _in_flight[id].send_time = _clock.stamp(now);
+        _session_query_count++;
+    }
+
+    if (id_list.size()) {
+        auto qt = _qgen->next_tcp(id_list);
+        session->write(std::get<0>(qt).get(), std::get<1>(qt));
+        _metrics->send(std::get<1>(qt), id_list.size(), _in_flight.size());
+    }
+
+    if (_traf_config->session_queries && _session_query_count >= _traf_config->session_queries) {
+        // session is used up: wait for responses, then close. CloseEvent reconnects.
+        start_wait_timer_for_tcp_finish();
+    }
+}
+
+/**
+ * Send a batch on a DoH session, one stream per query, within the session's stream concurrency limit.
+ */
+void TrafGen::doh_send(std::shared_ptr<HTTPSSession> session)
+{
+
+    uint16_t id{0};
+    bool exhausted{false};
+    u_long count{0};
+    u_long bytes{0};
+    size_t available = session->available_streams();
+    // the streams go out together on session->send()
+    auto now = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < _traf_config->batch_count && available; i++) {
+        if (_traf_config->session_queries && _session_query_count >= _traf_config->session_queries) {
+            exhausted = true;
+            break;
+        }
+        if (_free_id_list.empty()) {
+            // out of ids, have to limit
+            break;
+        }
+        if (_rate_limit && !_rate_limit->take(1))
+            break;
+        id = _free_id_list.back();
+        assert(_in_flight.find(id) == _in_flight.end());
+        auto w = _qgen->next_wire();
+        static const std::string no_param;
+        const std::string &dns_param = (_traf_config->doh_method == HTTPSSession::Method::GET) ? _qgen->wire_b64url(w.first) : no_param;
+        if (!session->submit(id, w.second.first, w.second.second, dns_param)) {
+            // server sent GOAWAY or we ran out of stream ids on this connection
+            exhausted = true;
+            break;
+        }
+        _free_id_list.pop_back();
+        _in_flight[id].send_time = _clock.stamp(now);
+        _session_query_count++;
+        available--;
+        count++;
+        bytes += w.second.second;
+    }
+
+    if (count) {
+        session->send();
+        _metrics->send(bytes, count, _in_flight.size());
+        _metrics->streams(session->open_streams());
+    }
+
+    if (exhausted) {
+        // session is used up: wait for responses, then close. CloseEvent reconnects.
+        start_wait_timer_for_tcp_finish();
+    }
+}
+
+/**
+ * Send a batch on _udp_socket as few large sends: consecutive queries of the same size are
+ * concatenated and segmented by the kernel (GSO) or by the socket. A query of a different size
+ * starts a new send.
+ */
+void TrafGen::udp_send_batch(long count)
+{
+
+    if (finished())
+        return;
+
+    std::vector<uint16_t> ids;
+    size_t seg_size{0};
+    // queued sends (io_uring) only reach the kernel on the final flush
+    u_long queued{0};
+    long sent_total{0};
+    // the batch is sent in a few syscalls in a row, it shares one send time
+    auto now = std::chrono::high_resolution_clock::now();
+
+    // send what has been collected. when the socket buffer fills up, the queries that didn't go
+    // are put back to go next time, and never counted as sent.
+    auto flush = [&]() {
+        if (ids.empty())
+            return true;
+        if (_traf_config->timestamps) {
+            _udp_socket->tx_tags(ids);
+        }
+        size_t sent = _udp_socket->send(_gso_buffer.data(), _gso_buffer.size(), seg_size);
+        bool all = (sent == ids.size());
+        // every query in the buffer is seg_size bytes
+        for (size_t j = sent; j < ids.size(); j++) {
+            auto query = std::make_unique<char[]>(seg_size);
+            memcpy(query.get(), _gso_buffer.data() + j * seg_size, seg_size);
+            unsend(ids[j], QueryGenerator::QueryTpt(std::move(query), seg_size), _in_flight[ids[j]].index);
+            _in_flight.erase(ids[j]);
+        }
+        if (sent) {
+            _metrics->send(sent * seg_size, sent, _in_flight.size());
+            if (_traf_config->io_uring) {
+                queued += sent;
+            } else {
+                _metrics->send_syscall(sent);
+            }
+            sent_total += sent;
+        }
+        _gso_buffer.clear();
+        ids.clear();
+        return all;
+    };
+
+    if (_rate_limit)
+        count = _rate_limit->take(count);
+    for (long i = 0; i < count; i++) {
+        uint16_t id;
+        QueryGenerator::QueryTpt qt;
+        if (!next_udp_query(id, qt)) {
+            std::cerr << "max in flight reached" << std::endl;
+            break;
+        }
+        assert(_in_flight.find(id) == _in_flight.end());
+        size_t len = std::get<1>(qt);
+        if (ids.size() && (len != seg_size || ids.size() == UDPSocket::MAX_GSO_SEGMENTS || _gso_buffer.size() + len > UDPSocket::MAX_GSO_SIZE)) {
+            if (!flush()) {
+                unsend(id, std::move(qt), _query_index);
+                break;
+            }
+        }
+        seg_size = len;
+        _gso_buffer.append(std::get<0>(qt).get(), len);
+        ids.push_back(id);
+        auto &q = _in_flight[id];
+        q.send_time = send_time(now);
+        note_send(id, q, len, _udp_port);
+    }
+    flush();
+    if (_rate_limit)
+        _rate_limit->give_back(count - sent_total);
+    if (_udp_socket->flush() && queued) {
+        _metrics->send_syscall(queued);
+    }
+}
+
+/**
+ * Send a batch as raw frames on the shared packet TX ring, from our UDP socket's port so the
+ * responses arrive on it. The frames go out together on one flush.
+ */
+void TrafGen::udp_send_raw(long count)
+{
+
+#ifdef HAVE_PACKET_RING
+    auto &pool = _traf_config->socket_pool;
+    if (pool ? !pool->active() : !_udp_handle->active())
+        return;
+    if (finished())
+        return;
+
+    auto &raw = _traf_config->raw_sender;
+    u_long queued{0};
+    // the frames go out together on the flush
+    auto now = std::chrono::high_resolution_clock::now();
+    if (_rate_limit)
+        count = _rate_limit->take(count);
+    long i{0};
+    for (; i < count; i++) {
+        uint16_t id;
+        QueryGenerator::QueryTpt qt;
+        if (!next_udp_query(id, qt)) {
+            std::cerr << "max in flight reached" << std::endl;
+            break;
+        }
+        if (std::get<1>(qt) > raw->max_payload()) {
+            // won't fit in a frame, or would need IP fragmentation
+            _metrics->net_error();
+            _free_id_list.push_back(id);
+            continue;
+        }
+        unsigned int port = pool ? pool->port(_pool_socket) : _udp_port;
+        if (!raw->send(port, std::get<0>(qt).get(), std::get<1>(qt))) {
+            // ring is full until the kernel catches up: the query goes first next time, and its
+            // token back to the rate limiter
+            unsend(id, std::move(qt), _query_index);
+            break;
+        }
+        if (pool) {
+            pool->sent(_pool_member, _pool_socket);
+            _pool_socket = (_pool_socket + 1) % pool->size();
+        }
+        assert(_in_flight.find(id) == _in_flight.end());
+        auto &q = _in_flight[id];
+        q.send_time = send_time(now);
+        note_send(id, q, std::get<1>(qt), port);
+        _metrics->send(std::get<1>(qt), 1, _in_flight.size());
+        queued++;
+    }
+    if (_rate_limit)
+        _rate_limit->give_back(count - i);
+    if (queued) {
+        raw->flush();
+        _metrics->send_syscall(queued);
+    }
+#endif
+}
+
+void TrafGen::udp_send(long count)
+{
+    LoopMetrics::Scope scope(_loop_metrics, LoopMetrics::SEND);
+
+    if (_udp_socket) {
+        udp_send_batch(count);
+        return;
+    }
+    if (_traf_config->raw_sender) {
+        udp_send_raw(count);
+        return;
+    }
+    auto &pool = _traf_config->socket_pool;
+    if (_udp_handle.get() && !_udp_handle->active())
+        return;
+    if (pool && !pool->active())
+        return;
+    if (finished())
+        return;
+    if (_free_id_list.size() == 0 && _unsent.empty()) {
+        std::cerr << "max in flight reached" << std::endl;
+        return;
+    }
+    // take the batch's tokens at once, and give back what couldn't be sent
+    if (_rate_limit)
+        count = _rate_limit->take(count);
+    uint16_t id{0};
+    long i{0};
+    for (; i < count; i++) {
+        QueryGenerator::QueryTpt qt;
+        if (!next_udp_query(id, qt)) {
+            std::cerr << "max in flight reached" << std::endl;
+            break;
+        }
+        assert(_in_flight.find(id) == _in_flight.end());
+        bool sent{true};
+        unsigned int port = pool ? pool->port(_pool_socket) : _udp_port;
+        if (pool) {
+            sent = pool->send(_pool_member, _pool_socket, std::move(std::get<0>(qt)), std::get<1>(qt));
+            _pool_socket = (_pool_socket + 1) % pool->size();
+        } else if (_udp_connected) {
+#ifdef HAVE_UV_UDP_CONNECT
+            // connected: send in place, without a send request or address
+            uv_buf_t buf = uv_buf_init(std::get<0>(qt).get(), std::get<1>(qt));
+            int r = uv_udp_try_send(_udp_handle->raw(), &buf, 1, nullptr);
+            if (r < 0) {
+                if (r != UV_EAGAIN) {
+                    _metrics->net_error();
+                }
+                sent = false;
+            }
+#endif
         } else {
-            _udp_handle->send<uvw::IPv6>(_traf_config->target_address, _traf_config->port,
+            _udp_handle->send(reinterpret_cast<const sockaddr &>(_traf_config->target_sockaddr),
                 std::move(std::get<0>(qt)),
                 std::get<1>(qt));
         }
+        if (!sent) {
+            // not sent, the socket buffer being full: the query goes first on the next timer, and its
+            // token back to the rate limiter
+            unsend(id, std::move(qt), _query_index);
+            break;
+        }
         _metrics->send(std::get<1>(qt), 1, _in_flight.size());
-        _in_flight[id].send_time = std::chrono::high_resolution_clock::now();
+        auto &q = _in_flight[id];
+        q.send_time = send_time();
+        note_send(id, q, std::get<1>(qt), port);
     }
+    if (_rate_limit)
+        _rate_limit->give_back(count - i);
 }
 
 void TrafGen::start()
 {
 
-    if (_traf_config->protocol == Protocol::UDP) {
-        start_udp();
-        _sender_timer = _loop->resource<uvw::TimerHandle>();
-        _sender_timer->on<uvw::TimerEvent>([this](const uvw::TimerEvent &event, uvw::TimerHandle &h) {
-            if (_traf_config->protocol == Protocol::UDP) {
-                udp_send();
-            } else if (_traf_config->protocol == Protocol::TCP) {
-                start_tcp_session();
-            }
-        });
-        _sender_timer->start(uvw::TimerHandle::Time{1}, uvw::TimerHandle::Time{_traf_config->s_delay});
+    if (_traf_config->protocol == Protocol::UDP || _traf_config->tls()) {
+        if (_traf_config->protocol == Protocol::UDP) {
+            start_udp();
+        } else {
+            _tls_ctx = TCPTLSSession::new_client_ctx(_traf_config->tls_resume,
+                (_traf_config->protocol == Protocol::DOH) ? "h2" : "");
+            start_tcp_session();
+        }
+        // paced sends come from the pacer calling send()
+        if (!_traf_config->paced) {
+            _sender_timer = _loop->resource<uvw::TimerHandle>();
+            _sender_timer->on<uvw::TimerEvent>([this](const uvw::TimerEvent &event, uvw::TimerHandle &h) {
+                if (_loop_metrics) {
+                    auto now = std::chrono::steady_clock::now();
+                    _loop_metrics->timer_late(std::max(now - _sender_due, std::chrono::steady_clock::duration::zero()));
+                    _sender_due = now + std::chrono::milliseconds(_traf_config->s_delay);
+                }
+                if (_outstanding) {
+                    // answers and timeouts send the next queries, this only retries sends that
+                    // failed, e.g. on a full socket buffer
+                    refill();
+                } else if (_traf_config->protocol == Protocol::UDP) {
+                    udp_send(_traf_config->batch_count);
+                } else if (_traf_config->protocol == Protocol::TCP) {
+                    start_tcp_session();
+                } else if (_traf_config->tls()) {
+                    tls_send();
+                }
+            });
+            _sender_due = std::chrono::steady_clock::now() + std::chrono::milliseconds(1);
+            _sender_timer->start(uvw::TimerHandle::Time{1}, uvw::TimerHandle::Time{_traf_config->s_delay});
+        }
     } else {
         start_tcp_session();
     }
@@ -365,8 +823,12 @@ void TrafGen::start()
     _timeout_timer = _loop->resource<uvw::TimerHandle>();
     _timeout_timer->on<uvw::TimerEvent>([this](const uvw::TimerEvent &event, uvw::TimerHandle &h) {
         handle_timeouts();
+        if (_traf_config->timestamps && _udp_socket) {
+            // kernel timestamps follow the system clock, which may be slewed under us
+            _udp_socket->sync_clock();
+        }
     });
-    _timeout_timer->start(uvw::TimerHandle::Time{_traf_config->r_timeout * 1000}, uvw::TimerHandle::Time{1000});
+    _timeout_timer->start(uvw::TimerHandle::Time{_traf_config->r_timeout * 1000}, TIMEOUT_INTERVAL);
 
     _shutdown_timer = _loop->resource<uvw::TimerHandle>();
     _shutdown_timer->on<uvw::TimerEvent>([this](auto &, auto &) {
@@ -382,6 +844,12 @@ void TrafGen::start()
         if (_udp_handle.get()) {
             _udp_handle->close();
         }
+        if (_udp_socket) {
+            _udp_socket->close();
+        }
+        if (_traf_config->socket_pool) {
+            _traf_config->socket_pool->leave();
+        }
         if (_tcp_handle.get()) {
             _tcp_handle->close();
         }
@@ -402,19 +870,29 @@ void TrafGen::start()
  */
 void TrafGen::handle_timeouts(bool force_reset)
 {
+    LoopMetrics::Scope scope(_loop_metrics, LoopMetrics::TIMEOUTS);
 
     std::vector<uint16_t> timed_out;
     auto now = std::chrono::high_resolution_clock::now();
-    for (auto i : _in_flight) {
-        if (force_reset || std::chrono::duration_cast<std::chrono::seconds>(now - i.second.send_time).count() >= _traf_config->r_timeout) {
+    auto stamp = _clock.stamp(now);
+    std::chrono::nanoseconds timeout = std::chrono::seconds(_traf_config->r_timeout);
+    for (auto &i : _in_flight) {
+        if (force_reset || QueryClock::between(i.second.send_time, stamp) >= timeout) {
             timed_out.push_back(i.first);
         }
     }
     for (auto i : timed_out) {
+        FLAME_PROBE2(query__timeout, i, QueryClock::between(_in_flight[i].send_time, stamp).count());
+        if (_tracer) {
+            _tracer->timed_out(i, _in_flight[i], _clock.time(_in_flight[i].send_time, now));
+        }
         _in_flight.erase(i);
         _metrics->timeout(_in_flight.size());
         _free_id_list.push_back(i);
     }
+    if (timed_out.size()) {
+        refill();
+    }
 }
 
 void TrafGen::stop()
@@ -2,6 +2,7 @@
 
 #pragma once
 
+#include <deque>
 #include <memory>
 #include <unordered_map>
 #include <vector>
@@ -9,23 +10,70 @@
 #include "config.h"
 #include "metrics.h"
 #include "query.h"
+#include "queryclock.h"
+#include "ratelimiter.h"
+#include "udpsocket.h"
+#include "httpssession.h"
+#include "probes.h"
 
-#include <TokenBucket.h>
 #include <uvw.hpp>
 
+class IOUring;
+class PacketSender;
+class Tracer;
+class UDPSocketPool;
+
 enum class Protocol {
     UDP,
     TCP,
+    DOT,
+    DOH,
 };
 
 struct TrafGenConfig {
     std::string target_address;
     int family{0};
     unsigned int port{53};
+    // target_address and port, resolved once for all sends
+    sockaddr_storage target_sockaddr{};
     int r_timeout{3};
     long s_delay{1};
     long batch_count{10};
+    // UDP sends are driven by a Pacer calling TrafGen::send(), instead of batch_count every s_delay
+    bool paced{false};
     Protocol protocol{Protocol::UDP};
+    // send UDP batches with segmentation offload, receive with GRO
+    bool udp_gso{false};
+    // connect UDP sockets to the target: sends carry no address, and the kernel drops
+    // datagrams from other sources
+    bool udp_connect{false};
+    // time UDP latency from the kernel's send timestamp to its receive timestamp (SO_TIMESTAMPING)
+    bool timestamps{false};
+    // do UDP i/o on this ring instead of libuv, shared by all generators
+    std::shared_ptr<IOUring> io_uring;
+    // send UDP as raw frames on this packet socket, responses are still received on _udp_handle
+    std::shared_ptr<PacketSender> raw_sender;
+    // send and receive UDP on these sockets, shared by all generators, instead of one socket each
+    std::shared_ptr<UDPSocketPool> socket_pool;
+    // log every Nth query to this trace, shared by all generators
+    std::shared_ptr<Tracer> tracer;
+    // where loop time goes and how late send timers fire, shared by all generators
+    std::shared_ptr<LoopMetrics> loop_metrics;
+    // DNS over TLS and HTTPS
+    std::string tls_sni;
+    bool tls_resume{true};
+    // close and reconnect a DoT/DoH session after this many queries, 0 keeps sessions open
+    long session_queries{0};
+    // DNS over HTTPS
+    std::string doh_authority;
+    std::string doh_path{"/dns-query"};
+    HTTPSSession::Method doh_method{HTTPSSession::Method::POST};
+    long doh_max_streams{100};
+
+    bool tls() const
+    {
+        return protocol == Protocol::DOT || protocol == Protocol::DOH;
+    }
 };
 
 class TrafGen
@@ -36,9 +84,19 @@ class TrafGen
     std::shared_ptr<Config> _config;
     std::shared_ptr<TrafGenConfig> _traf_config;
     std::shared_ptr<QueryGenerator> _qgen;
-    std::shared_ptr<TokenBucket> _rate_limit;
+    // our share of the rate limiter, if any
+    std::unique_ptr<RateShard> _rate_limit;
 
     std::shared_ptr<uvw::UDPHandle> _udp_handle;
+    // local port of _udp_handle or _udp_socket, the source port of raw sends
+    unsigned int _udp_port{0};
+    bool _udp_connected{false};
+    // our member index in the shared socket pool, and the pool socket the next query goes out on
+    size_t _pool_member{0};
+    size_t _pool_socket{0};
+    // used instead of _udp_handle in GSO and io_uring modes
+    std::shared_ptr<UDPSocket> _udp_socket;
+    std::string _gso_buffer;
     std::shared_ptr<uvw::TcpHandle> _tcp_handle;
 
     std::shared_ptr<uvw::TimerHandle> _sender_timer;
@@ -46,34 +104,174 @@ class TrafGen
     std::shared_ptr<uvw::TimerHandle> _shutdown_timer;
     std::shared_ptr<uvw::TimerHandle> _finish_session_timer;
 
-    // a hash of in flight queries, keyed by query id
+    // DNS over TLS/HTTPS state, kept across connections for session resumption
+    std::shared_ptr<SSL_CTX> _tls_ctx;
+    std::shared_ptr<SSL_SESSION> _tls_session;
+    std::chrono::high_resolution_clock::time_point _connect_start;
+    long _session_query_count{0};
+
+    // a hash of in flight queries, keyed by query id, with their times stamped on _clock
     std::unordered_map<uint16_t, Query> _in_flight;
+    QueryClock _clock;
     // a randomized list of query ids that are not currently in flight
     std::vector<uint16_t> _free_id_list;
 
+    // a UDP query generated on one of our ids but not sent, the socket buffer being full. it goes
+    // out first next time rather than being lost.
+    struct UnsentQuery {
+        uint16_t id;
+        QueryGenerator::QueryTpt query;
+        size_t index;
+    };
+    std::deque<UnsentQuery> _unsent;
+    // generator index of the query being sent, for the trace
+    size_t _query_index{0};
+
     bool _stopping;
 
+    // closed loop: queries kept in flight, each answer or timeout sending the next. 0 is off.
+    long _outstanding{0};
+
+    // intended send times of the queries in the current paced send, null otherwise, and how many
+    // of them queries have been given. a query skipped or not sent takes none.
+    const std::chrono::high_resolution_clock::time_point *_intended{nullptr};
+    long _intended_used{0};
+
+    // time the next query sent is timed from: the next intended time when paced, so latency
+    // includes any delay in sending it (no coordinated omission), or else when it was sent. Queries
+    // that leave in one syscall share one clock read.
+    uint32_t send_time(std::chrono::high_resolution_clock::time_point sent)
+    {
+        return _clock.stamp(_intended ? _intended[_intended_used++] : sent);
+    }
+    // a query sent on its own
+    uint32_t send_time()
+    {
+        return _intended ? _clock.stamp(_intended[_intended_used++]) : _clock.stamp(std::chrono::high_resolution_clock::now());
+    }
+
+    // _traf_config->tracer, if tracing
+    Tracer *_tracer{nullptr};
+
+    // _traf_config->loop_metrics, and when _sender_timer is next due
+    LoopMetrics *_loop_metrics{nullptr};
+    // the same, if it counts hardware events: query generation is only timed apart then
+    LoopMetrics *_generate_metrics{nullptr};
+    std::chrono::steady_clock::time_point _sender_due;
+
+    // a UDP query is being sent: fire the probe, and note what the trace needs when tracing
+    void note_send(uint16_t id, Query &q, size_t size, unsigned int port)
+    {
+        FLAME_PROBE3(query__send, id, size, port);
+        if (_tracer) {
+            q.index = _query_index;
+            q.size = size;
+            q.port = port;
+        }
+    }
+
+    QueryGenerator::QueryTpt next_udp(uint16_t id)
+    {
+        LoopMetrics::Scope scope(_generate_metrics, LoopMetrics::GENERATE);
+        auto qt = _qgen->next_udp(id);
+        if (_tracer) {
+            _query_index = _qgen->index();
+        }
+        return qt;
+    }
+
+    // the next UDP query to send and its id: one put back by unsend(), else a new one on a free
+    // id. false if no id is free.
+    bool next_udp_query(uint16_t &id, QueryGenerator::QueryTpt &qt)
+    {
+        if (!_unsent.empty()) {
+            id = _unsent.front().id;
+            qt = std::move(_unsent.front().query);
+            _query_index = _unsent.front().index;
+            _unsent.pop_front();
+            return true;
+        }
+        if (_free_id_list.empty()) {
+            return false;
+        }
+        id = _free_id_list.back();
+        _free_id_list.pop_back();
+        qt = next_udp(id);
+        return true;
+    }
+
+    // put back a query from next_udp_query() that couldn't be sent, to go again before any new
+    // ones. index is its generator index.
+    void unsend(uint16_t id, QueryGenerator::QueryTpt qt, size_t index)
+    {
+        _unsent.push_back(UnsentQuery{id, std::move(qt), index});
+    }
+
+    // whether there is nothing left to send
+    bool finished()
+    {
+        return _qgen->finished() && _unsent.empty();
+    }
+
     void handle_timeouts(bool force_reset = false);
 
-    void process_wire(const char data[], size_t len);
+    // closed loop: send enough queries to have _outstanding in flight again
+    void refill()
+    {
+        if (_outstanding && !_stopping && static_cast<long>(_in_flight.size()) < _outstanding) {
+            udp_send(_outstanding - _in_flight.size());
+        }
+    }
+
+    // rx is the kernel's receive timestamp, if it took one
+    void process_wire(const char data[], size_t len, const UDPSocket::Timestamp *rx = nullptr);
 
     void start_udp();
-    void udp_send();
+    void udp_send(long count);
+    void udp_send_batch(long count);
+    void udp_send_raw(long count);
 
     void start_tcp_session();
     void start_wait_timer_for_tcp_finish();
+    void start_tls_session();
+    void tls_send();
+    void doh_send(std::shared_ptr<HTTPSSession> session);
+    void tls_close();
 
 public:
+    // how often in flight queries are checked for timeouts: one is timed out at most this long
+    // after r_timeout, so r_timeout plus this must stay under QueryClock::MAX_AGE
+    static constexpr std::chrono::seconds TIMEOUT_INTERVAL{1};
+
     TrafGen(std::shared_ptr<uvw::Loop> l,
         std::shared_ptr<Metrics> s,
         std::shared_ptr<Config> c,
         std::shared_ptr<TrafGenConfig> tgc,
         std::shared_ptr<QueryGenerator> q,
-        std::shared_ptr<TokenBucket> r);
+        std::shared_ptr<RateLimiter> r);
+
+    // keep exactly outstanding UDP queries in flight instead of sending on a timer or rate.
+    // must be set before start().
+    void closed_loop(long outstanding)
+    {
+        _outstanding = outstanding;
+    }
 
     void start();
 
     void stop();
+
+    // send count UDP queries now (paced mode), intended to go out at the given times
+    void send(const std::chrono::high_resolution_clock::time_point intended[], long count)
+    {
+        if (!_stopping) {
+            _intended = intended;
+            _intended_used = 0;
+            udp_send(count);
+            _intended = nullptr;
+        }
+    }
+
     std::vector<uint16_t>::size_type in_flight_cnt()
     {
         return _in_flight.size();
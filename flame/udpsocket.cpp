@@ -0,0 +1,411 @@
+// Copyright 2019 NSONE, Inc
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#endif
+
+#include "udpsocket.h"
+
+#if defined(__linux__) && defined(SO_TIMESTAMPING)
+#define HAVE_TIMESTAMPING
+#endif
+
+#ifndef __linux__
+struct mmsghdr {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+};
+#endif
+
+// big enough for a fully coalesced GRO read
+static const size_t RECV_BUF_SIZE = 65535;
+// bound on datagrams read per readable event, so a busy socket can't starve the loop
+static const int MAX_READS_PER_EVENT = 256;
+
+UDPSocket::UDPSocket(std::shared_ptr<uvw::Loop> loop, int family, const std::string &target_address, unsigned int port, bool gro)
+    : _loop(loop)
+{
+    int r;
+    if (family == AF_INET) {
+        r = uv_ip4_addr(target_address.c_str(), port, reinterpret_cast<sockaddr_in *>(&_target));
+        _target_len = sizeof(sockaddr_in);
+    } else {
+        r = uv_ip6_addr(target_address.c_str(), port, reinterpret_cast<sockaddr_in6 *>(&_target));
+        _target_len = sizeof(sockaddr_in6);
+    }
+    if (r != 0) {
+        throw std::runtime_error("invalid target address: " + target_address);
+    }
+
+    _fd = socket(family, SOCK_DGRAM, 0);
+    if (_fd < 0) {
+        throw std::runtime_error(std::string("unable to create UDP socket: ") + strerror(errno));
+    }
+    fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL) | O_NONBLOCK);
+
+    sockaddr_storage local{};
+    socklen_t local_len;
+    if (family == AF_INET) {
+        uv_ip4_addr("0.0.0.0", 0, reinterpret_cast<sockaddr_in *>(&local));
+        local_len = sizeof(sockaddr_in);
+    } else {
+        int on = 1;
+        setsockopt(_fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on));
+        uv_ip6_addr("::0", 0, reinterpret_cast<sockaddr_in6 *>(&local));
+        local_len = sizeof(sockaddr_in6);
+    }
+    if (bind(_fd, reinterpret_cast<sockaddr *>(&local), local_len) != 0) {
+        ::close(_fd);
+        throw std::runtime_error(std::string("unable to bind UDP socket: ") + strerror(errno));
+    }
+
+#ifdef UDP_SEGMENT
+    // kernels without GSO (< 4.18) reject the option
+    int seg{0};
+    socklen_t seg_len{sizeof(seg)};
+    _gso = (getsockopt(_fd, SOL_UDP, UDP_SEGMENT, &seg, &seg_len) == 0);
+#endif
+#ifdef UDP_GRO
+    if (gro) {
+        int on = 1;
+        _gro = (setsockopt(_fd, SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0);
+    }
+#endif
+}
+
+UDPSocket::~UDPSocket()
+{
+    close();
+}
+
+unsigned int UDPSocket::port() const
+{
+    sockaddr_storage local{};
+    socklen_t len{sizeof(local)};
+    getsockname(_fd, reinterpret_cast<sockaddr *>(&local), &len);
+    if (local.ss_family == AF_INET) {
+        return ntohs(reinterpret_cast<sockaddr_in *>(&local)->sin_port);
+    }
+    return ntohs(reinterpret_cast<sockaddr_in6 *>(&local)->sin6_port);
+}
+
+bool UDPSocket::connect()
+{
+    if (::connect(_fd, reinterpret_cast<sockaddr *>(&_target), _target_len) != 0) {
+        return false;
+    }
+    _connected = true;
+    return true;
+}
+
+bool UDPSocket::timestamps()
+{
+#ifdef HAVE_TIMESTAMPING
+    // keys (OPT_ID) match send timestamps to datagrams, which aren't looped back (OPT_TSONLY)
+    int flags = SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_TX_SOFTWARE
+        | SOF_TIMESTAMPING_RAW_HARDWARE | SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_TX_HARDWARE
+        | SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+    bool on = false;
+#ifdef SOF_TIMESTAMPING_OPT_TX_SWHW
+    // software send timestamps too when the NIC stamps in hardware (4.13+)
+    int swhw = flags | SOF_TIMESTAMPING_OPT_TX_SWHW;
+    on = (setsockopt(_fd, SOL_SOCKET, SO_TIMESTAMPING, &swhw, sizeof(swhw)) == 0);
+#endif
+    if (!on && setsockopt(_fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) != 0) {
+        return false;
+    }
+    _timestamps = true;
+    // a GSO send is timestamped once, for its first segment
+    _gso = false;
+#ifdef UDP_GRO
+    // and a coalesced read for its first datagram, which would give the rest its receive time
+    if (_gro) {
+        int off = 0;
+        setsockopt(_fd, SOL_UDP, UDP_GRO, &off, sizeof(off));
+        _gro = false;
+    }
+#endif
+    sync_clock();
+    return true;
+#else
+    return false;
+#endif
+}
+
+void UDPSocket::sync_clock()
+{
+    // kernel software timestamps are on the system clock
+    _clock_offset = std::chrono::high_resolution_clock::now().time_since_epoch()
+        - std::chrono::duration_cast<std::chrono::high_resolution_clock::duration>(std::chrono::system_clock::now().time_since_epoch());
+}
+
+UDPSocket::Timestamp UDPSocket::timestamp(const void *scm_timestamping) const
+{
+    Timestamp t;
+#ifdef HAVE_TIMESTAMPING
+    // software, deprecated, raw hardware
+    timespec ts[3];
+    memcpy(ts, scm_timestamping, sizeof(ts));
+    auto software = std::chrono::seconds(ts[0].tv_sec) + std::chrono::nanoseconds(ts[0].tv_nsec);
+    if (software.count()) {
+        t.software = std::chrono::high_resolution_clock::time_point(
+            std::chrono::duration_cast<std::chrono::high_resolution_clock::duration>(software) + _clock_offset);
+    }
+    t.hardware = std::chrono::seconds(ts[2].tv_sec) + std::chrono::nanoseconds(ts[2].tv_nsec);
+#endif
+    return t;
+}
+
+void UDPSocket::tag_sent(size_t datagrams)
+{
+    if (!_timestamps) {
+        return;
+    }
+    if (_pending_tags) {
+        for (size_t i = 0; i < datagrams && i < _pending_tags->size(); i++) {
+            _tx_waiting.emplace_back(_tx_key + i, (*_pending_tags)[i]);
+        }
+        // a tag older than that has been reused, its timestamp isn't coming or is no use
+        while (_tx_waiting.size() > MAX_TX_WAITING) {
+            _tx_waiting.pop_front();
+        }
+    }
+    _tx_key += datagrams;
+    // most devices have taken the timestamp by the time the send returns
+    read_tx_times();
+}
+
+void UDPSocket::read_tx_times()
+{
+#ifdef HAVE_TIMESTAMPING
+    char control[CMSG_SPACE(sizeof(timespec) * 3) + CMSG_SPACE(sizeof(sock_extended_err) + sizeof(sockaddr_in6))];
+    while (_fd >= 0) {
+        msghdr msg{};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            return;
+        }
+        const void *tss{nullptr};
+        sock_extended_err err{};
+        for (cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPING) {
+                tss = CMSG_DATA(cm);
+            } else if ((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+                || (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+                memcpy(&err, CMSG_DATA(cm), sizeof(err));
+            }
+        }
+        if (!tss || err.ee_errno != ENOMSG || err.ee_origin != SO_EE_ORIGIN_TIMESTAMPING) {
+            continue;
+        }
+        auto ts = timestamp(tss);
+        // timestamps come in send order, datagrams before this one without one won't get one
+        uint32_t key = err.ee_data;
+        while (!_tx_waiting.empty() && static_cast<int32_t>(_tx_waiting.front().first - key) < 0) {
+            _tx_waiting.pop_front();
+        }
+        // kept until a later key comes, there may be a software and a hardware timestamp
+        if (!_tx_waiting.empty() && _tx_waiting.front().first == key) {
+            _tx_time(_tx_waiting.front().second, ts);
+        }
+    }
+#endif
+}
+
+void UDPSocket::start()
+{
+    _recv_buf = std::make_unique<char[]>(RECV_BUF_SIZE);
+    _poll = _loop->resource<uvw::PollHandle>(_fd);
+    _poll->on<uvw::PollEvent>([this](const uvw::PollEvent &, uvw::PollHandle &) {
+        read();
+    });
+    _poll->on<uvw::ErrorEvent>([this](const uvw::ErrorEvent &, uvw::PollHandle &) {
+        if (_timestamps && _fd >= 0) {
+            // libuv stops polling on POLLERR, which also means send timestamps are queued
+            int err{0};
+            socklen_t err_len{sizeof(err)};
+            getsockopt(_fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+            if (err) {
+                _error();
+            }
+            _poll->start(uvw::PollHandle::Event::READABLE);
+            read();
+            return;
+        }
+        _error();
+    });
+    _poll->start(uvw::PollHandle::Event::READABLE);
+}
+
+void UDPSocket::close()
+{
+    if (_fd < 0) {
+        return;
+    }
+    // the poll handle must be done with the descriptor before it is closed
+    if (_poll) {
+        _poll->stop();
+        _poll->close();
+    }
+    ::close(_fd);
+    _fd = -1;
+}
+
+size_t UDPSocket::send(const char data[], size_t len, size_t seg_size)
+{
+    size_t sent = send_segments(data, len, seg_size);
+    _pending_tags = nullptr;
+    return sent;
+}
+
+size_t UDPSocket::send_segments(const char data[], size_t len, size_t seg_size)
+{
+    if (_fd < 0) {
+        return 0;
+    }
+    if (_gso && len > seg_size) {
+        if (send_gso(data, len, seg_size)) {
+            return (len + seg_size - 1) / seg_size;
+        }
+        if (!_gso) {
+            // gso was just found to be unusable, fall through to the plain path
+            return send_mmsg(data, len, seg_size);
+        }
+        return 0;
+    }
+    return send_mmsg(data, len, seg_size);
+}
+
+bool UDPSocket::send_gso(const char data[], size_t len, size_t seg_size)
+{
+#ifdef UDP_SEGMENT
+    iovec iov{const_cast<char *>(data), len};
+    char control[CMSG_SPACE(sizeof(uint16_t))] = {0};
+
+    msghdr msg{};
+    msg.msg_name = msg_name();
+    msg.msg_namelen = msg_namelen();
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_UDP;
+    cm->cmsg_type = UDP_SEGMENT;
+    cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    uint16_t seg = seg_size;
+    memcpy(CMSG_DATA(cm), &seg, sizeof(seg));
+
+    if (sendmsg(_fd, &msg, 0) >= 0) {
+        return true;
+    }
+    if (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP) {
+        // device or route can't segment (e.g. no checksum offload): stop trying
+        _gso = false;
+    } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        _error();
+    }
+#endif
+    return false;
+}
+
+size_t UDPSocket::send_mmsg(const char data[], size_t len, size_t seg_size)
+{
+    size_t count = (len + seg_size - 1) / seg_size;
+    iovec iov[MAX_GSO_SEGMENTS];
+    mmsghdr msgs[MAX_GSO_SEGMENTS];
+    memset(msgs, 0, sizeof(mmsghdr) * count);
+    for (size_t i = 0; i < count; i++) {
+        iov[i].iov_base = const_cast<char *>(data + i * seg_size);
+        iov[i].iov_len = std::min(seg_size, len - i * seg_size);
+        msgs[i].msg_hdr.msg_name = msg_name();
+        msgs[i].msg_hdr.msg_namelen = msg_namelen();
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+#ifdef __linux__
+    int sent = sendmmsg(_fd, msgs, count, 0);
+#else
+    int sent = 0;
+    for (; static_cast<size_t>(sent) < count; sent++) {
+        if (sendmsg(_fd, &msgs[sent].msg_hdr, 0) < 0) {
+            break;
+        }
+    }
+    if (sent == 0 && count) {
+        sent = -1;
+    }
+#endif
+    if (sent < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            _error();
+        }
+        return 0;
+    }
+    // fewer than count if the socket buffer filled up part way
+    tag_sent(sent);
+    return sent;
+}
+
+void UDPSocket::read()
+{
+    if (_timestamps) {
+        // send timestamps first, so they're in before the responses
+        read_tx_times();
+    }
+    char control[CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(timespec) * 3)];
+    iovec iov{_recv_buf.get(), RECV_BUF_SIZE};
+
+    for (int i = 0; i < MAX_READS_PER_EVENT && _fd >= 0; i++) {
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t len = recvmsg(_fd, &msg, 0);
+        if (len < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                _error();
+            }
+            return;
+        }
+
+        // a GRO read holds several datagrams of gso_size bytes, the last may be shorter
+        size_t gso_size = len;
+        for (cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+#ifdef UDP_GRO
+            if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+                int size;
+                memcpy(&size, CMSG_DATA(cm), sizeof(size));
+                if (size > 0) {
+                    gso_size = size;
+                }
+            }
+#endif
+#ifdef HAVE_TIMESTAMPING
+            if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPING) {
+                _rx = timestamp(CMSG_DATA(cm));
+                _rx_valid = true;
+            }
+#endif
+        }
+        for (size_t offset = 0; offset < static_cast<size_t>(len); offset += gso_size) {
+            _recv(_recv_buf.get() + offset, std::min(gso_size, len - offset));
+        }
+        _rx_valid = false;
+    }
+}
@@ -0,0 +1,187 @@
+// Copyright 2019 NSONE, Inc
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sys/socket.h>
+
+#include <uvw.hpp>
+
+// libuv can connect UDP handles since 1.27
+#if UV_VERSION_HEX >= 0x011b00
+#define HAVE_UV_UDP_CONNECT
+#endif
+
+/**
+ * A UDP socket driven directly with sendmsg/recvmsg from a uvw poll handle, for sending
+ * modes libuv's UDP handle does not expose: segmentation offload (UDP_SEGMENT, "GSO") on
+ * send and receive coalescing (UDP_GRO), and kernel timestamps (SO_TIMESTAMPING).
+ */
+class UDPSocket
+{
+public:
+    /**
+     * When the kernel sent or received a datagram: in software, on the high resolution clock so it
+     * compares with user space times, and by the NIC where it timestamps in hardware, on its own
+     * clock. Either is zero if not taken.
+     */
+    struct Timestamp {
+        std::chrono::high_resolution_clock::time_point software;
+        std::chrono::nanoseconds hardware{0};
+    };
+
+    using recv_cb = std::function<void(const char data[], size_t len)>;
+    using error_cb = std::function<void()>;
+    // the kernel's send timestamp of the datagram tagged tag by tx_tags()
+    using tx_time_cb = std::function<void(uint16_t tag, const Timestamp &ts)>;
+
+    // most segments the kernel accepts in one GSO send
+    static const size_t MAX_GSO_SEGMENTS = 64;
+    // largest UDP payload, and so the largest GSO send
+    static const size_t MAX_GSO_SIZE = 65507;
+
+    /**
+     * @param family AF_INET or AF_INET6
+     * @param target_address address all datagrams are sent to
+     * @param gro enable receive coalescing, if the kernel supports it
+     */
+    UDPSocket(std::shared_ptr<uvw::Loop> loop, int family, const std::string &target_address, unsigned int port, bool gro);
+    virtual ~UDPSocket();
+
+    // local (source) port
+    unsigned int port() const;
+
+    // whether the kernel supports segmentation offload on this socket
+    bool gso() const
+    {
+        return _gso;
+    }
+
+    bool gro() const
+    {
+        return _gro;
+    }
+
+    /**
+     * Have the kernel timestamp every datagram sent and received, in software and in hardware where
+     * the NIC has been set up for it. Send timestamps are handed to the tx time callback, receive
+     * timestamps are at rx_timestamp() during the recv callback. Turns off GSO and GRO, as the
+     * kernel stamps a GSO send or a coalesced read once. Linux only, returns false elsewhere or if
+     * the kernel refuses. Call before start().
+     */
+    bool timestamps();
+
+    // re-read the system clock's offset from the high resolution clock, which kernel software
+    // timestamps are converted with. call now and then, as the system clock is slewed (NTP).
+    void sync_clock();
+
+    // tags for the datagrams of the next send(), one each, for their send timestamps
+    void tx_tags(const std::vector<uint16_t> &tags)
+    {
+        _pending_tags = &tags;
+    }
+
+    // receive timestamp of the datagram the recv callback is handling, null if it has none
+    const Timestamp *rx_timestamp() const
+    {
+        return _rx_valid ? &_rx : nullptr;
+    }
+
+    /**
+     * Connect to the target: sends then carry no address, sparing the kernel a route lookup per
+     * datagram, and datagrams from any other source are dropped. Call before start().
+     */
+    bool connect();
+
+    /**
+     * Send len bytes as datagrams of seg_size bytes each (the last may be shorter). Uses one GSO send
+     * where supported, otherwise one sendmmsg. Returns the number of datagrams sent, the first ones:
+     * fewer than all, or none, when the socket buffer fills up.
+     */
+    virtual size_t send(const char data[], size_t len, size_t seg_size);
+
+    // push out sends that are queued rather than sent immediately, call after a batch of send().
+    // returns whether that took a syscall.
+    virtual bool flush()
+    {
+        return false;
+    }
+
+    virtual void start();
+    virtual void close();
+
+    void on_recv(recv_cb handler)
+    {
+        _recv = std::move(handler);
+    }
+
+    void on_error(error_cb handler)
+    {
+        _error = std::move(handler);
+    }
+
+    void on_tx_time(tx_time_cb handler)
+    {
+        _tx_time = std::move(handler);
+    }
+
+protected:
+    std::shared_ptr<uvw::Loop> _loop;
+    int _fd{-1};
+    bool _gso{false};
+    bool _gro{false};
+    sockaddr_storage _target{};
+    socklen_t _target_len{0};
+    bool _connected{false};
+
+    // destination for a msghdr: none once connected
+    void *msg_name()
+    {
+        return _connected ? nullptr : &_target;
+    }
+    socklen_t msg_namelen() const
+    {
+        return _connected ? 0 : _target_len;
+    }
+
+    recv_cb _recv;
+    error_cb _error;
+    tx_time_cb _tx_time;
+
+private:
+    std::shared_ptr<uvw::PollHandle> _poll;
+    std::unique_ptr<char[]> _recv_buf;
+
+    // SO_TIMESTAMPING: kernel key of the next datagram sent, the tags of datagrams sent that are
+    // waiting for their timestamps by key, and the tags of the send being made
+    bool _timestamps{false};
+    uint32_t _tx_key{0};
+    std::deque<std::pair<uint32_t, uint16_t>> _tx_waiting;
+    // one per DNS id, at most that many can be in flight
+    static const size_t MAX_TX_WAITING = 65536;
+    const std::vector<uint16_t> *_pending_tags{nullptr};
+    // high resolution clock time at the system clock's epoch, to convert kernel times
+    std::chrono::high_resolution_clock::duration _clock_offset{0};
+    // timestamp of the datagram being received
+    Timestamp _rx;
+    bool _rx_valid{false};
+
+    size_t send_segments(const char data[], size_t len, size_t seg_size);
+    bool send_gso(const char data[], size_t len, size_t seg_size);
+    // fallback, one sendmmsg for all segments
+    size_t send_mmsg(const char data[], size_t len, size_t seg_size);
+    void read();
+    // note the timestamp keys of the datagrams just sent
+    void tag_sent(size_t datagrams);
+    // hand out the send timestamps on the error queue
+    void read_tx_times();
+    Timestamp timestamp(const void *scm_timestamping) const;
+};
@@ -0,0 +1,471 @@
+// Copyright 2019 NSONE, Inc
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+// how long an idle SQPOLL thread spins before it sleeps and needs a wakeup
+static const unsigned int SQPOLL_IDLE_MS = 1000;
+
+static int sys_io_uring_setup(unsigned int entries, io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, const void *arg, unsigned int nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+template <typename T>
+static T *ring_ptr(void *base, uint32_t offset)
+{
+    return reinterpret_cast<T *>(static_cast<char *>(base) + offset);
+}
+
+IOUring::IOUring(std::shared_ptr<uvw::Loop> loop, unsigned int entries, bool sqpoll)
+    : _sqpoll(sqpoll)
+{
+    io_uring_params p{};
+    if (sqpoll) {
+        p.flags |= IORING_SETUP_SQPOLL;
+        p.sq_thread_idle = SQPOLL_IDLE_MS;
+    }
+    _fd = sys_io_uring_setup(entries, &p);
+    if (_fd < 0) {
+        throw std::runtime_error(std::string("unable to create io_uring: ") + strerror(errno));
+    }
+
+    _sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    _cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        _sq_size = _cq_size = std::max(_sq_size, _cq_size);
+    }
+    _sq_ptr = mmap(nullptr, _sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+    if (_sq_ptr == MAP_FAILED) {
+        _sq_ptr = nullptr;
+        release();
+        throw std::runtime_error("unable to map io_uring submission queue");
+    }
+    if (single_mmap) {
+        _cq_ptr = _sq_ptr;
+    } else {
+        _cq_ptr = mmap(nullptr, _cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_CQ_RING);
+        if (_cq_ptr == MAP_FAILED) {
+            _cq_ptr = nullptr;
+            release();
+            throw std::runtime_error("unable to map io_uring completion queue");
+        }
+    }
+    _sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+    void *sqes = mmap(nullptr, _sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        release();
+        throw std::runtime_error("unable to map io_uring submission entries");
+    }
+    _sqes = static_cast<io_uring_sqe *>(sqes);
+
+    _sq_head = ring_ptr<unsigned>(_sq_ptr, p.sq_off.head);
+    _sq_tail = ring_ptr<unsigned>(_sq_ptr, p.sq_off.tail);
+    _sq_flags = ring_ptr<unsigned>(_sq_ptr, p.sq_off.flags);
+    _sq_array = ring_ptr<unsigned>(_sq_ptr, p.sq_off.array);
+    _sq_mask = *ring_ptr<unsigned>(_sq_ptr, p.sq_off.ring_mask);
+    _sq_entries = p.sq_entries;
+    _sq_local_tail = _sq_submitted = *_sq_tail;
+
+    _cq_head = ring_ptr<unsigned>(_cq_ptr, p.cq_off.head);
+    _cq_tail = ring_ptr<unsigned>(_cq_ptr, p.cq_off.tail);
+    _cq_mask = *ring_ptr<unsigned>(_cq_ptr, p.cq_off.ring_mask);
+    _cqes = ring_ptr<io_uring_cqe>(_cq_ptr, p.cq_off.cqes);
+
+    try {
+        setup_buffers();
+    } catch (const std::runtime_error &) {
+        release();
+        throw;
+    }
+
+    // completions are signalled here, so the ring can be watched by the event loop
+    _event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (_event_fd < 0 || sys_io_uring_register(_fd, IORING_REGISTER_EVENTFD, &_event_fd, 1) != 0) {
+        release();
+        throw std::runtime_error(std::string("unable to register io_uring eventfd: ") + strerror(errno));
+    }
+    _poll = loop->resource<uvw::PollHandle>(_event_fd);
+    _poll->on<uvw::PollEvent>([this](const uvw::PollEvent &, uvw::PollHandle &) {
+        uint64_t count;
+        while (read(_event_fd, &count, sizeof(count)) > 0) {
+        }
+        drain();
+    });
+    _poll->start(uvw::PollHandle::Event::READABLE);
+}
+
+IOUring::~IOUring()
+{
+    release();
+}
+
+void IOUring::release()
+{
+    if (_buf_ring) {
+        munmap(_buf_ring, _buf_ring_size);
+        _buf_ring = nullptr;
+    }
+    if (_sqes) {
+        munmap(_sqes, _sqes_size);
+        _sqes = nullptr;
+    }
+    if (_cq_ptr && _cq_ptr != _sq_ptr) {
+        munmap(_cq_ptr, _cq_size);
+    }
+    _cq_ptr = nullptr;
+    if (_sq_ptr) {
+        munmap(_sq_ptr, _sq_size);
+        _sq_ptr = nullptr;
+    }
+    if (_event_fd >= 0) {
+        close(_event_fd);
+        _event_fd = -1;
+    }
+    if (_fd >= 0) {
+        close(_fd);
+        _fd = -1;
+    }
+}
+
+void IOUring::setup_buffers()
+{
+    _bufs = std::make_unique<char[]>(static_cast<size_t>(BUFFER_COUNT) * RECV_BUF_SIZE);
+
+    // the ring must be page aligned
+    _buf_ring_size = BUFFER_COUNT * sizeof(io_uring_buf);
+    void *mem = mmap(nullptr, _buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        throw std::runtime_error("unable to allocate io_uring buffer ring");
+    }
+    _buf_ring = static_cast<io_uring_buf_ring *>(mem);
+
+    io_uring_buf_reg reg{};
+    reg.ring_addr = reinterpret_cast<uint64_t>(mem);
+    reg.ring_entries = BUFFER_COUNT;
+    reg.bgid = BUFFER_GROUP;
+    if (sys_io_uring_register(_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        throw std::runtime_error("io_uring provided buffer rings are not supported, Linux 5.19+ is required");
+    }
+    for (unsigned int i = 0; i < BUFFER_COUNT; i++) {
+        recycle_buffer(i);
+    }
+}
+
+void IOUring::recycle_buffer(uint16_t bid)
+{
+    // not _buf_ring->bufs: in C++ the kernel header's flex array wrapper has a one byte empty
+    // struct in front of it, which misplaces the array. only addr, len and bid are written, the
+    // resv field of the first entry is the ring tail.
+    io_uring_buf *buf = reinterpret_cast<io_uring_buf *>(_buf_ring) + (_buf_local_tail & (BUFFER_COUNT - 1));
+    buf->addr = reinterpret_cast<uint64_t>(buffer(bid));
+    buf->len = RECV_BUF_SIZE;
+    buf->bid = bid;
+    _buf_local_tail++;
+    __atomic_store_n(&_buf_ring->tail, _buf_local_tail, __ATOMIC_RELEASE);
+}
+
+io_uring_sqe *IOUring::get_sqe()
+{
+    if (!reserve(1)) {
+        return nullptr;
+    }
+    unsigned int index = _sq_local_tail & _sq_mask;
+    io_uring_sqe *sqe = &_sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    _sq_array[index] = index;
+    _sq_local_tail++;
+    return sqe;
+}
+
+bool IOUring::reserve(unsigned int count)
+{
+    if (_sq_local_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) + count <= _sq_entries) {
+        return true;
+    }
+    submit();
+    return _sq_local_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) + count <= _sq_entries;
+}
+
+bool IOUring::submit()
+{
+    if (_sq_local_tail != _sq_submitted) {
+        __atomic_store_n(_sq_tail, _sq_local_tail, __ATOMIC_RELEASE);
+        _sq_submitted = _sq_local_tail;
+    }
+    if (_sqpoll) {
+        // the kernel thread picks up the new tail by itself, unless it went to sleep. a wakeup
+        // submits nothing, the thread does.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (__atomic_load_n(_sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP) {
+            sys_io_uring_enter(_fd, 0, 0, IORING_ENTER_SQ_WAKEUP);
+        }
+        return false;
+    }
+    // entries the kernel has not consumed yet, including any left by a failed enter
+    unsigned int to_submit = _sq_local_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+    if (!to_submit) {
+        return false;
+    }
+    sys_io_uring_enter(_fd, to_submit, 0, 0);
+    return true;
+}
+
+void IOUring::drain()
+{
+    unsigned int head = *_cq_head;
+    while (true) {
+        unsigned int tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            break;
+        }
+        for (; head != tail; head++) {
+            // copy out: the handler may free its request, or queue more work
+            io_uring_cqe cqe = _cqes[head & _cq_mask];
+            __atomic_store_n(_cq_head, head + 1, __ATOMIC_RELEASE);
+            if (cqe.user_data) {
+                reinterpret_cast<IOUringRequest *>(cqe.user_data)->complete(cqe);
+            }
+        }
+    }
+    // handlers may have rearmed requests
+    submit();
+}
+
+void IOUring::attach()
+{
+    _users++;
+}
+
+void IOUring::detach()
+{
+    if (--_users == 0 && _poll) {
+        _poll->stop();
+        _poll->close();
+    }
+}
+
+UringUDPSocket::UringUDPSocket(std::shared_ptr<uvw::Loop> loop, std::shared_ptr<IOUring> ring, int family,
+    const std::string &target_address, unsigned int port, bool gso)
+    : UDPSocket(loop, family, target_address, port, false)
+    , _ring(ring)
+{
+    _gso = _gso && gso;
+}
+
+UringUDPSocket::~UringUDPSocket()
+{
+    close();
+}
+
+void UringUDPSocket::RecvRequest::complete(const io_uring_cqe &cqe)
+{
+    if (!(cqe.flags & IORING_CQE_F_MORE)) {
+        armed = false;
+    }
+    if (socket) {
+        socket->received(cqe);
+        return;
+    }
+    // orphaned by close(): give back what the kernel picked, and go with the final completion
+    if (cqe.flags & IORING_CQE_F_BUFFER) {
+        ring->recycle_buffer(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+    }
+    if (!armed) {
+        ring->detach();
+        delete this;
+    }
+}
+
+void UringUDPSocket::SendRequest::complete(const io_uring_cqe &cqe)
+{
+    if (socket) {
+        socket->sent(this, cqe);
+    } else if (--pending == 0) {
+        ring->detach();
+        delete this;
+    }
+}
+
+void UringUDPSocket::start()
+{
+    _ring->attach();
+    _started = true;
+    _recv_req = new RecvRequest();
+    _recv_req->socket = this;
+    _recv_req->ring = _ring.get();
+    arm_recv();
+    _ring->submit();
+}
+
+void UringUDPSocket::close()
+{
+    if (_fd < 0) {
+        return;
+    }
+    if (_started) {
+        // the armed recv holds its own reference to the socket, closing the descriptor won't end it.
+        // it and the sends still queued complete later, on their own.
+        if (_recv_req->armed) {
+            io_uring_sqe *sqe = _ring->get_sqe();
+            if (sqe) {
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->addr = reinterpret_cast<uint64_t>(static_cast<IOUringRequest *>(_recv_req));
+            }
+            _recv_req->socket = nullptr;
+            _ring->attach();
+        } else {
+            delete _recv_req;
+        }
+        _recv_req = nullptr;
+        for (auto req : _sends) {
+            req->socket = nullptr;
+            _ring->attach();
+        }
+        _sends.clear();
+        _ring->submit();
+        _ring->detach();
+        _started = false;
+    }
+    UDPSocket::close();
+}
+
+void UringUDPSocket::arm_recv()
+{
+    io_uring_sqe *sqe = _ring->get_sqe();
+    if (!sqe) {
+        _error();
+        return;
+    }
+    // one request for all datagrams, each completion picks a buffer from the ring
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = _fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = _ring->buffer_group();
+    sqe->user_data = reinterpret_cast<uint64_t>(static_cast<IOUringRequest *>(_recv_req));
+    _recv_req->armed = true;
+}
+
+void UringUDPSocket::received(const io_uring_cqe &cqe)
+{
+    if (cqe.flags & IORING_CQE_F_BUFFER) {
+        uint16_t bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe.res > 0 && _fd >= 0) {
+            _recv(_ring->buffer(bid), cqe.res);
+        }
+        _ring->recycle_buffer(bid);
+    } else if (cqe.res < 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED) {
+        // e.g. EINVAL from a kernel without multishot recv (< 6.0): don't spin rearming
+        _error();
+        return;
+    }
+    // the kernel ends a multishot request when it runs out of buffers, start a new one
+    if (!(cqe.flags & IORING_CQE_F_MORE) && _fd >= 0) {
+        arm_recv();
+    }
+}
+
+size_t UringUDPSocket::send(const char data[], size_t len, size_t seg_size)
+{
+    if (_fd < 0 || _sends.size() >= MAX_SENDS_IN_FLIGHT) {
+        return 0;
+    }
+    bool gso = _gso && len > seg_size;
+    size_t datagrams = (len + seg_size - 1) / seg_size;
+    size_t count = gso ? 1 : datagrams;
+    if (!_ring->reserve(count)) {
+        return 0;
+    }
+
+    auto req = new SendRequest();
+    req->socket = this;
+    req->ring = _ring.get();
+    req->gso = gso;
+    req->data = std::make_unique<char[]>(len);
+    memcpy(req->data.get(), data, len);
+    req->target = _target;
+    req->iov.resize(count);
+    req->msg.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        size_t offset = gso ? 0 : i * seg_size;
+        req->iov[i].iov_base = req->data.get() + offset;
+        req->iov[i].iov_len = gso ? len : std::min(seg_size, len - offset);
+        msghdr &msg = req->msg[i];
+        msg = {};
+        msg.msg_name = msg_name() ? &req->target : nullptr;
+        msg.msg_namelen = msg_namelen();
+        msg.msg_iov = &req->iov[i];
+        msg.msg_iovlen = 1;
+    }
+#ifdef UDP_SEGMENT
+    if (gso) {
+        msghdr &msg = req->msg[0];
+        memset(req->control, 0, sizeof(req->control));
+        msg.msg_control = req->control;
+        msg.msg_controllen = sizeof(req->control);
+        cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        uint16_t seg = seg_size;
+        memcpy(CMSG_DATA(cm), &seg, sizeof(seg));
+    }
+#endif
+
+    for (size_t i = 0; i < count; i++) {
+        io_uring_sqe *sqe = _ring->get_sqe();
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = _fd;
+        sqe->addr = reinterpret_cast<uint64_t>(&req->msg[i]);
+        sqe->len = 1;
+        sqe->user_data = reinterpret_cast<uint64_t>(static_cast<IOUringRequest *>(req));
+    }
+    req->pending = count;
+    _sends.insert(req);
+    return datagrams;
+}
+
+void UringUDPSocket::sent(SendRequest *req, const io_uring_cqe &cqe)
+{
+    if (cqe.res < 0) {
+        int err = -cqe.res;
+        if (req->gso && (err == EIO || err == EINVAL || err == ENOPROTOOPT || err == EOPNOTSUPP)) {
+            // device or route can't segment: later sends go one datagram per SQE
+            _gso = false;
+        }
+        _error();
+    }
+    if (--req->pending == 0) {
+        _sends.erase(req);
+        delete req;
+    }
+}
+
+bool UringUDPSocket::flush()
+{
+    return _ring->submit();
+}
@@ -0,0 +1,199 @@
+// Copyright 2019 NSONE, Inc
+
+#pragma once
+
+#include <memory>
+#include <unordered_set>
+#include <vector>
+
+#include <uvw.hpp>
+
+#include "udpsocket.h"
+
+// after uvw: linux/fs.h defines FICLONE, which collides with uvw's copy file flags
+#include <linux/io_uring.h>
+
+/**
+ * A request in flight on an IOUring. The user_data of every SQE points at one of these,
+ * and its completions are handed back to it.
+ */
+class IOUringRequest
+{
+public:
+    virtual ~IOUringRequest() = default;
+    virtual void complete(const io_uring_cqe &cqe) = 0;
+};
+
+/**
+ * A minimal io_uring, driven with raw syscalls (no liburing). Completions are signalled on an
+ * eventfd, which a uvw poll handle watches, so the ring runs inside the normal event loop next
+ * to libuv's own handles. Receive buffers come from one provided buffer ring shared by all
+ * requests on the ring.
+ */
+class IOUring
+{
+public:
+    // size of each provided receive buffer: the largest response we expect to see
+    static const unsigned int RECV_BUF_SIZE = 4096;
+    // submission queue size, enough for every generator's batch between submits
+    static const unsigned int DEFAULT_ENTRIES = 4096;
+
+    /**
+     * @param entries submission queue size, rounded up to a power of two by the kernel
+     * @param sqpoll let a kernel thread poll the submission queue, so submitting needs no syscall
+     */
+    IOUring(std::shared_ptr<uvw::Loop> loop, unsigned int entries, bool sqpoll);
+    ~IOUring();
+
+    // a zeroed SQE, submitting pending ones if the queue is full. null if it is still full.
+    io_uring_sqe *get_sqe();
+
+    // make room for count SQEs, so that many get_sqe() calls will succeed
+    bool reserve(unsigned int count);
+
+    // hand queued SQEs to the kernel, returns whether that took a syscall to submit them. with
+    // SQPOLL the kernel thread submits, waking it up isn't counted.
+    bool submit();
+
+    bool sqpoll() const
+    {
+        return _sqpoll;
+    }
+
+    // buffer group for IOSQE_BUFFER_SELECT requests
+    uint16_t buffer_group() const
+    {
+        return BUFFER_GROUP;
+    }
+
+    const char *buffer(uint16_t bid) const
+    {
+        return _bufs.get() + static_cast<size_t>(bid) * RECV_BUF_SIZE;
+    }
+
+    // give a selected buffer back to the kernel
+    void recycle_buffer(uint16_t bid);
+
+    // users of the ring register here so the poll handle can be closed with the last of them,
+    // letting the loop exit. requests outliving their socket are users until their last completion.
+    void attach();
+    void detach();
+
+private:
+    static const uint16_t BUFFER_GROUP = 0;
+    static const unsigned int BUFFER_COUNT = 4096;
+
+    int _fd{-1};
+    int _event_fd{-1};
+    bool _sqpoll;
+    std::shared_ptr<uvw::PollHandle> _poll;
+    long _users{0};
+
+    // mmaped rings
+    void *_sq_ptr{nullptr};
+    size_t _sq_size{0};
+    void *_cq_ptr{nullptr};
+    size_t _cq_size{0};
+    io_uring_sqe *_sqes{nullptr};
+    size_t _sqes_size{0};
+
+    unsigned *_sq_head;
+    unsigned *_sq_tail;
+    unsigned *_sq_flags;
+    unsigned *_sq_array;
+    unsigned _sq_mask;
+    unsigned _sq_entries;
+    // our tail, published to the kernel on submit
+    unsigned _sq_local_tail{0};
+    unsigned _sq_submitted{0};
+
+    unsigned *_cq_head;
+    unsigned *_cq_tail;
+    unsigned _cq_mask;
+    io_uring_cqe *_cqes;
+
+    // provided buffer ring and the buffers it hands out
+    io_uring_buf_ring *_buf_ring{nullptr};
+    size_t _buf_ring_size{0};
+    uint16_t _buf_local_tail{0};
+    std::unique_ptr<char[]> _bufs;
+
+    void setup_buffers();
+    void drain();
+    // unmap and close everything, also used to unwind a failed constructor
+    void release();
+};
+
+/**
+ * UDPSocket with its i/o on an IOUring: one multishot recv on the provided buffer ring stays armed
+ * for all responses, and sends are queued as SQEs and submitted together on flush(). GSO sends work
+ * as on UDPSocket, receive coalescing (GRO) is not used.
+ */
+class UringUDPSocket : public UDPSocket
+{
+public:
+    /**
+     * @param gso use segmentation offload for sends, if the kernel supports it
+     */
+    UringUDPSocket(std::shared_ptr<uvw::Loop> loop, std::shared_ptr<IOUring> ring, int family,
+        const std::string &target_address, unsigned int port, bool gso);
+    ~UringUDPSocket();
+
+    /**
+     * Queue len bytes as datagrams of seg_size bytes each, as one GSO send where supported,
+     * otherwise one SQE per datagram. The data is copied. Returns the number of datagrams queued,
+     * all of them, or none if the ring or the limit on sends in flight is full.
+     */
+    size_t send(const char data[], size_t len, size_t seg_size) override;
+    bool flush() override;
+
+    void start() override;
+    void close() override;
+
+private:
+    /**
+     * The kernel may complete requests after the socket is closed (the cancelled recv, sends still
+     * queued), so requests are allocated apart from it. On close the socket lets go of them: socket
+     * is cleared, and each frees itself on its last completion.
+     */
+    class RecvRequest : public IOUringRequest
+    {
+    public:
+        UringUDPSocket *socket;
+        IOUring *ring;
+        // whether the kernel has it, until a completion without IORING_CQE_F_MORE
+        bool armed{false};
+        void complete(const io_uring_cqe &cqe) override;
+    };
+
+    // one send() call: a copy of the data and target and a msghdr per SQE, freed when the last
+    // SQE completes
+    class SendRequest : public IOUringRequest
+    {
+    public:
+        UringUDPSocket *socket;
+        IOUring *ring;
+        bool gso{false};
+        std::unique_ptr<char[]> data;
+        sockaddr_storage target;
+        std::vector<iovec> iov;
+        std::vector<msghdr> msg;
+        char control[CMSG_SPACE(sizeof(uint16_t))];
+        size_t pending{0};
+        void complete(const io_uring_cqe &cqe) override;
+    };
+
+    // bound on send() calls awaiting completion
+    static const size_t MAX_SENDS_IN_FLIGHT = 1024;
+
+    std::shared_ptr<IOUring> _ring;
+    // null once closed, when it may still complete
+    RecvRequest *_recv_req{nullptr};
+    // send() calls awaiting completion
+    std::unordered_set<SendRequest *> _sends;
+    bool _started{false};
+
+    void arm_recv();
+    void received(const io_uring_cqe &cqe);
+    void sent(SendRequest *req, const io_uring_cqe &cqe);
+};
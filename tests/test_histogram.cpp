@@ -0,0 +1,40 @@
+#include <catch2/catch.hpp>
+
+#include <cstdint>
+
+#include "histogram.h"
+
+TEST_CASE("LatencyHistogram keeps a recorded 0 as the min", "[histogram]")
+{
+    LatencyHistogram h;
+    h.record(0);
+    h.record(500);
+    CHECK(h.min() == 0);
+    CHECK(h.max() == 500);
+
+    LatencyHistogram later;
+    later.record(700);
+    later.record(0);
+    CHECK(later.min() == 0);
+
+    LatencyHistogram merged;
+    merged.record(300);
+    merged.merge(h);
+    CHECK(merged.min() == 0);
+}
+
+TEST_CASE("LatencyHistogram reads values back to within half a bucket", "[histogram]")
+{
+    for (uint64_t v = 1; v < LatencyHistogram::MAX_VALUE; v = v * 3 + 7) {
+        LatencyHistogram h;
+        // min and max clamp the percentile, keep them out of the way
+        h.record(0);
+        h.record(v);
+        h.record(v);
+        h.record(LatencyHistogram::MAX_VALUE);
+        uint64_t p = h.percentile(50);
+        double error = (p > v ? p - v : v - p) / static_cast<double>(v);
+        INFO("value " << v << " read back as " << p);
+        CHECK(error <= 1.0 / 128);
+    }
+}
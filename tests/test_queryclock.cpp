@@ -0,0 +1,54 @@
+#include <catch2/catch.hpp>
+
+#include <chrono>
+#include <cstdint>
+
+#include "queryclock.h"
+
+using namespace std::chrono;
+
+TEST_CASE("QueryClock stamps wrap and differences span the wrap", "[queryclock]")
+{
+    QueryClock::clock::time_point base{};
+    QueryClock qc(base);
+
+    // 2^32 ticks of 16 ns is about 68.7 s: a stamp just past it wraps around to a small value
+    auto wrap = nanoseconds(static_cast<int64_t>(1) << (32 + QueryClock::TICK_BITS));
+    uint32_t early = qc.stamp(base + wrap - microseconds(1));
+    uint32_t late = qc.stamp(base + wrap + microseconds(1));
+    CHECK(late < early);
+
+    CHECK(QueryClock::between(early, late) == nanoseconds(2000));
+    CHECK(QueryClock::after(early, late) == nanoseconds(2000));
+    CHECK(QueryClock::before(early, late));
+    CHECK(!QueryClock::before(late, early));
+}
+
+TEST_CASE("QueryClock after clamps a later from at 0", "[queryclock]")
+{
+    QueryClock::clock::time_point base{};
+    QueryClock qc(base);
+
+    uint32_t sent = qc.stamp(base + seconds(1));
+    uint32_t kernel = qc.stamp(base + seconds(1) - microseconds(5));
+    CHECK(QueryClock::after(sent, kernel) == nanoseconds(0));
+    // between takes it the long way round instead
+    CHECK(QueryClock::between(sent, kernel) > seconds(60));
+    CHECK(QueryClock::before(kernel, sent));
+}
+
+TEST_CASE("QueryClock time recovers a stamp's time point to the tick", "[queryclock]")
+{
+    QueryClock::clock::time_point base{};
+    QueryClock qc(base);
+
+    auto sent = base + seconds(100) + nanoseconds(123456);
+    auto now = sent + seconds(QueryClock::MAX_AGE.count() - 1);
+    uint32_t s = qc.stamp(sent);
+
+    CHECK(qc.since(s, now) >= seconds(QueryClock::MAX_AGE.count() - 1));
+    CHECK(qc.since(s, now) < seconds(QueryClock::MAX_AGE.count() - 1) + nanoseconds(1 << QueryClock::TICK_BITS));
+    auto t = qc.time(s, now);
+    CHECK(t <= sent);
+    CHECK(sent - t < nanoseconds(1 << QueryClock::TICK_BITS));
+}
@@ -0,0 +1,58 @@
+#include <catch2/catch.hpp>
+
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "ratelimiter.h"
+
+TEST_CASE("RateLimiter burst covers the send delay", "[ratelimiter]")
+{
+    CHECK(RateLimiter::burst_for(std::chrono::milliseconds(1)) == RateLimiter::BURST);
+    CHECK(RateLimiter::burst_for(std::chrono::milliseconds(1000)) == std::chrono::seconds(1));
+}
+
+TEST_CASE("RateLimiter delivers the rate to a sender ticking every 1000 ms", "[ratelimiter]")
+{
+    const double qps = 10000;
+    auto limiter = std::make_shared<RateLimiter>(qps, RateLimiter::burst_for(std::chrono::milliseconds(1000)));
+    RateShard shard(limiter);
+
+    // -d 1000: one send a second, each asking for more than a second's worth
+    uint64_t sent{0};
+    auto start = RateLimiter::clock::now();
+    for (int tick = 0; tick < 2; tick++) {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        sent += shard.take(static_cast<uint64_t>(qps * 10));
+    }
+    double elapsed = std::chrono::duration<double>(RateLimiter::clock::now() - start).count();
+
+    CHECK(sent >= 0.95 * qps * 2);
+    CHECK(sent <= qps * elapsed + 1);
+}
+
+TEST_CASE("RateShards together hold at most one batch of the rate", "[ratelimiter]")
+{
+    const double qps = 100000;
+    auto limiter = std::make_shared<RateLimiter>(qps);
+    std::vector<std::unique_ptr<RateShard>> shards;
+    for (int i = 0; i < 100; i++) {
+        shards.push_back(std::make_unique<RateShard>(limiter));
+    }
+    CHECK(limiter->shards() == 100);
+
+    // fill the bucket, then have every shard take its first batch
+    std::this_thread::sleep_for(RateLimiter::BURST);
+    for (auto &shard : shards) {
+        CHECK(shard->take(1) == 1);
+    }
+
+    // the shards asked for 100 tokens, and hold about another 1 ms worth between them
+    double full = qps * std::chrono::duration<double>(RateLimiter::BURST).count();
+    double parked = qps * std::chrono::duration<double>(RateShard::BATCH).count();
+    CHECK(limiter->take(static_cast<uint64_t>(full)) >= full - 100 - parked - 1);
+
+    shards.clear();
+    CHECK(limiter->shards() == 0);
+}